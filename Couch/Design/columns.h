@@ -0,0 +1,385 @@
+#ifndef CPPCOUCH_COLUMNS_H
+#define CPPCOUCH_COLUMNS_H
+
+#include <limits>
+
+#include "viewstream.h"
+
+namespace couchdb
+{
+    /* column_extractor class - Extracts selected fields of view (or _all_docs) rows into typed columns.
+     *
+     * Each column is defined by a path into the row, e.g. "value.amount", "key[1]", or "doc.address.city", and a type.
+     * Rows are scanned in their raw JSON form, so no json::value is built, and each column is stored as a single
+     * contiguous array (real_column() and int_column() return plain arrays, ready to be aggregated in tight loops).
+     * The characters of all string columns are stored in one shared buffer, and each string column only stores offsets and lengths.
+     *
+     * If the path of a column does not exist in a row, or the value has the wrong type, the row's entry is NaN (for reals),
+     * 0 (for integers), or an empty string, and is_present() returns false. Integer columns truncate real values.
+     */
+
+    class column_extractor
+    {
+    public:
+        enum column_type
+        {
+            real_type,   // Stored as double
+            int_type,    // Stored as json::int_t
+            string_type  // Stored in the shared string buffer
+        };
+
+        column_extractor() : rows_(0) {}
+
+        // Adds a column with the specified path and type, and returns its index
+        // Columns must be added before any rows are extracted
+        size_t add_column(const std::string &path, column_type type)
+        {
+            if (rows_ > 0)
+                throw error(error::invalid_argument, "Columns cannot be added after rows have been extracted");
+
+            column col;
+            col.path = path;
+            col.type = type;
+            col.steps = parse_path(path);
+
+            columns_.push_back(col);
+            return columns_.size() - 1;
+        }
+
+        size_t add_real(const std::string &path) {return add_column(path, real_type);}
+        size_t add_int(const std::string &path) {return add_column(path, int_type);}
+        size_t add_string(const std::string &path) {return add_column(path, string_type);}
+
+        // Reserves space for the specified number of rows, and `string_bytes` characters of string data
+        void reserve(size_t rows, size_t string_bytes = 0)
+        {
+            for (column &col: columns_)
+            {
+                col.present.reserve(rows);
+                switch (col.type)
+                {
+                    case real_type: col.reals.reserve(rows); break;
+                    case int_type: col.ints.reserve(rows); break;
+                    case string_type: col.offsets.reserve(rows); col.lengths.reserve(rows); break;
+                }
+            }
+
+            strings_.reserve(string_bytes);
+        }
+
+        // Removes all rows, keeping the columns and allocated storage
+        void clear()
+        {
+            for (column &col: columns_)
+            {
+                col.present.clear();
+                col.reals.clear();
+                col.ints.clear();
+                col.offsets.clear();
+                col.lengths.clear();
+            }
+
+            strings_.clear();
+            rows_ = 0;
+        }
+
+        // Extracts a single raw JSON row
+        // If the row cannot be decoded, the exception is rethrown and none of the row's values are kept
+        void add_row(string_ref row)
+        {
+            size_t string_size = strings_.size();
+
+            for (column &col: columns_)
+                col.found = false;
+
+            try
+            {
+                // Each member of the row is visited once, and the columns starting with it are resolved from there
+                raw_json::for_each_member(row, [&](string_ref key, string_ref value)
+                {
+                    for (column &col: columns_)
+                        if (!col.found && !col.steps[0].is_index && raw_json::string_equals(key, col.steps[0].name.data(), col.steps[0].name.size()))
+                            col.found = store(col, resolve(value, col.steps, 1));
+                    return true;
+                });
+
+                for (column &col: columns_)
+                    if (!col.found)
+                        store_missing(col);
+            }
+            catch (...)
+            {
+                // Columns stored before the failure would otherwise be one row ahead of the others
+                for (column &col: columns_)
+                {
+                    truncate(col.present, rows_);
+                    truncate(col.reals, rows_);
+                    truncate(col.ints, rows_);
+                    truncate(col.offsets, rows_);
+                    truncate(col.lengths, rows_);
+                }
+                strings_.resize(string_size);
+                throw;
+            }
+
+            ++rows_;
+        }
+
+        // Extracts all rows of a complete view response, and returns the number of rows extracted
+        size_t add_rows(string_ref body)
+        {
+            view_response_parser parser;
+            const char *begin, *end;
+            size_t count = 0;
+
+            parser.append(body.data(), body.size());
+
+            try
+            {
+                while (parser.next(begin, end))
+                {
+                    add_row(string_ref(begin, end));
+                    ++count;
+                }
+            }
+            catch (const error &e)
+            {
+                throw error(error::view_unavailable, e.reason());
+            }
+
+            if (!parser.finished() || !parser.error_name().empty())
+                throw error(error::view_unavailable, parser.error_reason());
+
+            return count;
+        }
+
+        // Extracts all remaining rows from a row source (e.g. a view_stream, view_pager, or view_scatter)
+        // Returns the number of rows extracted
+        template<typename source>
+        size_t add_rows_from(source &src)
+        {
+            view_row row;
+            size_t count = 0;
+
+            while (src.next(row))
+            {
+                add_row(row.raw());
+                ++count;
+            }
+
+            return count;
+        }
+
+        // Returns the number of rows extracted
+        size_t size() const {return rows_;}
+
+        // Returns the number of columns
+        size_t column_count() const {return columns_.size();}
+
+        // Returns the path and type of the specified column
+        const std::string &column_path(size_t col) const {return columns_.at(col).path;}
+        column_type get_column_type(size_t col) const {return columns_.at(col).type;}
+
+        // Returns true if the specified row has a value of the correct type for the specified column
+        bool is_present(size_t col, size_t row) const {return columns_[col].present[row] != 0;}
+
+        // Returns the values of a real or integer column, as an array of size() elements
+        const double *real_column(size_t col) const {return columns_[col].reals.data();}
+        const json::int_t *int_column(size_t col) const {return columns_[col].ints.data();}
+
+        // Returns the value of a string column in the specified row
+        // The returned reference is valid until more rows are extracted or the extractor is cleared
+        string_ref string_at(size_t col, size_t row) const
+        {
+            return string_ref(strings_.data() + columns_[col].offsets[row], columns_[col].lengths[row]);
+        }
+
+        // Returns the characters of all string columns
+        const std::string &string_data() const {return strings_;}
+
+    private:
+        struct path_step
+        {
+            bool is_index;
+            std::string name;
+            size_t index;
+        };
+
+        struct column
+        {
+            std::string path;
+            column_type type;
+            std::vector<path_step> steps;
+            bool found; // Whether the current row has a value for this column
+
+            std::vector<unsigned char> present;
+            std::vector<double> reals;
+            std::vector<json::int_t> ints;
+            std::vector<size_t> offsets; // Start of each string in the string buffer
+            std::vector<size_t> lengths;
+        };
+
+        // Parses paths like "value.amount" or "key[1]" into steps
+        static std::vector<path_step> parse_path(const std::string &path)
+        {
+            std::vector<path_step> steps;
+            size_t pos = 0;
+
+            while (pos < path.size())
+            {
+                path_step step;
+
+                if (path[pos] == '[')
+                {
+                    size_t close = path.find(']', pos);
+                    if (close == std::string::npos || close == pos + 1)
+                        throw error(error::invalid_argument, "Invalid column path: " + path);
+
+                    step.is_index = true;
+                    step.index = 0;
+                    for (size_t i = pos + 1; i < close; ++i)
+                    {
+                        if (!isdigit(static_cast<unsigned char>(path[i])))
+                            throw error(error::invalid_argument, "Invalid column path: " + path);
+                        step.index = step.index * 10 + (path[i] - '0');
+                    }
+
+                    pos = close + 1;
+                    if (pos < path.size() && path[pos] == '.')
+                        ++pos;
+                }
+                else
+                {
+                    size_t end = path.find_first_of(".[", pos);
+                    if (end == std::string::npos)
+                        end = path.size();
+                    if (end == pos)
+                        throw error(error::invalid_argument, "Invalid column path: " + path);
+
+                    step.is_index = false;
+                    step.name = path.substr(pos, end - pos);
+                    step.index = 0;
+
+                    pos = end;
+                    if (pos < path.size() && path[pos] == '.')
+                        ++pos;
+                }
+
+                steps.push_back(step);
+            }
+
+            if (steps.empty() || steps[0].is_index)
+                throw error(error::invalid_argument, "Invalid column path: " + path);
+
+            return steps;
+        }
+
+        // Returns the raw value at the remaining steps of the path, or an empty reference if it does not exist
+        static string_ref resolve(string_ref value, const std::vector<path_step> &steps, size_t first)
+        {
+            for (size_t i = first; i < steps.size() && !value.empty(); ++i)
+            {
+                const path_step &step = steps[i];
+                string_ref next;
+
+                if (step.is_index)
+                {
+                    size_t n = 0;
+                    raw_json::for_each_element(value, [&](string_ref element)
+                    {
+                        if (n++ < step.index)
+                            return true;
+
+                        next = element;
+                        return false;
+                    });
+                }
+                else
+                {
+                    raw_json::for_each_member(value, [&](string_ref k, string_ref v)
+                    {
+                        if (!raw_json::string_equals(k, step.name.data(), step.name.size()))
+                            return true;
+
+                        next = v;
+                        return false;
+                    });
+                }
+
+                value = next;
+            }
+
+            return value;
+        }
+
+        // Appends the raw value to the column, and returns false if it is missing or has the wrong type
+        bool store(column &col, string_ref raw)
+        {
+            if (raw.empty())
+                return false;
+
+            switch (col.type)
+            {
+                case real_type:
+                {
+                    double val;
+                    if (!raw_json::to_number(raw, val))
+                        return false;
+                    col.reals.push_back(val);
+                    break;
+                }
+                case int_type:
+                {
+                    json::int_t val;
+                    if (!raw_json::to_number(raw, val))
+                        return false;
+                    col.ints.push_back(val);
+                    break;
+                }
+                case string_type:
+                {
+                    if (raw[0] != '"')
+                        return false;
+
+                    size_t start = strings_.size();
+                    if (memchr(raw.data(), '\\', raw.size()) == NULL)
+                        strings_.append(raw.data() + 1, raw.size() - 2);
+                    else
+                        strings_ += raw_json::decode_string(raw);
+
+                    col.offsets.push_back(start);
+                    col.lengths.push_back(strings_.size() - start);
+                    break;
+                }
+            }
+
+            col.present.push_back(1);
+            return true;
+        }
+
+        template<typename T>
+        static void truncate(std::vector<T> &values, size_t size)
+        {
+            if (values.size() > size)
+                values.resize(size);
+        }
+
+        void store_missing(column &col)
+        {
+            switch (col.type)
+            {
+                case real_type: col.reals.push_back(std::numeric_limits<double>::quiet_NaN()); break;
+                case int_type: col.ints.push_back(0); break;
+                case string_type: col.offsets.push_back(strings_.size()); col.lengths.push_back(0); break;
+            }
+
+            col.present.push_back(0);
+        }
+
+        std::vector<column> columns_;
+        std::string strings_;
+        size_t rows_;
+    };
+}
+
+#endif // CPPCOUCH_COLUMNS_H
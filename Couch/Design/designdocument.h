@@ -10,6 +10,13 @@ namespace couchdb
     /* DesignDocument class - provides a thin wrapper on top of a normal document for design document
      * methods.
      *
+     * The body of the design document is downloaded once per revision and cached, so the getters do not
+     * make any requests after the first. Use refresh() to load the latest revision. The setters modify the
+     * cached body and save it with a single PUT, which fails with error::document_conflict if the design
+     * document was changed by someone else since it was loaded. Use begin_batch() and commit() to save
+     * several changes with one PUT. Changes that could not be saved are kept until commit() saves them
+     * or refresh() discards them.
+     *
      * UNTESTED
      */
 
@@ -28,6 +35,17 @@ namespace couchdb
         design_document(std::shared_ptr<base> _comm, const std::string &_db,
                    const std::string &_id, const std::string &_rev)
             : document<http_client>(_comm, _db, _id, _rev)
+            , cached_(false)
+            , batching_(false)
+            , modified_(false)
+        {}
+        design_document(std::shared_ptr<base> _comm, const std::string &_db,
+                   const std::string &_id, const std::string &_rev, const json::value &body)
+            : document<http_client>(_comm, _db, _id, _rev)
+            , body_(body)
+            , cached_(body.is_object())
+            , batching_(false)
+            , modified_(false)
         {}
 
     public:
@@ -72,7 +90,7 @@ namespace couchdb
 
             std::vector<view_information> views;
             for (auto it = response.get_object().begin(); it != response.get_object().end(); ++it)
-                views.push_back(view_information(it->first, it->second));
+                views.push_back(view_information(it->first, it->second["map"].get_string(""), it->second["reduce"].get_string("")));
 
             return views;
         }
@@ -128,6 +146,33 @@ namespace couchdb
             return set_data("views", obj);
         }
 
+        // Reloads the latest revision of the design document, discarding any uncommitted changes
+        void refresh()
+        {
+            json::value response = document<http_client>::get_data(false);
+            if (!response.is_object())
+                throw error(error::document_unavailable);
+
+            body_ = response;
+            cached_ = true;
+            modified_ = false;
+            this->revision_ = response["_rev"].get_string();
+        }
+
+        // Delays saving changes made by the setters until commit() is called
+        void begin_batch() {batching_ = true;}
+
+        // Saves all changes made since begin_batch() with a single PUT, and ends the batch
+        void commit()
+        {
+            batching_ = false;
+            if (modified_)
+                save();
+        }
+
+        // Returns true if changes have been made that are not yet saved
+        bool has_uncommitted_changes() const {return modified_;}
+
         // Compacts the view indexes for this design document
         void compactViews()
         {
@@ -152,25 +197,63 @@ namespace couchdb
         }
 
     protected:
-        json::value get_data(const std::string &key) const
+        // Loads the body into the cache, if it is not already loaded for the current revision
+        // Throws error::document_conflict if the cached body has uncommitted changes to another revision
+        const json::value &get_body() const
         {
-            json::value response = document<http_client>::get_data();
-            if (!response.is_object())
-                throw error(error::document_unavailable);
+            const json::value &body = body_;
+            if (!cached_ || (this->revision_.size() > 0 && (!body.is_member("_rev") || this->revision_ != body["_rev"].get_string())))
+            {
+                if (modified_)
+                    throw error(error::document_conflict, "Design document " + this->id_ + " has uncommitted changes to another revision");
+
+                json::value response = document<http_client>::get_data();
+                if (!response.is_object())
+                    throw error(error::document_unavailable);
+
+                body_ = response;
+                cached_ = true;
+                modified_ = false;
+            }
 
-            return response[key];
+            return body_;
         }
 
+        json::value get_data(const std::string &key) const {return get_body()[key];}
+
         void set_data(const std::string &key, const json::value &value)
         {
-            json::value response = document<http_client>::get_data();
-            if (!response.is_object())
-                throw error(error::document_unavailable);
+            get_body();
+            body_[key] = value;
+            modified_ = true;
 
-            response[key] = value;
+            if (!batching_)
+                save();
+        }
+
+        // Saves the cached body, using the cached revision so conflicting changes are detected
+        // On failure, the changes are kept, so they may be saved again with commit(), or discarded with refresh()
+        void save()
+        {
+            json::value response = this->comm_->get_data(this->get_doc_url_path(false), "PUT", json_to_string(body_));
+            if (!response.is_object() || !response.is_member("rev"))
+            {
+#ifdef CPPCOUCH_DEBUG
+                std::cout << "Design document " + this->id_ + " could not be saved: " + response["reason"].get_string();
+#endif
+                throw error(error::document_unavailable, response["reason"].get_string());
+            }
 
-            return document<http_client>::set_data(response);
+            this->revision_ = response["rev"].get_string();
+            body_["_rev"] = this->revision_;
+            modified_ = false;
         }
+
+    private:
+        mutable json::value body_;
+        mutable bool cached_;
+        bool batching_;
+        mutable bool modified_;
     };
 }
 
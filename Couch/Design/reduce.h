@@ -0,0 +1,190 @@
+#ifndef CPPCOUCH_REDUCE_H
+#define CPPCOUCH_REDUCE_H
+
+#include "viewstream.h"
+
+namespace couchdb
+{
+    /* reduce_options struct - The grouping options of a reduce view query.
+     *
+     * If neither `group` nor `group_level` is set, the entire view is reduced to a single row with a null key,
+     * which is returned as a default-constructed key.
+     * Other queries (e.g. startkey and endkey) may be added to `queries`.
+     */
+
+    struct reduce_options
+    {
+        reduce_options() : group(false), group_level(0) {}
+        reduce_options(unsigned int group_level) : group(false), group_level(group_level) {}
+
+        // Groups by the entire key
+        bool group;
+        // Groups by the first `group_level` elements of array keys, or 0 to not use group_level
+        unsigned int group_level;
+
+        view_queries queries;
+    };
+
+    /* reduce_stats struct - The output of the builtin _stats reducer
+     */
+
+    struct reduce_stats
+    {
+        reduce_stats() : sum(0), min(0), max(0), count(0), sumsqr(0) {}
+
+        double sum;
+        double min;
+        double max;
+        json::int_t count;
+        double sumsqr;
+
+        // Returns the mean of the reduced values
+        double mean() const {return count? sum / count: 0.0;}
+    };
+
+    /* array_key struct - A fixed-capacity composite key, e.g. [year, month, day]
+     *
+     * Keys with more than N elements are truncated. `size` holds the number of elements actually present.
+     */
+
+    template<typename T, size_t N>
+    struct array_key
+    {
+        array_key() : size(0) {}
+
+        T values[N];
+        size_t size;
+
+        const T &operator[](size_t pos) const {return values[pos];}
+        T &operator[](size_t pos) {return values[pos];}
+
+        bool operator==(const array_key &other) const
+        {
+            if (size != other.size)
+                return false;
+
+            for (size_t i = 0; i < size; ++i)
+                if (!(values[i] == other.values[i]))
+                    return false;
+
+            return true;
+        }
+        bool operator!=(const array_key &other) const {return !(*this == other);}
+    };
+
+    /* reduce_row struct - A single row of a reduce view query
+     */
+
+    template<typename key_type, typename value_type>
+    struct reduce_row
+    {
+        key_type key;
+        value_type value;
+    };
+
+    /* reduce_decode functions - Decode raw JSON from a view response directly into typed values.
+     * Each returns false if the raw value does not have the expected type.
+     *
+     * To decode custom types, overload reduce_decode(string_ref, your_type &) in the couchdb namespace.
+     */
+
+    inline bool reduce_decode(string_ref raw, double &result) {return raw_json::to_number(raw, result);}
+    inline bool reduce_decode(string_ref raw, json::int_t &result) {return raw_json::to_number(raw, result);}
+
+    inline bool reduce_decode(string_ref raw, std::string &result)
+    {
+        if (raw.empty() || raw[0] != '"')
+            return false;
+
+        result = raw_json::decode_string(raw);
+        return true;
+    }
+
+    inline bool reduce_decode(string_ref raw, json::value &result)
+    {
+        result = raw_json::to_json(raw);
+        return true;
+    }
+
+    inline bool reduce_decode(string_ref raw, reduce_stats &result)
+    {
+        return raw_json::for_each_member(raw, [&](string_ref key, string_ref value)
+        {
+            if (raw_json::string_equals(key, "sum", 3))
+                raw_json::to_number(value, result.sum);
+            else if (raw_json::string_equals(key, "min", 3))
+                raw_json::to_number(value, result.min);
+            else if (raw_json::string_equals(key, "max", 3))
+                raw_json::to_number(value, result.max);
+            else if (raw_json::string_equals(key, "count", 5))
+                raw_json::to_number(value, result.count);
+            else if (raw_json::string_equals(key, "sumsqr", 6))
+                raw_json::to_number(value, result.sumsqr);
+            return true;
+        });
+    }
+
+    template<typename T, size_t N>
+    bool reduce_decode(string_ref raw, array_key<T, N> &result)
+    {
+        bool ok = true;
+
+        result.size = 0;
+        if (raw.size() == 4 && raw == string_ref("null", 4)) // Key of a fully reduced view
+            return true;
+
+        return raw_json::for_each_element(raw, [&](string_ref element)
+        {
+            if (result.size == N)
+                return false;
+
+            ok = reduce_decode(element, result.values[result.size++]);
+            return ok;
+        }) && ok;
+    }
+
+    /* Parses the rows of a reduce view response and appends them to `results`
+     * If `grouped` is false, the null key of the single row is decoded as a default-constructed key, whatever its type.
+     */
+
+    template<typename key_type, typename value_type>
+    void reduce_parse_results(string_ref body, std::vector<reduce_row<key_type, value_type>> &results, bool grouped = true)
+    {
+        view_response_parser parser;
+        const char *begin, *end;
+
+        parser.append(body.data(), body.size());
+
+        try
+        {
+            while (parser.next(begin, end))
+            {
+                reduce_row<key_type, value_type> row = reduce_row<key_type, value_type>();
+                bool key_ok = false, value_ok = false;
+
+                raw_json::for_each_member(string_ref(begin, end), [&](string_ref k, string_ref v)
+                {
+                    if (raw_json::string_equals(k, "key", 3))
+                        key_ok = (!grouped && v == string_ref("null", 4)) || reduce_decode(v, row.key);
+                    else if (raw_json::string_equals(k, "value", 5))
+                        value_ok = reduce_decode(v, row.value);
+                    return true;
+                });
+
+                if (!key_ok || !value_ok)
+                    throw error(error::bad_response, "Unexpected key or value type in reduce row: " + std::string(begin, end));
+
+                results.push_back(row);
+            }
+        }
+        catch (const error &e)
+        {
+            throw error(error::view_unavailable, e.reason());
+        }
+
+        if (!parser.finished() || !parser.error_name().empty())
+            throw error(error::view_unavailable, parser.error_reason());
+    }
+}
+
+#endif // CPPCOUCH_REDUCE_H
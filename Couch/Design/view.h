@@ -3,48 +3,18 @@
 
 #include "../shared.h"
 #include "../communication.h"
+#include "viewquery.h"
+#include "viewoptions.h"
+#include "viewstream.h"
+#include "viewpager.h"
+#include "viewscatter.h"
+#include "reduce.h"
+#include "columns.h"
 
 namespace couchdb
 {
-    /* ViewResult struct - This stores a single key/value pair returned from a user-defined view.
-     *
-     * UNTESTED
-     */
-
     template<typename http_client> class locator;
 
-    struct view_result
-    {
-        view_result() {}
-        view_result(const json::value &key, const json::value &value, const std::string &documentName, const std::string &documentURL)
-            : key(key)
-            , value(value)
-            , documentName(documentName)
-            , documentURL(documentURL)
-        {}
-
-        json::value key;
-        json::value value;
-        std::string documentName;
-        std::string documentURL;
-    };
-
-    /* ViewQuery struct - This struct stores a well-defined query parameter to pass to a view
-     */
-
-    struct view_query
-    {
-        view_query() : useLiteralStrings(true) {}
-
-        std::string key;
-        json::value value;
-        bool useLiteralStrings; //the string of 'value' will be surrounded by quotes if false
-    };
-
-    // Convenience typedefs
-    typedef std::vector<view_query> view_queries;
-    typedef std::vector<view_result> view_results;
-
     /* View class - This class references a user-defined view stored in a design document.
      */
 
@@ -81,46 +51,230 @@ namespace couchdb
         std::string get_doc_revision() const {return revision;}
 
         // Runs the view with specified queries
-        view_results query(const view_queries &_queries) const
+        view_results query(const view_queries &_queries) const {return query(get_query_string(_queries));}
+
+        // Runs the view with the specified single query
+        view_results query(const view_query &viewQuery) const {return query(get_query_string(viewQuery));}
+
+        // Runs the view with the specified typed options
+        view_results query(const view_options &options) const {return query(options.str());}
+
+        // Runs the view with specified queries, returning a stream that reads rows as they arrive
+        // Unlike query(), the response is never held in memory all at once
+        std::shared_ptr<view_stream<http_client>> query_stream(const view_queries &_queries = view_queries()) const
         {
-            std::string queryString;
-            for (view_query viewQuery: _queries)
+            return std::make_shared<view_stream<http_client>>(comm, get_query_url(get_query_string(_queries)), get_db_url());
+        }
+
+        // Runs the view with the specified single query, returning a stream that reads rows as they arrive
+        std::shared_ptr<view_stream<http_client>> query_stream(const view_query &viewQuery) const
+        {
+            return std::make_shared<view_stream<http_client>>(comm, get_query_url(get_query_string(viewQuery)), get_db_url());
+        }
+
+        // Runs the view with the specified typed options, returning a stream that reads rows as they arrive
+        std::shared_ptr<view_stream<http_client>> query_stream(const view_options &options) const
+        {
+            return std::make_shared<view_stream<http_client>>(comm, get_query_url(options.str()), get_db_url());
+        }
+
+        // Runs the view with the specified typed options, streaming the rows into the columns of `extractor`
+        // Returns the number of rows extracted
+        size_t query_columns(column_extractor &extractor, const view_options &options = view_options()) const
+        {
+            view_stream<http_client> stream(comm, get_query_url(options.str()), get_db_url());
+            return extractor.add_rows_from(stream);
+        }
+
+        // Runs the view for each of the specified keys, using POST requests with at most `chunk_size` keys each
+        // Other queries (e.g. include_docs) may be specified in `_queries`
+        // As each request is limited, skipped and sorted separately, limit, skip, and descending throw an error if more than one request is needed
+        view_results query_keys(const json::array_t &keys, const view_queries &_queries = view_queries(), size_t chunk_size = 1000) const
+        {
+            view_results results;
+            std::shared_ptr<const std::string> db_url = std::make_shared<const std::string>(get_db_url());
+            std::string url = get_query_url(get_query_string(_queries));
+            std::string body;
+
+            if (chunk_size == 0)
+                chunk_size = keys.size();
+
+            if (keys.size() > chunk_size)
+                for (const view_query &viewQuery: _queries)
+                    if (viewQuery.key == "limit" || viewQuery.key == "skip" || viewQuery.key == "descending")
+                        throw error(error::invalid_argument, "view::query_keys() cannot apply " + viewQuery.key + " to more than one chunk of keys");
+
+            for (size_t i = 0; i < keys.size(); i += chunk_size)
             {
-                std::string val;
-                if (viewQuery.value.is_string())
+                size_t end = std::min(keys.size(), i + chunk_size);
+
+                body = "{\"keys\":[";
+                for (size_t j = i; j < end; ++j)
                 {
-                    if (viewQuery.useLiteralStrings)
-                        val = viewQuery.value.get_string();
-                    else
-                        val = "\"" + viewQuery.value.get_string() + "\"";
+                    if (j != i)
+                        body += ',';
+                    body += json_to_string(keys[j]);
                 }
-                else
-                    val = json_to_string(viewQuery.value);
+                body += "]}";
 
-                if (!queryString.empty())
-                    queryString += "&";
-
-                queryString += url_encode(viewQuery.key) + "=" + url_encode(val);
+                parse_results(comm->get_raw_data(url, "POST", typename base::header_map(), body), db_url, results);
             }
 
-            return query(queryString);
+            return results;
         }
 
-        // Runs the view with the specified single query
-        view_results query(const view_query &viewQuery) const
+        // Runs several queries on the view in a single request, returning the results of each query in order
+        // This requires CouchDB 2.2 or later
+        std::vector<view_results> query_batch(const std::vector<view_queries> &batch) const
         {
-            std::string val;
-            if (viewQuery.value.is_string())
+            std::vector<view_results> results;
+            std::shared_ptr<const std::string> db_url = std::make_shared<const std::string>(get_db_url());
+            json::value body = json::object_t();
+            json::array_t &arr = body["queries"].get_array();
+            std::string response;
+            string_ref raw_results;
+
+            if (batch.empty())
+                return results;
+
+            for (const view_queries &q: batch)
+                arr.push_back(get_query_object(q));
+
+            std::string url = getURL(false) + "/queries";
+            if (revision.size() > 0)
+                url += "?rev=" + url_encode(revision);
+
+            response = comm->get_raw_data(url, "POST", typename base::header_map(), json_to_string(body));
+            raw_results = raw_json::find_member(response, "results");
+            if (raw_results.empty())
+                throw error(error::view_unavailable, raw_json::decode_string(raw_json::find_member(response, "reason")));
+
+            results.reserve(batch.size());
+            raw_json::for_each_element(raw_results, [&](string_ref result)
             {
-                if (viewQuery.useLiteralStrings)
-                    val = viewQuery.value.get_string();
+                results.push_back(view_results());
+                parse_results(result, db_url, results.back());
+                return true;
+            });
+
+            return results;
+        }
+
+        // Runs a reduce query on the view, decoding keys and values directly into the specified types
+        // For example, query_reduce<array_key<json::int_t, 3>, reduce_stats>(reduce_options(2)) groups a _stats view by [year, month]
+        template<typename key_type, typename value_type>
+        std::vector<reduce_row<key_type, value_type>> query_reduce(const reduce_options &options = reduce_options()) const
+        {
+            std::vector<reduce_row<key_type, value_type>> results;
+            std::string queryString = "reduce=true";
+
+            if (options.group_level > 0)
+                queryString += "&group_level=" + std::to_string(options.group_level);
+            else if (options.group)
+                queryString += "&group=true";
+
+            if (!options.queries.empty())
+                queryString += "&" + get_query_string(options.queries);
+
+            reduce_parse_results(comm->get_raw_data(get_query_url(queryString)), results, options.group || options.group_level > 0);
+            return results;
+        }
+
+        // Runs the view with specified queries, fetching `page_size` rows at a time and returning them as a single range
+        // The startkey, startkey_docid, and skip queries apply to the first page, and limit applies to the total number of rows
+        std::shared_ptr<view_pager<http_client>> query_paged(const view_queries &_queries = view_queries(), size_t page_size = 1000) const
+        {
+            view_queries other;
+            std::string first_page;
+            json::int_t limit = -1;
+
+            for (const view_query &viewQuery: _queries)
+            {
+                if (viewQuery.key == "limit")
+                    limit = viewQuery.value.is_string()? strtoll(viewQuery.value.get_string().c_str(), NULL, 10): viewQuery.value.get_int(-1);
+                else if (viewQuery.key == "startkey" || viewQuery.key == "start_key" ||
+                         viewQuery.key == "startkey_docid" || viewQuery.key == "start_key_doc_id" ||
+                         viewQuery.key == "skip")
+                {
+                    if (!first_page.empty())
+                        first_page += "&";
+
+                    first_page += get_query_string(viewQuery);
+                }
                 else
-                    val = "\"" + viewQuery.value.get_string() + "\"";
+                    other.push_back(viewQuery);
             }
-            else
-                val = json_to_string(viewQuery.value);
 
-            return query(url_encode(viewQuery.key) + "=" + url_encode(val));
+            return std::make_shared<view_pager<http_client>>(comm, get_query_url(get_query_string(other)), first_page, get_db_url(), page_size, limit);
+        }
+
+        // Scans the view as several key ranges in parallel, split at the specified keys (in ascending order)
+        // If `ordered` is false, rows are returned in the order they arrive instead of in view order
+        // Other queries (e.g. include_docs or reduce=false) may be specified in `_queries`. Queries that conflict with the
+        // computed ranges (key, keys, startkey, endkey, limit, skip, and descending) throw an error
+        std::shared_ptr<view_scatter<http_client>> query_scatter(const json::array_t &split_points, const view_queries &_queries = view_queries(),
+                                                                 bool ordered = true, size_t page_size = 1000) const
+        {
+            check_scatter_queries(_queries);
+
+            std::vector<std::string> raw_points;
+            for (const json::value &point: split_points)
+                raw_points.push_back(json_to_string(point));
+
+            return std::make_shared<view_scatter<http_client>>(comm, get_query_url(get_query_string(_queries)), get_db_url(), raw_points, ordered, page_size);
+        }
+
+        // Scans the view as (at most) `ranges` key ranges in parallel, with split points found by sample_split_points()
+        std::shared_ptr<view_scatter<http_client>> query_scatter(size_t ranges, const view_queries &_queries = view_queries(),
+                                                                 bool ordered = true, size_t page_size = 1000) const
+        {
+            check_scatter_queries(_queries);
+            return query_scatter(sample_split_points(ranges), _queries, ordered, page_size);
+        }
+
+        // Returns up to `ranges - 1` distinct keys that split the view into ranges with about the same number of rows
+        // The keys are found by requesting single rows with `skip`, in parallel
+        json::array_t sample_split_points(size_t ranges) const
+        {
+            json::array_t result;
+            view_response_parser parser;
+            std::vector<std::future<std::string>> samples;
+            const char *begin, *end;
+
+            try
+            {
+                parser.append(comm->get_raw_data(get_query_url("reduce=false&limit=0")));
+                while (parser.next(begin, end));
+            }
+            catch (const error &e)
+            {
+                throw error(error::view_unavailable, e.reason());
+            }
+
+            if (!parser.finished() || parser.total_rows() < 0)
+                throw error(error::view_unavailable, parser.error_reason());
+
+            json::int_t total = parser.total_rows();
+            for (size_t i = 1; i < ranges && static_cast<json::int_t>(i) < total; ++i)
+            {
+                std::string url = get_query_url("reduce=false&limit=1&skip=" + std::to_string(total * i / ranges));
+                samples.push_back(std::async(std::launch::async, &view::get_sample, comm->duplicate(), url));
+            }
+
+            for (auto &sample: samples)
+            {
+                parser.reset();
+                parser.append(sample.get());
+
+                if (!parser.next(begin, end))
+                    continue;
+
+                json::value key = raw_json::to_json(raw_json::find_member(string_ref(begin, end), "key"));
+                if (result.empty() || !(result.back() == key))
+                    result.push_back(key);
+            }
+
+            return result;
         }
 
         // Returns the URL of the CouchDB server
@@ -155,36 +309,117 @@ namespace couchdb
         }
 
     protected:
-        view_results query(const std::string &queries) const
+        static std::string get_query_string(const view_query &viewQuery)
         {
-            json::value response;
-            view_results results;
-            std::string url = "/" + url_encode(db) + "/" + url_encode_doc_id(document) + "/" + url_encode_view_id(id);
+            std::string val;
+            if (viewQuery.value.is_string())
+            {
+                if (viewQuery.useLiteralStrings)
+                    val = viewQuery.value.get_string();
+                else
+                    val = "\"" + viewQuery.value.get_string() + "\"";
+            }
+            else
+                val = json_to_string(viewQuery.value);
 
-            if (revision.size() > 0)
-                url += "?rev=" + url_encode(revision);
+            return url_encode(viewQuery.key) + "=" + url_encode(val);
+        }
+
+        static std::string get_query_string(const view_queries &_queries)
+        {
+            std::string queryString;
+            for (const view_query &viewQuery: _queries)
+            {
+                if (!queryString.empty())
+                    queryString += "&";
+
+                queryString += get_query_string(viewQuery);
+            }
+
+            return queryString;
+        }
+
+        std::string get_query_url(const std::string &queries) const
+        {
+            std::string url = getURL(true);
 
             if (queries.size() > 0)
                 url = add_url_query(url, queries);
 
-            response = comm->get_data(url);
-            if (!response.is_object())
-                throw error(error::view_unavailable);
+            return url;
+        }
 
-            response = response["rows"];
-            if (!response.is_array())
-                throw error(error::view_unavailable);
+        view_results query(const std::string &queries) const
+        {
+            view_results results;
+            parse_results(comm->get_raw_data(get_query_url(queries)), std::make_shared<const std::string>(get_db_url()), results);
+            return results;
+        }
+
+        static std::string get_sample(std::shared_ptr<base> comm, std::string url)
+        {
+            return comm->get_raw_data(url);
+        }
+
+        // Throws an error if a query would conflict with the key ranges of a scatter scan
+        static void check_scatter_queries(const view_queries &_queries)
+        {
+            for (const view_query &viewQuery: _queries)
+                if (viewQuery.key == "key" || viewQuery.key == "keys" || viewQuery.key == "startkey" || viewQuery.key == "start_key" ||
+                    viewQuery.key == "endkey" || viewQuery.key == "end_key" || viewQuery.key == "limit" || viewQuery.key == "skip" ||
+                    viewQuery.key == "descending")
+                    throw error(error::invalid_argument, "view::query_scatter() cannot apply " + viewQuery.key + " to the scanned ranges");
+        }
 
-            for (json::value val: response)
+        // Converts queries to a JSON object, as used in the body of a POST request
+        static json::value get_query_object(const view_queries &_queries)
+        {
+            json::value obj = json::object_t();
+
+            for (const view_query &viewQuery: _queries)
             {
-                if (val.is_object())
-                    results.push_back(view_result(val["key"],
-                                                  val["value"],
-                                                  val["id"].get_string(),
-                                                  get_db_url() + "/" + val["id"].get_string()));
+                json::value val = viewQuery.value;
+
+                // Literal strings are already JSON text (except for bare words like "ok")
+                if (val.is_string() && viewQuery.useLiteralStrings)
+                {
+                    val = string_to_json(viewQuery.value.get_string());
+                    if (val.is_null() && viewQuery.value.get_string() != "null")
+                        val = viewQuery.value;
+                }
+
+                obj[viewQuery.key] = val;
             }
 
-            return results;
+            return obj;
+        }
+
+        // Parses the rows of a view response and appends them to `results`
+        static void parse_results(string_ref body, std::shared_ptr<const std::string> db_url, view_results &results)
+        {
+            view_response_parser parser;
+            view_row row;
+
+            parser.append(body.data(), body.size());
+
+            try
+            {
+                while (parser.next(row, db_url))
+                {
+                    if (row.raw().size() && row.raw()[0] == '{' && !row.has_error())
+                        results.push_back(view_result(row.key(),
+                                                      row.value(),
+                                                      row.id(),
+                                                      row.document_url()));
+                }
+            }
+            catch (const error &)
+            {
+                throw error(error::view_unavailable);
+            }
+
+            if (!parser.finished() || !parser.error_name().empty())
+                throw error(error::view_unavailable, parser.error_reason());
         }
 
         std::string getURL(bool withRevision) const
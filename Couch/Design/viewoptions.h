@@ -0,0 +1,263 @@
+#ifndef CPPCOUCH_VIEWOPTIONS_H
+#define CPPCOUCH_VIEWOPTIONS_H
+
+#include <ctype.h>
+#include <stdint.h>
+#include <locale>
+#include <sstream>
+
+#include "../shared.h"
+
+namespace couchdb
+{
+    /* view_options class - A typed builder for view query parameters.
+     *
+     * Each parameter has its own member function, so misspelled parameters and values of the wrong type are
+     * compile errors instead of server errors. Parameter names are compile-time constants, and values are
+     * serialized and percent-encoded directly into a single preallocated query string, without building
+     * intermediate strings. Member functions return a reference to the builder so calls can be chained:
+     *
+     *     view.query(view_options().startkey(json::array_t{"a"}).limit(10).include_docs())
+     *
+     * Setting the same parameter twice adds it twice, which CouchDB resolves by using the last value.
+     */
+
+    class view_options
+    {
+    public:
+        enum update_mode
+        {
+            update_true,  // Update the view before responding (default)
+            update_false, // Respond with the current index, without updating it
+            update_lazy   // Respond with the current index, then update it
+        };
+
+        explicit view_options(size_t reserve = 128) {query_.reserve(reserve);}
+
+        view_options &key(const json::value &val) {return append_json("key", val);}
+        view_options &keys(const json::array_t &val) {return append_json("keys", val);}
+        view_options &startkey(const json::value &val) {return append_json("startkey", val);}
+        view_options &endkey(const json::value &val) {return append_json("endkey", val);}
+        view_options &startkey_docid(const std::string &val) {return append_string("startkey_docid", val);}
+        view_options &endkey_docid(const std::string &val) {return append_string("endkey_docid", val);}
+
+        view_options &limit(size_t val) {return append_int("limit", val);}
+        view_options &skip(size_t val) {return append_int("skip", val);}
+
+        view_options &descending(bool val = true) {return append_bool("descending", val);}
+        view_options &inclusive_end(bool val = true) {return append_bool("inclusive_end", val);}
+        view_options &include_docs(bool val = true) {return append_bool("include_docs", val);}
+        view_options &update_seq(bool val = true) {return append_bool("update_seq", val);}
+        view_options &sorted(bool val = true) {return append_bool("sorted", val);}
+        view_options &stable(bool val = true) {return append_bool("stable", val);}
+
+        view_options &reduce(bool val = true) {return append_bool("reduce", val);}
+        view_options &group(bool val = true) {return append_bool("group", val);}
+        view_options &group_level(unsigned int val) {return append_int("group_level", val);}
+
+        view_options &update(update_mode mode)
+        {
+            append_name("update");
+            switch (mode)
+            {
+                case update_false: return append_raw("false");
+                case update_lazy: return append_raw("lazy");
+                default: return append_raw("true");
+            }
+        }
+
+        // Equivalent to update(update_false) if `update_after` is false, or update(update_lazy) otherwise
+        // Prefer update() for CouchDB 2.1+, since stale is deprecated
+        view_options &stale(bool update_after = false)
+        {
+            append_name("stale");
+            if (update_after)
+                return append_raw("update_after");
+            return append_raw("ok");
+        }
+
+        // Returns true if no parameters have been set
+        bool empty() const {return query_.empty();}
+
+        // Returns the encoded query string, without a leading '?'
+        const std::string &str() const {return query_;}
+
+        // Removes all parameters, keeping the allocated buffer
+        void clear() {query_.clear();}
+
+    private:
+        // Appends `name=`, where `name` is a string literal whose length is known at compile time
+        template<size_t N>
+        void append_name(const char (&name)[N])
+        {
+            if (!query_.empty())
+                query_.push_back('&');
+            query_.append(name, N-1);
+            query_.push_back('=');
+        }
+
+        template<size_t N>
+        view_options &append_raw(const char (&value)[N])
+        {
+            query_.append(value, N-1);
+            return *this;
+        }
+
+        template<size_t N>
+        view_options &append_bool(const char (&name)[N], bool val)
+        {
+            append_name(name);
+            return val? append_raw("true"): append_raw("false");
+        }
+
+        template<size_t N>
+        view_options &append_int(const char (&name)[N], json::int_t val)
+        {
+            append_name(name);
+            write_int(val);
+            return *this;
+        }
+
+        template<size_t N>
+        view_options &append_string(const char (&name)[N], const std::string &val)
+        {
+            append_name(name);
+            write_encoded(val.data(), val.size());
+            return *this;
+        }
+
+        template<size_t N>
+        view_options &append_json(const char (&name)[N], const json::value &val)
+        {
+            append_name(name);
+            write_json(val);
+            return *this;
+        }
+
+        void write_int(json::int_t val)
+        {
+            char buf[24];
+            char *p = buf + sizeof(buf);
+            uint64_t u = val < 0? -static_cast<uint64_t>(val): val;
+
+            do
+                *--p = '0' + u % 10;
+            while (u /= 10);
+
+            if (val < 0)
+                *--p = '-';
+
+            query_.append(p, buf + sizeof(buf));
+        }
+
+        // Percent-encodes the data, leaving only unreserved characters as-is
+        void write_encoded(const char *data, size_t size)
+        {
+            static const char hex[] = "0123456789ABCDEF";
+
+            for (size_t i = 0; i < size; ++i)
+            {
+                unsigned char c = data[i];
+                if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~')
+                    query_.push_back(c);
+                else
+                {
+                    query_.push_back('%');
+                    query_.push_back(hex[c >> 4]);
+                    query_.push_back(hex[c & 0xf]);
+                }
+            }
+        }
+
+        void write_encoded(char c) {write_encoded(&c, 1);}
+
+        // Writes a JSON string, escaped and percent-encoded
+        void write_json_string(const std::string &str)
+        {
+            static const char hex[] = "0123456789abcdef";
+
+            query_.append("%22", 3);
+            for (size_t i = 0; i < str.size(); ++i)
+            {
+                unsigned char c = str[i];
+                switch (c)
+                {
+                    case '"': query_.append("%5C%22", 6); break;
+                    case '\\': query_.append("%5C%5C", 6); break;
+                    case '\b': query_.append("%5Cb", 4); break;
+                    case '\f': query_.append("%5Cf", 4); break;
+                    case '\n': query_.append("%5Cn", 4); break;
+                    case '\r': query_.append("%5Cr", 4); break;
+                    case '\t': query_.append("%5Ct", 4); break;
+                    default:
+                        if (iscntrl(c))
+                        {
+                            query_.append("%5Cu00", 6);
+                            query_.push_back(hex[c >> 4]);
+                            query_.push_back(hex[c & 0xf]);
+                        }
+                        else
+                            write_encoded(c);
+                        break;
+                }
+            }
+            query_.append("%22", 3);
+        }
+
+        // Writes a JSON value, percent-encoded
+        void write_json(const json::value &val)
+        {
+            switch (val.get_type())
+            {
+                case json::null: query_.append("null", 4); break;
+                case json::boolean: val.get_bool()? query_.append("true", 4): query_.append("false", 5); break;
+                case json::integer: write_int(val.get_int()); break;
+                case json::real:
+                {
+                    // Formatted in the classic locale, so the decimal separator is always a period
+                    std::ostringstream stream;
+                    stream.imbue(std::locale::classic());
+                    stream.precision(17);
+                    stream << val.get_real();
+
+                    const std::string str = stream.str();
+                    write_encoded(str.data(), str.size());
+                    break;
+                }
+                case json::string: write_json_string(val.get_string()); break;
+                case json::array:
+                {
+                    const json::array_t &arr = val.get_array();
+                    query_.append("%5B", 3);
+                    for (size_t i = 0; i < arr.size(); ++i)
+                    {
+                        if (i)
+                            query_.append("%2C", 3);
+                        write_json(arr[i]);
+                    }
+                    query_.append("%5D", 3);
+                    break;
+                }
+                case json::object:
+                {
+                    const json::object_t &obj = val.get_object();
+                    query_.append("%7B", 3);
+                    for (auto it = obj.begin(); it != obj.end(); ++it)
+                    {
+                        if (it != obj.begin())
+                            query_.append("%2C", 3);
+                        write_json_string(it->first);
+                        query_.append("%3A", 3);
+                        write_json(it->second);
+                    }
+                    query_.append("%7D", 3);
+                    break;
+                }
+            }
+        }
+
+        std::string query_;
+    };
+}
+
+#endif // CPPCOUCH_VIEWOPTIONS_H
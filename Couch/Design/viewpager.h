@@ -0,0 +1,164 @@
+#ifndef CPPCOUCH_VIEWPAGER_H
+#define CPPCOUCH_VIEWPAGER_H
+
+#include <future>
+
+#include "viewstream.h"
+
+namespace couchdb
+{
+    /* view_pager class - Walks a view one page at a time, exposed as a single range of rows.
+     *
+     * Each page is requested with `limit` set to one more than the page size. The extra row is not returned,
+     * but its key and document id are used as `startkey` and `startkey_docid` for the next page, so paging is
+     * exact even when many rows share the same key. As soon as a page arrives, the next page is requested on
+     * another thread while the current one is being consumed.
+     *
+     * Requests are made with a separate communication object (and network client), so the view's own
+     * communication object may be used freely while the pager is active. Paging by document id only works
+     * with map views (or reduce=false).
+     */
+
+    template<typename http_client>
+    class view_pager
+    {
+        view_pager(const view_pager &) {}
+        view_pager &operator=(const view_pager &) {return *this;}
+
+    public:
+        typedef communication<http_client> communication_type;
+        typedef row_iterator<view_pager> iterator;
+
+        /*                comm (IN): The communication object to copy the state of. Requests are made with a duplicate.
+         *                 url (IN): The URL of the view, including any queries other than startkey, startkey_docid, limit, and skip.
+         * first_page_queries (IN): The encoded startkey, startkey_docid, and skip queries to use for the first page only.
+         *              db_url (IN): The URL of the database the view is stored in, used for document URLs.
+         *           page_size (IN): The number of rows to request per page.
+         *               limit (IN): The maximum total number of rows to return, or -1 for no limit.
+         */
+        view_pager(std::shared_ptr<communication_type> comm, const std::string &url, const std::string &first_page_queries,
+                   const std::string &db_url, size_t page_size, json::int_t limit = -1)
+            : comm_(comm->duplicate())
+            , url_(url)
+            , db_url_(std::make_shared<const std::string>(db_url))
+            , page_size_(page_size? page_size: 1)
+            , remaining_(limit)
+            , pos_(0)
+            , pages_(0)
+        {
+            std::string first_url = add_url_query(url_, "limit=" + std::to_string(page_size_ + 1));
+            if (first_page_queries.size() > 0)
+                first_url = add_url_query(first_url, first_page_queries);
+
+            fetch(first_url);
+        }
+        ~view_pager()
+        {
+            // Wait for any outstanding request, since it references comm_
+            if (pending_.valid())
+                pending_.wait();
+        }
+
+        iterator begin() {return iterator(this);}
+        iterator end() {return iterator();}
+
+        // Reads the next row. Returns false when there are no more rows.
+        bool next(view_row &row)
+        {
+            if (remaining_ == 0)
+                return false;
+
+            while (pos_ == rows_.size())
+            {
+                if (!pending_.valid())
+                    return false;
+
+                load(pending_.get());
+            }
+
+            std::swap(row, rows_[pos_++]);
+            if (remaining_ > 0)
+                --remaining_;
+
+            return true;
+        }
+
+        // Returns the number of pages received so far
+        size_t pages() const {return pages_;}
+
+        // Returns the number of rows requested per page
+        size_t page_size() const {return page_size_;}
+
+    private:
+        static std::string get_page(std::shared_ptr<communication_type> comm, std::string url)
+        {
+            return comm->get_raw_data(url);
+        }
+
+        void fetch(const std::string &url)
+        {
+            pending_ = std::async(std::launch::async, &view_pager::get_page, comm_, url);
+        }
+
+        void load(const std::string &page)
+        {
+            view_response_parser parser;
+            size_t count = 0;
+
+            ++pages_;
+            pos_ = 0;
+            parser.append(page);
+
+            try
+            {
+                // Reuse the storage of the previous page's rows
+                while (true)
+                {
+                    if (count == rows_.size())
+                        rows_.push_back(view_row());
+
+                    if (!parser.next(rows_[count], db_url_))
+                        break;
+
+                    ++count;
+                }
+            }
+            catch (const error &)
+            {
+                throw error(error::view_unavailable);
+            }
+
+            rows_.resize(count);
+
+            if (!parser.finished() || !parser.error_name().empty())
+                throw error(error::view_unavailable, parser.error_reason());
+
+            // The extra row is where the next page begins
+            if (rows_.size() > page_size_)
+            {
+                const view_row &last = rows_.back();
+                std::string url = add_url_query(url_, "limit=" + std::to_string(page_size_ + 1));
+                url = add_url_query(url, "startkey=" + url_encode(last.raw_key().to_string()));
+                url = add_url_query(url, "startkey_docid=" + url_encode(last.id()));
+
+                rows_.pop_back();
+
+                if (remaining_ < 0 || static_cast<size_t>(remaining_) > rows_.size())
+                    fetch(url);
+            }
+        }
+
+        std::shared_ptr<communication_type> comm_;
+        std::string url_;
+        std::shared_ptr<const std::string> db_url_;
+        size_t page_size_;
+        json::int_t remaining_;
+
+        std::vector<view_row> rows_;
+        size_t pos_;
+        size_t pages_;
+        std::future<std::string> pending_;
+    };
+}
+
+#endif // CPPCOUCH_VIEWPAGER_H
@@ -0,0 +1,46 @@
+#ifndef CPPCOUCH_VIEWQUERY_H
+#define CPPCOUCH_VIEWQUERY_H
+
+#include "../shared.h"
+
+namespace couchdb
+{
+    /* ViewResult struct - This stores a single key/value pair returned from a user-defined view.
+     *
+     * UNTESTED
+     */
+
+    struct view_result
+    {
+        view_result() {}
+        view_result(const json::value &key, const json::value &value, const std::string &documentName, const std::string &documentURL)
+            : key(key)
+            , value(value)
+            , documentName(documentName)
+            , documentURL(documentURL)
+        {}
+
+        json::value key;
+        json::value value;
+        std::string documentName;
+        std::string documentURL;
+    };
+
+    /* ViewQuery struct - This struct stores a well-defined query parameter to pass to a view
+     */
+
+    struct view_query
+    {
+        view_query() : useLiteralStrings(true) {}
+
+        std::string key;
+        json::value value;
+        bool useLiteralStrings; //the string of 'value' will be surrounded by quotes if false
+    };
+
+    // Convenience typedefs
+    typedef std::vector<view_query> view_queries;
+    typedef std::vector<view_result> view_results;
+}
+
+#endif // CPPCOUCH_VIEWQUERY_H
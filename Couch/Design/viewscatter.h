@@ -0,0 +1,197 @@
+#ifndef CPPCOUCH_VIEWSCATTER_H
+#define CPPCOUCH_VIEWSCATTER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "viewpager.h"
+
+namespace couchdb
+{
+    /* view_scatter class - Scans a view as several key ranges in parallel, exposed as a single range of rows.
+     *
+     * The key space is split at the given split points into one more range than there are split points. Each range
+     * is walked by its own view_pager (and so its own network client) in a separate thread, and rows are buffered
+     * until they are read, up to `buffer_size` rows per range in ordered mode, or in total in unordered mode.
+     *
+     * In ordered mode, rows are returned in view order: all rows of the first range, then all rows of the second, and
+     * so on, while the later ranges keep downloading in the background. In unordered mode, rows are returned as soon
+     * as any range receives them, which gives the highest throughput.
+     *
+     * Split points must be raw JSON keys in ascending view order. A row whose key equals a split point belongs to the
+     * range starting at that split point. The view must be queried in ascending order, and with reduce=false if it
+     * has a reduce function.
+     */
+
+    template<typename http_client>
+    class view_scatter
+    {
+        view_scatter(const view_scatter &) {}
+        void operator=(const view_scatter &) {}
+
+        typedef view_pager<http_client> pager_type;
+
+        struct buffer
+        {
+            buffer() : producers(0), cancelled(false) {}
+
+            std::mutex mutex;
+            std::condition_variable not_empty, not_full;
+
+            std::deque<view_row> rows; // Protected by mutex
+            size_t producers; // Number of ranges still writing to this buffer, protected by mutex
+            bool cancelled; // Protected by mutex
+            std::exception_ptr err; // The exception a range failed with, if any, protected by mutex
+        };
+
+    public:
+        typedef communication<http_client> communication_type;
+        typedef row_iterator<view_scatter> iterator;
+
+        /*         comm (IN): The communication object to copy the state of. Each range is requested with a duplicate.
+         *          url (IN): The URL of the view, including any queries other than startkey, endkey, inclusive_end, limit, and skip.
+         *       db_url (IN): The URL of the database the view is stored in, used for document URLs.
+         * split_points (IN): The raw JSON keys the key space is split at, in ascending order.
+         *      ordered (IN): If true, rows are returned in view order. If false, rows are returned as they arrive.
+         *    page_size (IN): The number of rows to request per page in each range.
+         *  buffer_size (IN): The maximum number of rows buffered before a thread waits. In ordered mode, each range has
+         *                   its own buffer. In unordered mode, all ranges share a single buffer of this size.
+         */
+        view_scatter(std::shared_ptr<communication_type> comm, const std::string &url, const std::string &db_url,
+                     const std::vector<std::string> &split_points, bool ordered = true,
+                     size_t page_size = 1000, size_t buffer_size = 10000)
+            : buffers_(ordered? split_points.size() + 1: 1)
+            , buffer_size_(buffer_size? buffer_size: 1)
+            , current_(0)
+        {
+            try
+            {
+                threads_.reserve(split_points.size() + 1);
+                for (size_t i = 0; i <= split_points.size(); ++i)
+                {
+                    std::string range_url = url, first_page;
+
+                    if (i > 0)
+                        first_page = "startkey=" + url_encode(split_points[i-1]);
+
+                    if (i < split_points.size())
+                    {
+                        range_url = add_url_query(range_url, "endkey=" + url_encode(split_points[i]));
+                        range_url = add_url_query(range_url, "inclusive_end=false");
+                    }
+
+                    buffer &buf = buffers_[ordered? i: 0];
+                    std::shared_ptr<pager_type> pager = std::make_shared<pager_type>(comm, range_url, first_page, db_url, page_size);
+
+                    buf.producers++;
+                    threads_.push_back(std::thread(produce, pager, &buf, buffer_size_));
+                }
+            }
+            catch (...)
+            {
+                // The destructor is not run, so the ranges already started must be stopped here
+                cancel();
+                throw;
+            }
+        }
+        ~view_scatter() {cancel();}
+
+        iterator begin() {return iterator(this);}
+        iterator end() {return iterator();}
+
+        // Reads the next row. Returns false when all ranges have been read.
+        // If a range fails, its error is thrown once the rows it buffered have been read
+        bool next(view_row &row)
+        {
+            while (current_ < buffers_.size())
+            {
+                buffer &buf = buffers_[current_];
+                std::unique_lock<std::mutex> lock(buf.mutex);
+
+                buf.not_empty.wait(lock, [&buf]{return !buf.rows.empty() || buf.producers == 0 || buf.err;});
+
+                if (buf.rows.empty())
+                {
+                    if (buf.err)
+                        std::rethrow_exception(buf.err);
+
+                    ++current_;
+                    continue;
+                }
+
+                std::swap(row, buf.rows.front());
+                buf.rows.pop_front();
+                lock.unlock();
+
+                buf.not_full.notify_one();
+                return true;
+            }
+
+            return false;
+        }
+
+        // Returns the number of ranges being scanned
+        size_t ranges() const {return threads_.size();}
+
+    private:
+        // Stops the ranges and waits for their threads to finish
+        void cancel()
+        {
+            for (buffer &buf: buffers_)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(buf.mutex);
+                    buf.cancelled = true;
+                }
+                buf.not_full.notify_all();
+            }
+
+            for (std::thread &thread: threads_)
+                thread.join();
+        }
+
+        static void produce(std::shared_ptr<pager_type> pager, buffer *buf, size_t buffer_size)
+        {
+            view_row row;
+
+            try
+            {
+                while (pager->next(row))
+                {
+                    std::unique_lock<std::mutex> lock(buf->mutex);
+                    buf->not_full.wait(lock, [&]{return buf->rows.size() < buffer_size || buf->cancelled;});
+                    if (buf->cancelled)
+                        break;
+
+                    buf->rows.push_back(view_row());
+                    std::swap(buf->rows.back(), row);
+                    lock.unlock();
+
+                    buf->not_empty.notify_one();
+                }
+            }
+            catch (...)
+            {
+                // Any exception, e.g. std::system_error from the pager's prefetch, is rethrown by next() instead of terminating
+                std::lock_guard<std::mutex> lock(buf->mutex);
+                buf->err = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(buf->mutex);
+                --buf->producers;
+            }
+            buf->not_empty.notify_all();
+        }
+
+        std::vector<buffer> buffers_;
+        std::vector<std::thread> threads_;
+        size_t buffer_size_;
+        size_t current_;
+    };
+}
+
+#endif // CPPCOUCH_VIEWSCATTER_H
@@ -0,0 +1,477 @@
+#ifndef CPPCOUCH_VIEWSTREAM_H
+#define CPPCOUCH_VIEWSTREAM_H
+
+#include <chrono>
+#include <iterator>
+#include <thread>
+
+#include "../shared.h"
+#include "../communication.h"
+#include "../raw_json.h"
+#include "viewquery.h"
+
+namespace couchdb
+{
+    /* view_row class - This stores a single raw row returned from a view (or _all_docs).
+     *
+     * The row is kept as the raw JSON text sent by CouchDB. The key, value, and document are
+     * only parsed when requested, so rows that are skipped or only partially used cost very little.
+     */
+
+    class view_row
+    {
+        struct span
+        {
+            span() : pos(0), size(0) {}
+            size_t pos, size;
+        };
+
+    public:
+        view_row() {}
+        view_row(const std::string &raw, std::shared_ptr<const std::string> db_url = std::shared_ptr<const std::string>())
+            : raw_(raw)
+            , db_url_(db_url)
+        {
+            index();
+        }
+
+        // Replaces the contents of this row, reusing its storage
+        void assign(const char *begin, const char *end, std::shared_ptr<const std::string> db_url = std::shared_ptr<const std::string>())
+        {
+            raw_.assign(begin, end);
+            db_url_ = db_url;
+            index();
+        }
+
+        // Returns the raw JSON text of this row
+        const std::string &raw() const {return raw_;}
+
+        // Returns the raw JSON text of the specified row member, or an empty reference if it is not present
+        string_ref raw_id() const {return get(id_);}
+        string_ref raw_key() const {return get(key_);}
+        string_ref raw_value() const {return get(value_);}
+        string_ref raw_doc() const {return get(doc_);}
+        string_ref raw_error() const {return get(error_);}
+
+        // Returns true if the row has the specified member
+        bool has_id() const {return id_.size != 0;}
+        bool has_doc() const {return doc_.size != 0;}
+        bool has_error() const {return error_.size != 0;}
+
+        // Returns the id of the document that emitted this row
+        std::string id() const {return raw_json::decode_string(raw_id());}
+
+        // Parses and returns the specified row member
+        json::value key() const {return raw_json::to_json(raw_key());}
+        json::value value() const {return raw_json::to_json(raw_value());}
+        json::value doc() const {return raw_json::to_json(raw_doc());}
+        std::string error() const {return raw_json::decode_string(raw_error());}
+
+        // Returns the URL of the document that emitted this row, or an empty string if unknown
+        std::string document_url() const {return db_url_ && has_id()? *db_url_ + "/" + url_encode_doc_id(id()): std::string();}
+
+    private:
+        string_ref get(const span &s) const {return string_ref(raw_.data() + s.pos, s.size);}
+
+        void index()
+        {
+            id_ = key_ = value_ = doc_ = error_ = span();
+
+            const char *begin = raw_.data();
+            raw_json::for_each_member(raw_, [&](string_ref k, string_ref v)
+            {
+                span *s = NULL;
+                if (raw_json::string_equals(k, "id", 2))
+                    s = &id_;
+                else if (raw_json::string_equals(k, "key", 3))
+                    s = &key_;
+                else if (raw_json::string_equals(k, "value", 5))
+                    s = &value_;
+                else if (raw_json::string_equals(k, "doc", 3))
+                    s = &doc_;
+                else if (raw_json::string_equals(k, "error", 5))
+                    s = &error_;
+
+                if (s)
+                {
+                    s->pos = v.begin() - begin;
+                    s->size = v.size();
+                }
+                return true;
+            });
+        }
+
+        std::string raw_;
+        std::shared_ptr<const std::string> db_url_;
+        span id_, key_, value_, doc_, error_;
+    };
+
+    /* view_response_parser class - Incrementally splits a view response into raw rows.
+     *
+     * Data may be appended in arbitrarily sized pieces. Rows are returned as soon as they are
+     * complete, and consumed data is discarded so memory use is bounded by the largest row.
+     */
+
+    class view_response_parser
+    {
+        enum parse_state
+        {
+            state_start,
+            state_member,
+            state_rows,
+            state_done
+        };
+
+    public:
+        view_response_parser() : state_(state_start), pos_(0), total_rows_(-1), offset_(-1) {}
+
+        void append(const char *data, size_t size) {buffer_.append(data, size);}
+        void append(const std::string &data) {buffer_ += data;}
+        void append_line(const std::string &line)
+        {
+            buffer_ += line;
+            buffer_ += '\n';
+        }
+
+        // Returns true if the entire response has been parsed
+        bool finished() const {return state_ == state_done;}
+
+        // Returns true if the members preceding the rows have been parsed
+        bool header_finished() const {return state_ == state_rows || state_ == state_done;}
+
+        // Returns the total_rows and offset members of the response, or -1 if not present
+        json::int_t total_rows() const {return total_rows_;}
+        json::int_t offset() const {return offset_;}
+
+        // Returns the raw update_seq member of the response, if present
+        const std::string &update_seq() const {return update_seq_;}
+
+        // Returns the error and reason members of the response, if present
+        const std::string &error_name() const {return error_;}
+        const std::string &error_reason() const {return reason_;}
+
+        void reset()
+        {
+            state_ = state_start;
+            buffer_.clear();
+            pos_ = 0;
+            total_rows_ = offset_ = -1;
+            update_seq_.clear();
+            error_.clear();
+            reason_.clear();
+        }
+
+        /* Parses as much as possible of the buffered data.
+         * Returns true and sets `begin` and `end` to the raw text of the next row if one is available.
+         * The returned range is valid until the next call to a non-const member function.
+         * Returns false if more data is needed, or if the response is finished.
+         */
+        bool next(const char *&begin, const char *&end) {return parse(begin, end, false);}
+
+        // Parses the members preceding the rows, without consuming any row. Returns false if more data is needed.
+        bool next_header()
+        {
+            const char *begin, *end;
+            parse(begin, end, true);
+            return header_finished();
+        }
+
+        // Convenience overload of next() that copies the row into `row`
+        bool next(view_row &row, std::shared_ptr<const std::string> db_url = std::shared_ptr<const std::string>())
+        {
+            const char *begin, *end;
+            if (!next(begin, end))
+                return false;
+
+            row.assign(begin, end, db_url);
+            return true;
+        }
+
+    private:
+        // Same as next(), but stops before the first row if `header_only` is set
+        bool parse(const char *&begin, const char *&end, bool header_only)
+        {
+            const char *data = buffer_.data(), *data_end = data + buffer_.size();
+
+            while (state_ != state_done && !(header_only && state_ == state_rows))
+            {
+                const char *p = raw_json::skip_whitespace(data + pos_, data_end);
+                pos_ = p - data;
+                if (p == data_end)
+                    break;
+
+                if (state_ == state_start)
+                {
+                    if (*p != '{')
+                        throw error(error::bad_response, "Expected JSON object in view response");
+
+                    ++pos_;
+                    state_ = state_member;
+                }
+                else if (state_ == state_member)
+                {
+                    if (*p == ',')
+                    {
+                        ++pos_;
+                        continue;
+                    }
+                    else if (*p == '}')
+                    {
+                        ++pos_;
+                        state_ = state_done;
+                        break;
+                    }
+
+                    const char *key_end = raw_json::skip_string(p, data_end);
+                    if (key_end == NULL)
+                        break;
+
+                    const char *q = raw_json::skip_whitespace(key_end, data_end);
+                    if (q == data_end)
+                        break;
+                    else if (*q != ':')
+                        throw error(error::bad_response, "Expected ':' in view response");
+
+                    q = raw_json::skip_whitespace(q + 1, data_end);
+                    if (q == data_end)
+                        break;
+
+                    string_ref key(p, key_end);
+                    if (raw_json::string_equals(key, "rows", 4))
+                    {
+                        if (*q != '[')
+                            throw error(error::bad_response, "Expected rows array in view response");
+
+                        pos_ = q + 1 - data;
+                        state_ = state_rows;
+                        continue;
+                    }
+
+                    const char *value_end = raw_json::skip_value(q, data_end);
+                    if (value_end == NULL)
+                        break;
+
+                    header_member(key, string_ref(q, value_end));
+                    pos_ = value_end - data;
+                }
+                else if (state_ == state_rows)
+                {
+                    if (*p == ',')
+                    {
+                        ++pos_;
+                        continue;
+                    }
+                    else if (*p == ']')
+                    {
+                        ++pos_;
+                        state_ = state_member;
+                        continue;
+                    }
+
+                    const char *value_end = raw_json::skip_value(p, data_end);
+                    if (value_end == NULL)
+                        break;
+
+                    begin = p;
+                    end = value_end;
+                    pos_ = value_end - data;
+                    return true;
+                }
+            }
+
+            // Discard consumed data, only the incomplete remainder is kept
+            buffer_.erase(0, pos_);
+            pos_ = 0;
+            return false;
+        }
+
+        void header_member(string_ref key, string_ref value)
+        {
+            if (raw_json::string_equals(key, "total_rows", 10))
+                total_rows_ = strtoll(value.to_string().c_str(), NULL, 10);
+            else if (raw_json::string_equals(key, "offset", 6))
+                offset_ = strtoll(value.to_string().c_str(), NULL, 10);
+            else if (raw_json::string_equals(key, "update_seq", 10))
+                update_seq_ = value.to_string();
+            else if (raw_json::string_equals(key, "error", 5))
+                error_ = raw_json::decode_string(value);
+            else if (raw_json::string_equals(key, "reason", 6))
+                reason_ = raw_json::decode_string(value);
+        }
+
+        parse_state state_;
+        std::string buffer_;
+        size_t pos_;
+
+        json::int_t total_rows_;
+        json::int_t offset_;
+        std::string update_seq_;
+        std::string error_;
+        std::string reason_;
+    };
+
+    /* row_iterator class - An input iterator over the rows of any row source with a `bool next(view_row &)` member
+     * (e.g. view_stream). Rows are consumed from the source as the iterator advances.
+     */
+
+    template<typename source>
+    class row_iterator
+    {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef view_row value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const view_row *pointer;
+        typedef const view_row &reference;
+
+        row_iterator() : source_(NULL) {}
+        explicit row_iterator(source *src) : source_(src) {++*this;}
+
+        reference operator*() const {return row_;}
+        pointer operator->() const {return &row_;}
+
+        row_iterator &operator++()
+        {
+            if (source_ && !source_->next(row_))
+                source_ = NULL;
+            return *this;
+        }
+
+        bool operator==(const row_iterator &other) const {return source_ == other.source_;}
+        bool operator!=(const row_iterator &other) const {return source_ != other.source_;}
+
+    private:
+        source *source_;
+        view_row row_;
+    };
+
+    /* view_stream class - Reads the rows of a view (or _all_docs) response one at a time, as they arrive from the network.
+     *
+     * Only the row currently being parsed is held in memory, so arbitrarily large views can be iterated.
+     * The stream shares the communication object it was created with. Clients that multiplex a single
+     * connection (e.g. poco_http_impl) must finish or close() the stream before issuing other requests.
+     */
+
+    template<typename http_client>
+    class view_stream
+    {
+        view_stream(const view_stream &) {}
+        view_stream &operator=(const view_stream &) {return *this;}
+
+    public:
+        typedef communication<http_client> communication_type;
+        typedef typename http_client::response_handle_type response_handle_type;
+
+        typedef row_iterator<view_stream> iterator;
+
+        view_stream(std::shared_ptr<communication_type> comm, const std::string &url, const std::string &db_url,
+                    const std::string &method = "GET", const std::string &data = "")
+            : comm_(comm)
+            , handle_(comm->get_client().invalid_handle())
+            , db_url_(std::make_shared<const std::string>(db_url))
+            , open_(false)
+        {
+            handle_ = comm_->get_raw_data_response(url, method, typename communication_type::header_map(), data);
+            open_ = comm_->get_client().is_active_handle(handle_);
+            if (!open_)
+                throw error(error::view_unavailable, "Could not open view stream", method + ' ' + url);
+        }
+        ~view_stream()
+        {
+            try {close();} catch (...) {}
+        }
+
+        // Returns an iterator to the first unread row. Rows are consumed as the iterator advances.
+        iterator begin() {return iterator(this);}
+        iterator end() {return iterator();}
+
+        // Reads the next row. Returns false when there are no more rows.
+        bool next(view_row &row)
+        {
+            while (!parser_.next(row, db_url_))
+            {
+                if (parser_.finished())
+                {
+                    finish();
+                    return false;
+                }
+
+                read();
+            }
+
+            return true;
+        }
+
+        // Returns the total_rows and offset members of the response, or -1 if not present
+        // These will block until the part of the response preceding the rows has been received
+        json::int_t total_rows() {read_header(); return parser_.total_rows();}
+        json::int_t offset() {read_header(); return parser_.offset();}
+
+        // Returns true if all rows have been read
+        bool finished() const {return parser_.finished();}
+
+        // Stops reading the response. If not all rows were read, the underlying connection is closed.
+        void close()
+        {
+            if (!open_)
+                return;
+
+            open_ = false;
+            comm_->get_client().release_response_handle(handle_);
+            handle_ = comm_->get_client().invalid_handle();
+        }
+
+    private:
+        void read_header()
+        {
+            while (!parser_.next_header())
+                read();
+        }
+
+        void read()
+        {
+            if (!open_)
+                throw error(error::connection_lost, "View stream was closed before the response was complete");
+
+            std::string line = comm_->get_client().read_line_from_response_handle(handle_);
+            if (!line.empty())
+            {
+                parser_.append_line(line);
+                return;
+            }
+
+            // An empty line from a blocking handle (or an inactive handle) means the response was truncated
+            if (comm_->get_client().is_response_handle_blocking() || !comm_->get_client().is_active_handle(handle_))
+            {
+                close();
+                throw error(error::connection_lost, "View response ended unexpectedly");
+            }
+
+            comm_->get_client().wait_for_response_handle(handle_, std::chrono::milliseconds(100));
+        }
+
+        void finish()
+        {
+            if (open_ && comm_->get_client().is_response_handle_blocking())
+            {
+                // Drain the end of the response so the connection can be reused
+                while (comm_->get_client().is_active_handle(handle_) &&
+                       !comm_->get_client().read_line_from_response_handle(handle_).empty())
+                    ;
+            }
+
+            close();
+
+            if (!parser_.error_name().empty())
+                throw error(error::view_unavailable, parser_.error_name() + ": " + parser_.error_reason());
+        }
+
+        std::shared_ptr<communication_type> comm_;
+        response_handle_type handle_;
+        std::shared_ptr<const std::string> db_url_;
+        view_response_parser parser_;
+        bool open_;
+    };
+}
+
+#endif // CPPCOUCH_VIEWSTREAM_H
@@ -3,10 +3,17 @@
 
 #include "communication.h"
 #include "connection.h"
+#include "changes_filter.h"
+#include "checkpoint.h"
+#include "raw_json.h"
 #include <json.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <thread>
+#include <type_traits>
 
 namespace couchdb
 {
@@ -18,6 +25,9 @@ namespace couchdb
      * The signals are fired in the context of the changes-feed thread, not the main thread
      * (unless the main thread is the changes-feed thread).
      *
+     * If the feed delivers changes in batches (see changes::set_batching()), changes_occured() is fired once per batch
+     * instead. By default it fires change_occured() for each change, but it may be reimplemented to handle a batch at once.
+     *
      * Usage from the main thread MUST attempt to lock the mutex member before use.
      *
      * NOTE: this class is not copyable, since it has a std::mutex member. Subclasses must take that into
@@ -34,6 +44,11 @@ namespace couchdb
 
         virtual void changes_feed_opened() {}
         virtual void change_occured(const json::value &change) = 0;
+        virtual void changes_occured(const std::vector<json::value> &changes)
+        {
+            for (const json::value &change: changes)
+                change_occured(change);
+        }
         virtual void changes_feed_closed() {}
 
         bool try_lock() {return mutex_.try_lock();}
@@ -41,13 +56,120 @@ namespace couchdb
         void unlock() {mutex_.unlock();}
     };
 
+    /* change_record struct - The fields of a change that most handlers need, found by scanning the raw JSON text
+     * of the change instead of building a json::value tree.
+     *
+     * The references point into the text being delivered, so they are only valid during the signal. The id and rev
+     * members do not include quotes, but are still escaped as in the JSON text, so use id_string() and rev_string()
+     * if the values may contain escapes. For the line that ends a feed, seq refers to its last_seq and id is empty.
+     */
+    struct change_record
+    {
+        change_record() : deleted(false) {}
+
+        string_ref raw; // The complete change object
+        string_ref seq; // The raw JSON sequence, a string (including quotes) or a number
+        string_ref id;
+        string_ref rev; // The first revision listed in "changes"
+        bool deleted;
+
+        // Returns the sequence as used in a "since" query
+        std::string seq_string() const
+        {
+            return !seq.empty() && seq[0] == '"'? raw_json::decode_string(seq): seq.to_string();
+        }
+
+        std::string id_string() const {return unescape(id);}
+        std::string rev_string() const {return unescape(rev);}
+
+        // Returns true if the change includes the document, i.e. the feed was requested with include_docs=true
+        bool has_doc() const {return !doc_.empty();}
+
+        // Parses the document included in the change, or returns null if it is not included
+        json::value doc() const {return raw_json::to_json(doc_);}
+
+        // Parses the complete change
+        json::value to_json() const {return raw_json::to_json(raw);}
+
+        // Finds the fields of the raw JSON change object. Returns false if it is not an object.
+        static bool parse(string_ref raw, change_record &record)
+        {
+            record = change_record();
+            record.raw = raw;
+
+            return raw_json::for_each_member(raw, [&record](string_ref key, string_ref value)
+            {
+                if (raw_json::string_equals(key, "seq", 3) || raw_json::string_equals(key, "last_seq", 8))
+                    record.seq = value;
+                else if (raw_json::string_equals(key, "id", 2))
+                    record.id = unquote(value);
+                else if (raw_json::string_equals(key, "deleted", 7))
+                    record.deleted = value == string_ref("true", 4);
+                else if (raw_json::string_equals(key, "doc", 3))
+                    record.doc_ = value;
+                else if (raw_json::string_equals(key, "changes", 7))
+                {
+                    raw_json::for_each_element(value, [&record](string_ref change)
+                    {
+                        record.rev = unquote(raw_json::find_member(change, "rev"));
+                        return false;
+                    });
+                }
+                return true;
+            });
+        }
+
+    private:
+        static string_ref unquote(string_ref value)
+        {
+            return value.size() >= 2 && value[0] == '"'? string_ref(value.begin() + 1, value.end() - 1): string_ref();
+        }
+
+        // The quotes around the content are still in the buffer
+        static std::string unescape(string_ref content)
+        {
+            if (content.empty() || memchr(content.data(), '\\', content.size()) == NULL)
+                return content.to_string();
+            return raw_json::decode_string(string_ref(content.begin() - 1, content.end() + 1));
+        }
+
+        string_ref doc_;
+    };
+
+    /* change_record_signal_base class - This class is a base class for changes-feed signal handlers that only need the
+     * fields of a change_record. Subclasses must reimplement the change_record_occured() member.
+     *
+     * The changes class fires change_record_occured() (or change_records_occured() for a batch) directly from the text
+     * of the feed, so a change is only parsed completely if the handler calls change_record::doc() or to_json().
+     * Components that deliver already parsed changes fire change_occured(), which is forwarded as a record.
+     */
+    class change_record_signal_base : public signal_base
+    {
+    public:
+        virtual void change_record_occured(const change_record &change) = 0;
+        virtual void change_records_occured(const std::vector<change_record> &changes)
+        {
+            for (const change_record &change: changes)
+                change_record_occured(change);
+        }
+
+        void change_occured(const json::value &change)
+        {
+            std::string text = json_to_string(change);
+            change_record record;
+            change_record::parse(text, record);
+            change_record_occured(record);
+        }
+    };
+
     /* changes_feed_thread class - This class is a high-level changes-feed handler, and manages a separate thread
      * for watching changes. Begin a new feed with start_in_other_thread(), which issues requests entirely in a new
      * thread, or use start_in_this_thread(), followed by run_in_other_thread() to connect in the current thread and
      * watch for changes in the managed thread.
      *
      * To stop the feed, use stop() (blocking) or try_stop() (non-blocking, returns false on failure) which just stop the feed,
-     * not the managed thread. To stop the feed AND managed thread, use stop_and_wait_for_finish() to ensure the
+     * not the managed thread. If reconnecting is enabled with set_reconnect(), a feed started in the managed thread reopens
+     * itself from the last delivered sequence when the connection is lost, until it is stopped. To stop the feed AND managed thread, use stop_and_wait_for_finish() to ensure the
      * process is entirely shut down, or use stop_and_detach() to stop the process and detach the thread to finish on its own.
      *
      * NOTE: this class is not copyable, since the signaller, thread, and changes classes are not copyable.
@@ -59,7 +181,7 @@ namespace couchdb
      * However, the communication_editor class exists to provide a mutex-lockable method of viewing or editing communication settings on an existing feed.
      * Simply create a communication_editor, with the changes feed as a parameter, and then use the communication() function to change settings.
      * Change signals will be frozen while the communication_editor exists. To unfreeze signals and apply changes to the communication object,
-     * destroy the communication_editor.
+     * destroy the communication_editor. Creating one waits for the read or wait in progress on the feed, if any, to finish.
      */
     template<typename http_client, typename signal_type>
     class changes_feed_thread
@@ -81,6 +203,14 @@ namespace couchdb
         void start_and_run_in_other_thread(const queries &q) {changes_feed.start_in_thread(thread, q);}
         void run_in_this_thread() {changes_feed.run_in_this_thread();}
         void run_in_other_thread() {changes_feed.run_in_thread(thread);}
+        void set_batching(size_t max_batch_size, std::chrono::milliseconds max_latency = std::chrono::milliseconds(100)) {changes_feed.set_batching(max_batch_size, max_latency);}
+        void set_catch_up(size_t page_size = 1000) {changes_feed.set_catch_up(page_size);}
+        void set_filter(const changes_filter &filter) {changes_feed.set_filter(filter);}
+        void set_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {changes_feed.set_heartbeat(interval, timeout);}
+        void set_checkpointing(std::shared_ptr<checkpoint_store> store, std::chrono::milliseconds interval = std::chrono::milliseconds(1000)) {changes_feed.set_checkpointing(store, interval);}
+        void set_reconnect(bool enabled, std::chrono::milliseconds min_delay = std::chrono::milliseconds(500), std::chrono::milliseconds max_delay = std::chrono::milliseconds(30000)) {changes_feed.set_reconnect(enabled, min_delay, max_delay);}
+        std::string last_seq() const {return changes_feed.last_seq();}
+        void checkpoint() {changes_feed.checkpoint();}
         void stop() {changes_feed.stop();}
         bool try_stop() {return changes_feed.try_stop();}
 
@@ -110,6 +240,10 @@ namespace couchdb
      * When a change is made in CouchDB, this class will emit the signal change_occured() with CouchDB's update.
      * When the feed is stopped by stop(), the changes_feed_closed() signal will be emitted.
      * This class should not be touched by the signal handler.
+     *
+     * The sequence of the last change delivered to the signal handler is kept, and returned by last_seq(). If a
+     * checkpoint_store is set with set_checkpointing(), the sequence is saved to it at most once per interval (and
+     * when the feed ends), and a feed started without a "since" query resumes from the saved sequence.
      */
     template<typename http_client, typename signal_type>
     class changes
@@ -121,7 +255,7 @@ namespace couchdb
         typedef communication<http_client> communication_type;
         typedef database<http_client> database_type;
 
-        mutable std::mutex comm_mutex, err_mutex;
+        mutable std::mutex comm_mutex, err_mutex, seq_mutex;
 
     public:
         class communication_editor
@@ -134,7 +268,16 @@ namespace couchdb
             communication_editor &operator=(communication_editor &&) = delete;
 
         public:
-            communication_editor(changes &feed_ptr) : feed(&feed_ptr) {feed->comm_mutex.lock();}
+            // Waits until the feed thread is not reading, since it uses the communication object without holding the mutex
+            communication_editor(changes &feed_ptr) : feed(&feed_ptr)
+            {
+                std::unique_lock<std::mutex> lock(feed->comm_mutex);
+                ++feed->editors;
+                feed->reading_changed.wait(lock, [this]{return !feed->reading;});
+                --feed->editors;
+                feed->reading_changed.notify_all();
+                lock.release();
+            }
             ~communication_editor() {feed->comm_mutex.unlock();}
 
             communication_type &communication() {return *feed->comm;}
@@ -151,6 +294,22 @@ namespace couchdb
             , comm(std::make_shared<communication_type>(http_client(database.get_connection().lowest_level().get_client())))
             , handle(comm->get_client().invalid_handle())
             , stop_requested(false)
+            , reading(false)
+            , editors(0)
+            , max_batch_size(1)
+            , max_latency(0)
+            , catch_up_page_size(0)
+            , reopening(false)
+            , lag_limit(0)
+            , backlog(0)
+            , heartbeat(0)
+            , heartbeat_timeout(0)
+            , heartbeat_lost(false)
+            , heartbeat_retried(false)
+            , reconnect(false)
+            , min_reconnect_delay(500)
+            , max_reconnect_delay(30000)
+            , checkpoint_interval(1000)
             , has_error(false)
             , err(error::unknown_error)
         {
@@ -164,10 +323,16 @@ namespace couchdb
         bool is_active() const
         {
             std::lock_guard<std::mutex> lock(comm_mutex);
-            return comm->get_client().is_active_handle(handle) && !stop_requested;
+            return !stop_requested && handle != comm->get_client().invalid_handle() && (reading || comm->get_client().is_active_handle(handle));
         }
 
-        // Starts a continuous feed with the provided queries in the current thread
+        /* Starts a continuous feed with the provided queries in the current thread.
+         * If the queries do not contain "since", the feed starts from the last delivered sequence, or from the sequence
+         * saved in the checkpoint store if no change was delivered yet.
+         *
+         * If catching up is enabled with set_catch_up(), the changes since that sequence are delivered first, in pages,
+         * before the continuous feed is opened.
+         */
         void start(const queries &options = queries())
         {
             {
@@ -175,37 +340,260 @@ namespace couchdb
                 has_error = false;
             }
 
-            std::lock_guard<std::mutex> lock(comm_mutex);
-            if (handle == comm->get_client().invalid_handle())
+            queries q = options;
+            if (std::find_if(q.begin(), q.end(), [](const query &item){return item.first == "since";}) == q.end())
             {
-                std::string url = "/" + url_encode(db.get_db_name()) + "/_changes?feed=continuous";
-                handle = comm->get_raw_data_response(add_url_queries(url, options));
+                std::string since = resume_seq();
+                if (!since.empty())
+                    q.push_back(query("since", url_encode(since)));
+            }
+
+            bool opened;
+            size_t page_size;
+            std::string body;
+
+            {
+                std::lock_guard<std::mutex> lock(comm_mutex);
+                if (handle != comm->get_client().invalid_handle())
+                    return;
+                page_size = catch_up_page_size;
+
+                // A feed reopened because it fell behind was never closed for the signaller
+                opened = reopening;
+                reopening = false;
+
+                queries filter_queries = filter.to_queries();
+                q.insert(q.end(), filter_queries.begin(), filter_queries.end());
+                body = filter.body();
+            }
+            backlog = 0;
 
+            try {open(q, body, page_size, opened);}
+            catch (...)
+            {
+                if (opened)
                 {
                     std::lock_guard<std::mutex> lock(signaller.mutex());
-                    signaller.changes_feed_opened();
+                    signaller.changes_feed_closed();
                 }
+                throw;
             }
         }
 
         // This function never returns unless the feed is shutdown externally (i.e. not by this process), or by an error
         void run_in_this_thread() {run(this);}
 
+        /* Sets how changes are delivered to the signaller. If `max_batch_size` is greater than 1, changes are collected and
+         * delivered with a single changes_occured() signal (and a single lock of the signaller), once `max_batch_size` changes
+         * are waiting, no more data is available, a heartbeat arrives, or the first waiting change is older than `max_latency`.
+         *
+         * NOTE: with blocking network clients, the latency is only checked when a line arrives, so use a heartbeat
+         * no longer than `max_latency` when following a quiet database.
+         */
+        void set_batching(size_t max_batch_size, std::chrono::milliseconds max_latency = std::chrono::milliseconds(100))
+        {
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            this->max_batch_size = max_batch_size;
+            this->max_latency = max_latency;
+            batch.reserve(max_batch_size);
+        }
+
+        /* Sets whether start() catches up with the database using feed=normal requests of up to `page_size` changes,
+         * before following the continuous feed. Each page is parsed at once and delivered with a single changes_occured()
+         * signal, which is much faster than reading a continuous feed line by line when the feed is far behind.
+         * Catching up ends when CouchDB reports no pending changes (or a page is not full), and the continuous feed then
+         * starts from the last sequence of the last page. The other queries, like include_docs or filter, apply to
+         * both modes. A page size of zero disables catching up.
+         *
+         * NOTE: catching up happens when start() opens the feed, which includes reconnections. If the feed runs in a thread
+         * started with start_in_thread() or start_in_new_thread(), a continuous feed that reads `page_size` changes in a row
+         * while more are already waiting is considered behind, and is reopened the same way, without firing
+         * changes_feed_closed() or changes_feed_opened(). Feeds run with run_in_this_thread() keep reading line by line.
+         */
+        void set_catch_up(size_t page_size = 1000)
+        {
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            catch_up_page_size = page_size;
+        }
+
+        /* Sets the server-side filter of the feed, which applies from the next call to start(), in both catch-up and
+         * continuous modes. Filters with a body, like selectors and document IDs, open the feed with a POST request.
+         * An empty filter disables filtering. Do not pass a "filter" query to start() as well.
+         */
+        void set_filter(const changes_filter &filter)
+        {
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            this->filter = filter;
+        }
+
+        /* Sets whether the continuous feed asks CouchDB to send a blank line every `interval` while no change occurs,
+         * so that a silently dropped connection is noticed within `timeout` (twice the interval if zero), instead of when
+         * the operating system gives up on it. A feed that receives nothing, not even a heartbeat, for that long is torn down
+         * and, if it runs in a thread started with start_in_thread() or start_in_new_thread(), reopened at once from the last
+         * delivered sequence. Further failures before data arrives again follow set_reconnect(). An interval of zero disables heartbeats.
+         *
+         * NOTE: the network client must implement wait_for_response_handle() for missed heartbeats to be detected.
+         */
+        void set_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds timeout = std::chrono::milliseconds(0))
+        {
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            heartbeat = interval;
+            heartbeat_timeout = interval.count() == 0? interval: timeout.count()? timeout: interval * 2;
+        }
+
+        /* Sets where the sequence of the last delivered change is saved, and how often. An empty pointer disables checkpointing.
+         * Errors raised by the store are reported by error_was_raised() and last_error(), but do not stop the feed.
+         */
+        void set_checkpointing(std::shared_ptr<checkpoint_store> store, std::chrono::milliseconds interval = std::chrono::milliseconds(1000))
+        {
+            std::lock_guard<std::mutex> lock(seq_mutex);
+            this->store = store;
+            checkpoint_interval = interval;
+            saved_seq.clear();
+        }
+
+        /* Sets whether a feed started with start_in_thread() or start_in_new_thread() reconnects when its connection is lost
+         * or cannot be opened. The feed reopens from the last delivered sequence, waiting `min_delay` before the first attempt,
+         * and twice as long after each failed attempt, up to `max_delay`. The signal handler sees changes_feed_closed()
+         * and changes_feed_opened() around each reconnection.
+         */
+        void set_reconnect(bool enabled, std::chrono::milliseconds min_delay = std::chrono::milliseconds(500), std::chrono::milliseconds max_delay = std::chrono::milliseconds(30000))
+        {
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            reconnect = enabled;
+            min_reconnect_delay = min_delay;
+            max_reconnect_delay = std::max(min_delay, max_delay);
+        }
+
+        // Returns the sequence of the last change delivered to the signaller, or an empty string if none was delivered yet
+        std::string last_seq() const
+        {
+            std::lock_guard<std::mutex> lock(seq_mutex);
+            return seq;
+        }
+
+        // Saves the sequence of the last delivered change to the checkpoint store now, if it changed since the last save
+        void checkpoint() {save_checkpoint(true);}
+
         // Waits for a single change or heartbeat signal to arrive
         void wait_for_changes()
         {
             std::string line;
+            bool more = false;
+            use_handle([this, &line, &more](http_client &client, response_handle_type handle)
+            {
+                line = client.read_line_from_response_handle(handle);
+                if (lag_limit && !line.empty())
+                    more = client.wait_for_response_handle(handle, std::chrono::milliseconds(0));
+            });
+
+            // Changes read while more data was already waiting show that the feed is behind
+            backlog = more? backlog + 1: 0;
 
             {
                 std::lock_guard<std::mutex> lock(comm_mutex);
-                line = comm->get_client().read_line_from_response_handle(handle);
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                if (!line.empty())
+                {
+                    last_activity = now;
+                    heartbeat_retried = false;
+                }
+
+                if (max_batch_size > 1 || !batch.empty())
+                {
+                    bool received = !line.empty();
+                    if (received)
+                    {
+                        if (batch.empty())
+                            batch_started = now;
+                        batch.push_back(std::move(line));
+                        line.clear();
+                    }
+
+                    if (!batch.empty() && (batch.size() >= max_batch_size || !received || now - batch_started >= max_latency))
+                        delivery.swap(batch);
+                }
             }
 
-            if (!line.empty())
+            if (!delivery.empty())
             {
-                std::lock_guard<std::mutex> lock(signaller.mutex());
-                signaller.change_occured(string_to_json(line));
+                deliver(delivery, uses_records());
+                delivery.clear();
             }
+            else if (!line.empty())
+                deliver(line, uses_records());
+
+            close_if_stopped();
+        }
+
+        /* Waits until data arrives on the feed, or until the timeout elapses, and returns false if the heartbeat timeout
+         * elapsed without any data, not even a heartbeat. Without heartbeats, blocking feeds return at once and wait in the next read.
+         * The wait is event-driven if the network client supports it, so an idle feed does not use any CPU.
+         * The feed's mutex is not held while waiting, so stop() interrupts the wait.
+         */
+        bool wait_for_data(std::chrono::milliseconds timeout)
+        {
+            std::chrono::milliseconds max_silence;
+            std::chrono::steady_clock::time_point deadline;
+
+            {
+                std::lock_guard<std::mutex> lock(comm_mutex);
+                max_silence = heartbeat_timeout;
+                deadline = last_activity + heartbeat_timeout;
+            }
+
+            bool received = false, lost = false;
+            use_handle([&](http_client &client, response_handle_type handle)
+            {
+                // Without heartbeats, only non-blocking feeds wait here, as blocking feeds wait in their next read
+                if (!max_silence.count())
+                {
+                    if (!client.is_response_handle_blocking())
+                        client.wait_for_response_handle(handle, timeout);
+                    return;
+                }
+
+                // A blocking feed keeps waiting until the deadline, since its next read would not return without data
+                for (std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(); now < deadline; now = std::chrono::steady_clock::now())
+                {
+                    std::chrono::milliseconds remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now) + std::chrono::milliseconds(1);
+                    if (client.wait_for_response_handle(handle, std::min(timeout, remaining)))
+                    {
+                        received = true;
+                        return;
+                    }
+                    else if (!client.is_response_handle_blocking())
+                        return;
+                }
+
+                lost = true;
+            });
+            close_if_stopped();
+
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            if (received)
+            {
+                last_activity = std::chrono::steady_clock::now();
+                heartbeat_retried = false;
+            }
+            else if (lost)
+                heartbeat_lost = true;
+            return !lost;
+        }
+
+        // Delivers any changes waiting to be sent in a batch
+        void flush_changes()
+        {
+            {
+                std::lock_guard<std::mutex> lock(comm_mutex);
+                if (batch.empty())
+                    return;
+
+                delivery.swap(batch);
+            }
+
+            deliver(delivery, uses_records());
+            delivery.clear();
         }
 
         // Starts and runs a continuous feed with the provided queries in a new thread and returns the new thread
@@ -235,21 +623,11 @@ namespace couchdb
 
         // Stops the current feed (not the thread it operates in),
         // blocking until the feed is shut down completely or has been requested to shut down
+        // If the feed thread is reading, its read is interrupted and the feed thread closes the feed
         void stop()
         {
             std::lock_guard<std::mutex> lock(comm_mutex);
-            if (handle != comm->get_client().invalid_handle())
-            {
-                comm->get_client().reset();
-                handle = comm->get_client().invalid_handle();
-
-                {
-                    std::lock_guard<std::mutex> lock(signaller.mutex());
-                    signaller.changes_feed_closed();
-                }
-            }
-            else
-                stop_requested = true;
+            request_stop();
         }
 
         // Same as stop(), but if it cannot request a stop immediately, will return false.
@@ -259,19 +637,7 @@ namespace couchdb
             if (comm_mutex.try_lock())
             {
                 std::lock_guard<std::mutex> lock(comm_mutex, std::adopt_lock);
-                if (handle != comm->get_client().invalid_handle())
-                {
-                    comm->get_client().reset();
-                    handle = comm->get_client().invalid_handle();
-
-                    {
-                        std::lock_guard<std::mutex> lock(signaller.mutex());
-                        signaller.changes_feed_closed();
-                    }
-                }
-                else
-                    stop_requested = true;
-
+                request_stop();
                 return true;
             }
             return false;
@@ -298,21 +664,62 @@ namespace couchdb
 
         static void start_and_run(changes *changes_feed, const queries &q)
         {
-            try
-            {
-                changes_feed->start(q);
-                std::this_thread::yield();
-                run(changes_feed);
-            } catch (couchdb::error e)
-            {
-                std::lock_guard<std::mutex> lock(changes_feed->err_mutex);
-                changes_feed->has_error = true;
-                changes_feed->err = e;
-            }
+            std::chrono::milliseconds delay(0);
+            bool resume = false;
 
+            while (true)
             {
+                bool clean = false;
+
+                {
+                    std::lock_guard<std::mutex> lock(changes_feed->comm_mutex);
+                    changes_feed->lag_limit = changes_feed->catch_up_page_size;
+                }
+
+                try
+                {
+                    // Reconnections resume from the last delivered sequence, instead of the requested one
+                    changes_feed->start(resume? changes_feed->resume_queries(q): q);
+                    delay = std::chrono::milliseconds(0);
+                    std::this_thread::yield();
+                    clean = run(changes_feed);
+                } catch (couchdb::error e)
+                {
+                    std::lock_guard<std::mutex> lock(changes_feed->err_mutex);
+                    changes_feed->has_error = true;
+                    changes_feed->err = e;
+                }
+
                 std::unique_lock<std::mutex> lock(changes_feed->comm_mutex);
 
+                // A feed that fell behind is reopened at once, which catches up in pages
+                if (changes_feed->reopening)
+                {
+                    resume = true;
+                    continue;
+                }
+
+                // A missed heartbeat means the connection went silent, not that the server failed, so reopen at once,
+                // but only once until data arrives again, as the server may be unable to answer
+                if (!clean && changes_feed->heartbeat_lost && !changes_feed->heartbeat_retried && !changes_feed->stop_requested &&
+                        changes_feed->handle == changes_feed->comm->get_client().invalid_handle())
+                {
+                    changes_feed->heartbeat_lost = false;
+                    changes_feed->heartbeat_retried = true;
+                    resume = true;
+                    continue;
+                }
+
+                if (!clean && changes_feed->reconnect && !changes_feed->stop_requested &&
+                        changes_feed->handle == changes_feed->comm->get_client().invalid_handle())
+                {
+                    resume = true;
+                    delay = delay.count()? std::min(delay * 2, changes_feed->max_reconnect_delay): changes_feed->min_reconnect_delay;
+                    changes_feed->reconnect_wait.wait_for(lock, delay, [changes_feed]{return changes_feed->stop_requested;});
+                    if (!changes_feed->stop_requested)
+                        continue;
+                }
+
                 // If the handle is not invalid, it wasn't a clean shutdown (note that the handle may be valid, but inactive)
                 if (changes_feed->handle != changes_feed->comm->get_client().invalid_handle())
                 {
@@ -329,29 +736,141 @@ namespace couchdb
                     lock.lock();
                 }
                 changes_feed->stop_requested = false;
+                break;
+            }
+
+            // Only start_and_run() reopens a feed that fell behind
+            changes_feed->lag_limit = 0;
+        }
+
+        typedef typename http_client::response_handle_type response_handle_type;
+
+        /* Calls `f` with the client and the handle of the feed, without holding comm_mutex, so that reading or waiting
+         * on the feed does not keep stop() or the other members from running. Returns false without calling `f` if the
+         * feed is closed or being stopped. The caller must call close_if_stopped() afterwards.
+         */
+        template<typename function>
+        bool use_handle(function f)
+        {
+            response_handle_type current;
+
+            {
+                // Let a waiting communication_editor in first, or it could wait for many reads
+                std::unique_lock<std::mutex> lock(comm_mutex);
+                reading_changed.wait(lock, [this]{return editors == 0;});
+                if (stop_requested || handle == comm->get_client().invalid_handle())
+                    return false;
+
+                current = handle;
+                reading = true;
+            }
+
+            try
+            {
+                f(comm->get_client(), current);
+            } catch (...)
+            {
+                done_reading();
+                throw;
+            }
+
+            done_reading();
+            return true;
+        }
+
+        // Returns true if the feed read enough changes in a row while more were waiting to be reopened by catching up
+        bool behind() const {return lag_limit && backlog >= lag_limit;}
+
+        void done_reading()
+        {
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            reading = false;
+            reading_changed.notify_all();
+        }
+
+        /* Returns how long a non-blocking feed waits for data before reading again: until the waiting batch is due, if any,
+         * or at most a second, so a client that cannot interrupt a wait still notices stop() in time.
+         */
+        std::chrono::milliseconds idle_wait() const
+        {
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            if (batch.empty())
+                return std::chrono::milliseconds(1000);
+
+            std::chrono::steady_clock::duration due = batch_started + max_latency - std::chrono::steady_clock::now();
+            return std::max(std::chrono::duration_cast<std::chrono::milliseconds>(due), std::chrono::milliseconds(0)) + std::chrono::milliseconds(1);
+        }
+
+        // Closes the feed if stop() was called while the handle was in use
+        void close_if_stopped()
+        {
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            if (stop_requested && !reading && handle != comm->get_client().invalid_handle())
+                close_handle();
+        }
+
+        // Must be called with comm_mutex locked
+        void request_stop()
+        {
+            if (handle != comm->get_client().invalid_handle() && reading)
+            {
+                stop_requested = true;
+                comm->get_client().interrupt_response_handle(handle);
+            }
+            else if (handle != comm->get_client().invalid_handle())
+                close_handle();
+            else
+            {
+                stop_requested = true;
+                reconnect_wait.notify_all();
             }
         }
 
-        static void run(changes *changes_feed)
+        // Must be called with comm_mutex locked and the handle not in use
+        // The handle is released first, so the client stops delivering data to it
+        void close_handle()
         {
+            comm->get_client().release_response_handle(handle);
+            comm->get_client().reset();
+            handle = comm->get_client().invalid_handle();
+            stop_requested = false;
+
+            {
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.changes_feed_closed();
+            }
+        }
+
+        // Returns true if the feed was shut down by stop(), or false if it ended by itself or by an error
+        static bool run(changes *changes_feed)
+        {
+            bool clean = false, lagging = false;
+
             try
             {
                 if (changes_feed->feed_blocks_on_reads())
                 {
-                    while (changes_feed->is_active())
+                    while (changes_feed->is_active() && !changes_feed->behind() && changes_feed->wait_for_data(std::chrono::milliseconds::max()))
                     {
                         changes_feed->wait_for_changes();
+                        changes_feed->save_checkpoint(false);
                         std::this_thread::yield();
                     }
                 }
                 else
                 {
-                    while (changes_feed->is_active())
+                    while (changes_feed->is_active() && !changes_feed->behind())
                     {
                         changes_feed->wait_for_changes();
-                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                        changes_feed->save_checkpoint(false);
+                        if (!changes_feed->wait_for_data(changes_feed->idle_wait()))
+                            break;
                     }
                 }
+
+                changes_feed->flush_changes();
+                changes_feed->save_checkpoint(true);
+                lagging = changes_feed->behind();
             } catch (couchdb::error e)
             {
                 std::lock_guard<std::mutex> lock(changes_feed->err_mutex);
@@ -362,6 +881,15 @@ namespace couchdb
             {
                 std::unique_lock<std::mutex> lock(changes_feed->comm_mutex);
 
+                // A feed that fell behind is released without firing changes_feed_closed(), for start_and_run() to reopen
+                if (lagging && !changes_feed->stop_requested && changes_feed->handle != changes_feed->comm->get_client().invalid_handle())
+                {
+                    changes_feed->comm->get_client().release_response_handle(changes_feed->handle);
+                    changes_feed->comm->get_client().reset();
+                    changes_feed->handle = changes_feed->comm->get_client().invalid_handle();
+                    changes_feed->reopening = true;
+                }
+
                 // If the handle is not invalid, it wasn't a clean shutdown (note that the handle may be valid, but inactive)
                 if (changes_feed->handle != changes_feed->comm->get_client().invalid_handle())
                 {
@@ -370,6 +898,8 @@ namespace couchdb
                     changes_feed->err = couchdb::error(couchdb::error::connection_lost);
                     changes_feed->stop_requested = true;
                 }
+                else
+                    clean = true;
 
                 if (changes_feed->stop_requested)
                 {
@@ -379,6 +909,320 @@ namespace couchdb
                 }
                 changes_feed->stop_requested = false;
             }
+
+            return clean;
+        }
+
+        // Records the sequence of a delivered change, or of the last_seq line that ends a feed
+        void set_seq(const json::value &change)
+        {
+            json::value value = change["seq"];
+            if (value.is_null())
+                value = change["last_seq"];
+            if (value.is_null())
+                return;
+
+            std::lock_guard<std::mutex> lock(seq_mutex);
+            seq = value.is_string()? value.get_string(): json_to_string(value);
+        }
+
+        void set_seq(const change_record &change)
+        {
+            if (change.seq.empty())
+                return;
+
+            std::string value = change.seq_string();
+            std::lock_guard<std::mutex> lock(seq_mutex);
+            seq.swap(value);
+        }
+
+        // Signallers derived from change_record_signal_base receive records decoded from the raw lines
+        typedef std::integral_constant<bool, std::is_base_of<change_record_signal_base, signal_type>::value> uses_records;
+
+        void deliver(const std::string &line, std::false_type)
+        {
+            json::value change = string_to_json(line);
+
+            {
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.change_occured(change);
+            }
+            set_seq(change);
+        }
+
+        void deliver(const std::string &line, std::true_type)
+        {
+            change_record change;
+            if (!change_record::parse(line, change))
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.change_record_occured(change);
+            }
+            set_seq(change);
+        }
+
+        void deliver(const std::vector<std::string> &lines, std::false_type)
+        {
+            std::vector<json::value> changes;
+            changes.reserve(lines.size());
+            for (const std::string &line: lines)
+                changes.push_back(string_to_json(line));
+
+            {
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.changes_occured(changes);
+            }
+            set_seq(changes.back());
+        }
+
+        void deliver(const std::vector<std::string> &lines, std::true_type)
+        {
+            std::vector<change_record> changes;
+            changes.reserve(lines.size());
+            for (const std::string &line: lines)
+            {
+                changes.push_back(change_record());
+                if (!change_record::parse(line, changes.back()))
+                    changes.pop_back();
+            }
+
+            if (changes.empty())
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.change_records_occured(changes);
+            }
+            set_seq(changes.back());
+        }
+
+        // Delivers a page of changes from a feed=normal request, and returns true if no changes are pending
+        bool deliver_page(const std::string &page, size_t page_size, std::false_type)
+        {
+            json::value response = string_to_json(page);
+            if (!response.is_object() || !response["results"].is_array())
+                throw error(error::bad_response, "Invalid changes feed response");
+
+            const json::array_t &results = response["results"].get_array();
+            if (!results.empty())
+            {
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.changes_occured(results);
+            }
+            set_seq(response);
+
+            // CouchDB 1.x does not report pending changes
+            const json::value &pending = response["pending"];
+            return pending.is_int()? pending.get_int() == 0: results.size() < page_size;
+        }
+
+        bool deliver_page(const std::string &page, size_t page_size, std::true_type)
+        {
+            std::vector<change_record> changes;
+            change_record end;
+            json::int_t pending = -1;
+
+            bool valid = raw_json::for_each_member(page, [&](string_ref key, string_ref value)
+            {
+                if (raw_json::string_equals(key, "results", 7))
+                {
+                    if (!raw_json::for_each_element(value, [&changes](string_ref change)
+                        {
+                            changes.push_back(change_record());
+                            if (!change_record::parse(change, changes.back()))
+                                changes.pop_back();
+                            return true;
+                        }))
+                        throw error(error::bad_response, "Invalid changes feed response");
+                }
+                else if (raw_json::string_equals(key, "last_seq", 8))
+                    end.seq = value;
+                else if (raw_json::string_equals(key, "pending", 7) && !raw_json::to_number(value, pending))
+                    pending = -1;
+                return true;
+            });
+
+            if (!valid)
+                throw error(error::bad_response, "Invalid changes feed response");
+
+            if (!changes.empty())
+            {
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.change_records_occured(changes);
+            }
+            set_seq(end.seq.empty() && !changes.empty()? changes.back(): end);
+
+            // CouchDB 1.x does not report pending changes
+            return pending >= 0? pending == 0: changes.size() < page_size;
+        }
+
+        // Returns the sequence to resume the feed from, loading it from the checkpoint store if no change was delivered yet
+        std::string resume_seq()
+        {
+            std::lock_guard<std::mutex> lock(seq_mutex);
+            if (seq.empty() && store)
+            {
+                try {saved_seq = seq = store->load();}
+                catch (const error &e)
+                {
+                    std::lock_guard<std::mutex> lock(err_mutex);
+                    has_error = true;
+                    err = e;
+                }
+            }
+            return seq;
+        }
+
+        /* Catches up in pages if `page_size` is not zero, then opens the continuous feed from where catching up ended.
+         * Fires changes_feed_opened() unless `opened` is set, and sets it once fired.
+         */
+        void open(queries q, const std::string &body, size_t page_size, bool &opened)
+        {
+            if (page_size)
+                q = catch_up(q, body, page_size, opened);
+
+            // A stop() requested before the continuous feed is opened, e.g. while catching up, keeps it from opening
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            if (stop_requested)
+            {
+                stop_requested = false;
+                if (opened)
+                {
+                    std::lock_guard<std::mutex> lock(signaller.mutex());
+                    signaller.changes_feed_closed();
+                }
+            }
+            else if (handle == comm->get_client().invalid_handle())
+            {
+                std::string url = "/" + url_encode(db.get_db_name()) + "/_changes?feed=continuous";
+                if (heartbeat.count() && std::find_if(q.begin(), q.end(), [](const query &item){return item.first == "heartbeat";}) == q.end())
+                    q.push_back(query("heartbeat", std::to_string(heartbeat.count())));
+
+                if (body.empty())
+                    handle = comm->get_raw_data_response(add_url_queries(url, q));
+                else
+                    handle = comm->get_raw_data_response(add_url_queries(url, q), "POST", typename communication_type::header_map(), body);
+                last_activity = std::chrono::steady_clock::now();
+                heartbeat_lost = false;
+
+                if (!opened)
+                {
+                    std::lock_guard<std::mutex> lock(signaller.mutex());
+                    signaller.changes_feed_opened();
+                }
+                opened = true;
+            }
+        }
+
+        /* Delivers the changes since the sequence in the queries with feed=normal requests, and returns the queries
+         * with "since" moved to the last sequence delivered. The requests are POSTed with `body` if it is not empty.
+         * `opened` is set once changes_feed_opened() was fired. Returns early if stop() is called between pages.
+         */
+        queries catch_up(const queries &options, const std::string &body, size_t page_size, bool &opened)
+        {
+            queries q;
+            std::string since;
+            for (const query &item: options)
+            {
+                if (item.first == "since")
+                    since = item.second;
+                else
+                    q.push_back(item);
+            }
+
+            std::string url = add_url_queries("/" + url_encode(db.get_db_name()) + "/_changes?feed=normal&limit=" + std::to_string(page_size), q);
+
+            while (true)
+            {
+                std::string page, page_url = since.empty()? url: url + "&since=" + since;
+
+                {
+                    // Like use_handle(), the request is made without comm_mutex, so stop() does not wait for it
+                    std::unique_lock<std::mutex> lock(comm_mutex);
+                    reading_changed.wait(lock, [this]{return editors == 0;});
+                    if (stop_requested)
+                        break;
+
+                    reading = true;
+                }
+
+                try
+                {
+                    if (body.empty())
+                        page = comm->get_raw_data(page_url);
+                    else
+                        page = comm->get_raw_data(page_url, "POST", typename communication_type::header_map(), body);
+                } catch (...)
+                {
+                    done_reading();
+                    throw;
+                }
+
+                done_reading();
+
+                if (!opened)
+                {
+                    std::lock_guard<std::mutex> lock(signaller.mutex());
+                    signaller.changes_feed_opened();
+                    opened = true;
+                }
+
+                bool done = deliver_page(page, page_size, uses_records());
+                save_checkpoint(false);
+
+                std::string seq = last_seq();
+                if (!seq.empty())
+                    since = url_encode(seq);
+
+                if (done)
+                    break;
+            }
+
+            if (!since.empty())
+                q.push_back(query("since", since));
+            return q;
+        }
+
+        // Returns the queries with "since" replaced by the last delivered sequence, if any
+        queries resume_queries(const queries &options)
+        {
+            std::string since = resume_seq();
+            if (since.empty())
+                return options;
+
+            queries q;
+            for (const query &item: options)
+                if (item.first != "since")
+                    q.push_back(item);
+            q.push_back(query("since", url_encode(since)));
+            return q;
+        }
+
+        // Saves the last delivered sequence if it changed, and if `force` is set or the checkpoint interval has elapsed
+        void save_checkpoint(bool force)
+        {
+            std::lock_guard<std::mutex> lock(seq_mutex);
+            if (!store || seq.empty() || seq == saved_seq)
+                return;
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (!force && now - last_checkpoint < checkpoint_interval)
+                return;
+
+            last_checkpoint = now;
+            try
+            {
+                store->save(seq);
+                saved_seq = seq;
+            }
+            catch (const error &e)
+            {
+                std::lock_guard<std::mutex> lock(err_mutex);
+                has_error = true;
+                err = e;
+            }
         }
 
     private:
@@ -387,6 +1231,34 @@ namespace couchdb
         std::shared_ptr<communication_type> comm; // Protected by comm_mutex
         typename http_client::response_handle_type handle; // Protected by comm_mutex
         bool stop_requested; // Protected by comm_mutex
+        bool reading; // Set while the feed thread uses the handle or requests a page without holding comm_mutex, protected by comm_mutex
+        size_t editors; // Number of communication_editors waiting for the handle, protected by comm_mutex
+        std::condition_variable reading_changed; // Notified when reading or editors is decremented, used with comm_mutex
+
+        size_t max_batch_size; // Protected by comm_mutex
+        std::chrono::milliseconds max_latency; // Protected by comm_mutex
+        std::vector<std::string> batch; // Lines waiting to be delivered, protected by comm_mutex
+        std::chrono::steady_clock::time_point batch_started; // Protected by comm_mutex
+        std::vector<std::string> delivery; // Lines being delivered, only used by the thread running the feed
+
+        size_t catch_up_page_size; // Protected by comm_mutex
+        bool reopening; // Set when the feed was released because it fell behind, until start() reopens it, protected by comm_mutex
+        size_t lag_limit; // Backlog after which the feed is behind, zero if unchecked, only used by the thread running the feed
+        size_t backlog; // Changes read in a row while more were waiting, only used by the thread running the feed
+        changes_filter filter; // Protected by comm_mutex
+        std::chrono::milliseconds heartbeat, heartbeat_timeout; // Protected by comm_mutex
+        std::chrono::steady_clock::time_point last_activity; // When data last arrived on the feed, protected by comm_mutex
+        bool heartbeat_lost; // Set when the feed was torn down because of a missed heartbeat, protected by comm_mutex
+        bool heartbeat_retried; // Set when the feed was reopened at once after a missed heartbeat, until data arrives, protected by comm_mutex
+        bool reconnect; // Protected by comm_mutex
+        std::chrono::milliseconds min_reconnect_delay, max_reconnect_delay; // Protected by comm_mutex
+        std::condition_variable reconnect_wait; // Wakes a waiting reconnection when stop() is called, used with comm_mutex
+
+        std::string seq; // The sequence of the last delivered change, protected by seq_mutex
+        std::shared_ptr<checkpoint_store> store; // Protected by seq_mutex
+        std::chrono::milliseconds checkpoint_interval; // Protected by seq_mutex
+        std::chrono::steady_clock::time_point last_checkpoint; // Protected by seq_mutex
+        std::string saved_seq; // The sequence last saved to the store, protected by seq_mutex
 
         bool has_error; // Protected by err_mutex
         error err; // Protected by err_mutex
@@ -0,0 +1,102 @@
+#ifndef CPPCOUCH_CHANGES_FILTER_H
+#define CPPCOUCH_CHANGES_FILTER_H
+
+#include "shared.h"
+
+namespace couchdb
+{
+    /* changes_filter class - A typed description of a server-side changes feed filter, so that only relevant changes
+     * are sent by CouchDB.
+     *
+     * Filters that take a document (selector() and doc_ids()) are sent in the body of a POST request, so long ID lists
+     * do not have to fit in the URL. The other filters only add query parameters. Parameters for filter functions can
+     * be added with param():
+     *
+     *     feed.set_filter(changes_filter::function("app", "by_type").param("type", "order"))
+     */
+
+    class changes_filter
+    {
+    public:
+        // No filter
+        changes_filter() {}
+
+        // Only changes of documents matching a Mango selector, i.e. filter=_selector (CouchDB 2.0+)
+        static changes_filter selector(const json::value &selector)
+        {
+            changes_filter f("_selector");
+            f.body_ = json::object_t();
+            f.body_["selector"] = selector;
+            return f;
+        }
+
+        // Only changes of the listed documents, i.e. filter=_doc_ids
+        static changes_filter doc_ids(const std::vector<std::string> &ids)
+        {
+            changes_filter f("_doc_ids");
+            json::array_t list;
+            list.reserve(ids.size());
+            for (const std::string &id: ids)
+                list.push_back(id);
+
+            f.body_ = json::object_t();
+            f.body_["doc_ids"] = list;
+            return f;
+        }
+
+        // Only changes of documents that emit a row in the map function of a view, i.e. filter=_view
+        static changes_filter view(const std::string &design, const std::string &view)
+        {
+            changes_filter f("_view");
+            f.params_.push_back(query("view", url_encode(design) + "/" + url_encode(view)));
+            return f;
+        }
+
+        // Only changes of design documents, i.e. filter=_design
+        static changes_filter design_docs() {return changes_filter("_design");}
+
+        // Only changes accepted by a filter function of a design document
+        static changes_filter function(const std::string &design, const std::string &name)
+        {
+            changes_filter f(url_encode(design) + "/" + url_encode(name));
+            return f;
+        }
+
+        // Adds a query parameter, which is passed to filter functions in `req.query`
+        changes_filter &param(const std::string &name, const std::string &value)
+        {
+            params_.push_back(query(url_encode(name), url_encode(value)));
+            return *this;
+        }
+
+        // Returns true if no filter is set
+        bool empty() const {return name_.empty();}
+
+        // Returns true if the filter must be sent in the body of a POST request
+        bool uses_post() const {return body_.is_object();}
+
+        // Returns the query parameters of the filter, already percent-encoded
+        queries to_queries() const
+        {
+            queries q;
+            if (!empty())
+            {
+                q.push_back(query("filter", name_));
+                q.insert(q.end(), params_.begin(), params_.end());
+            }
+            return q;
+        }
+
+        // Returns the body of the POST request, or an empty string if the filter does not use POST
+        std::string body() const {return uses_post()? json_to_string(body_): std::string();}
+
+    private:
+        changes_filter(const std::string &name) : name_(name) {}
+
+        std::string name_; // Percent-encoded
+        queries params_;
+        json::value body_;
+    };
+}
+
+#endif // CPPCOUCH_CHANGES_FILTER_H
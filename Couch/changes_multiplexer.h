@@ -0,0 +1,489 @@
+#ifndef CPPCOUCH_CHANGES_MULTIPLEXER_H
+#define CPPCOUCH_CHANGES_MULTIPLEXER_H
+
+#include "changes.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace couchdb
+{
+    /* changes_multiplexer class - Follows many continuous changes feeds with a small, fixed number of worker threads,
+     * instead of one thread per feed.
+     *
+     * add() opens a feed in the calling thread, with a copy of the multiplexer's client, and hands it to the worker with
+     * the fewest feeds. Workers read only the lines that are available without blocking, and fire changes_occured()
+     * (or change_occured() for a single change) once per feed per sweep. Signallers derived from change_record_signal_base
+     * receive change records instead, without each line being parsed. A feed costs a communication object and a response
+     * handle, not a thread.
+     *
+     * If the client supports notify_response_handle(), as the asio client does on a shared IoServicePool, the threads that
+     * run the connections mark a feed ready when data arrives, and a worker only services its ready feeds. Quiet feeds then
+     * cost nothing, and a worker with no ready feed sleeps until one is. Otherwise, each worker sweeps all its feeds, and
+     * when a sweep finds no data, waits for up to `idle_wait` on the response handle of one of them, taking turns.
+     *
+     * Signallers are fired in the context of a worker thread, with the same locking rules as the changes class, and must
+     * outlive their feed. Workers do not hold their feed list locked while reading or waiting, so add(), remove() and
+     * stop() can be called at any time, from any thread except a worker's. A feed closed by the server or by an error
+     * fires changes_feed_closed() and is removed; the error can be retrieved with last_error().
+     *
+     * NOTE: the network client must either use non-blocking response handles, or override wait_for_response_handle()
+     * so that it returns false if no line can be read yet, otherwise a quiet feed blocks its whole worker. Copies of the
+     * Poco client share a single session, so it cannot be used for more than one feed.
+     */
+    template<typename http_client>
+    class changes_multiplexer
+    {
+        changes_multiplexer(const changes_multiplexer &) = delete;
+        changes_multiplexer &operator=(const changes_multiplexer &) = delete;
+
+        typedef communication<http_client> communication_type;
+        typedef typename http_client::response_handle_type response_handle_type;
+
+    public:
+        typedef database<http_client> database_type;
+        typedef size_t feed_id;
+
+    private:
+        struct feed
+        {
+            feed(std::shared_ptr<communication_type> comm, signal_base &signaller)
+                : comm(comm)
+                , handle(comm->get_client().invalid_handle())
+                , signaller(&signaller)
+                , records(dynamic_cast<change_record_signal_base *>(&signaller))
+                , notified(false)
+                , closed(false)
+            {}
+
+            std::shared_ptr<communication_type> comm;
+            response_handle_type handle;
+            signal_base *signaller;
+            change_record_signal_base *records; // The signaller, if it accepts change records
+            bool notified; // Whether the client marks the feed ready when data arrives, set before the feed is added to its worker
+
+            std::mutex mutex; // Held while the feed is serviced, waited on or closed
+            bool closed; // Protected by mutex
+        };
+
+        struct worker
+        {
+            worker() : polled(0), stop_requested(false), next_wait(0) {}
+
+            std::mutex mutex;
+            std::condition_variable wake;
+            std::map<feed_id, std::shared_ptr<feed>> feeds; // Protected by mutex, which is never held while a feed is serviced
+            std::set<feed_id> ready; // Notified feeds with data to read, protected by mutex
+            size_t polled; // The number of feeds that are not notified, protected by mutex
+            bool stop_requested; // Protected by mutex
+            feed_id next_wait; // The polled feed to wait on when idle, only used by the worker thread
+            std::thread thread;
+        };
+
+    public:
+        /*           threads (IN): The number of worker threads to spread the feeds over.
+         *            client (IN): The client the feeds are opened with. Each feed uses a copy, so copies must be able to share
+         *                         connections between threads, as copies of the asio client share their ConnectionManager.
+         *                         Pass a manager created on an IoServicePool to have workers woken only by feeds with data.
+         *         idle_wait (IN): How long a worker waits for data on one feed when none of its feeds have any, if the client
+         *                         cannot notify.
+         * max_lines_per_sweep (IN): The most lines read from a single feed per sweep, so a busy feed cannot starve the others.
+         */
+        changes_multiplexer(size_t threads = 1,
+                            const http_client &client = http_client(),
+                            std::chrono::milliseconds idle_wait = std::chrono::milliseconds(10),
+                            size_t max_lines_per_sweep = 256)
+            : client(client)
+            , idle_wait(idle_wait)
+            , max_lines_per_sweep(max_lines_per_sweep? max_lines_per_sweep: 1)
+            , next_id(0)
+            , has_error(false)
+            , err(error::unknown_error)
+        {
+            for (size_t i = 0; i < (threads? threads: 1); ++i)
+            {
+                workers.push_back(std::unique_ptr<worker>(new worker()));
+                loads.push_back(0);
+            }
+        }
+        ~changes_multiplexer() {stop();}
+
+        /* Opens a continuous feed of the database with the provided queries and server-side filter, and returns its identifier.
+         * The feed uses a duplicate of the database's communication object, with a copy of the multiplexer's client.
+         * changes_feed_opened() is fired before this function returns.
+         * Throws an error if the feed could not be opened.
+         */
+        feed_id add(database_type db, signal_base &signaller, const queries &options = queries(), const changes_filter &filter = changes_filter())
+        {
+            std::shared_ptr<feed> f = std::make_shared<feed>(db.get_connection().lowest_level().duplicate(client), signaller);
+
+            std::string url = add_url_queries("/" + url_encode(db.get_db_name()) + "/_changes?feed=continuous", options);
+            url = add_url_queries(url, filter.to_queries());
+            if (filter.uses_post())
+                f->handle = f->comm->get_raw_data_response(url, "POST", typename communication_type::header_map(), filter.body());
+            else
+                f->handle = f->comm->get_raw_data_response(url);
+
+            {
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.changes_feed_opened();
+            }
+
+            feed_id id;
+            size_t index = 0;
+
+            {
+                std::lock_guard<std::mutex> lock(mux_mutex);
+                for (size_t i = 1; i < loads.size(); ++i)
+                    if (loads[i] < loads[index])
+                        index = i;
+
+                id = next_id++;
+                owners[id] = index;
+                ++loads[index];
+            }
+
+            worker &w = *workers[index];
+            worker *pw = &w;
+            f->notified = f->comm->get_client().notify_response_handle(f->handle, [pw, id]
+            {
+                {
+                    std::lock_guard<std::mutex> lock(pw->mutex);
+                    pw->ready.insert(id);
+                }
+                pw->wake.notify_all();
+            });
+
+            {
+                // Lines that arrived before the feed was registered are read by its first sweep
+                std::lock_guard<std::mutex> lock(w.mutex);
+                w.feeds[id] = f;
+                if (f->notified)
+                    w.ready.insert(id);
+                else
+                    ++w.polled;
+            }
+            w.wake.notify_all();
+
+            return id;
+        }
+
+        // Closes a feed, firing changes_feed_closed(). Returns false if the feed was already closed.
+        // Blocks until the feed's worker is done servicing or waiting on this feed.
+        bool remove(feed_id id)
+        {
+            size_t index;
+
+            {
+                std::lock_guard<std::mutex> lock(mux_mutex);
+                auto it = owners.find(id);
+                if (it == owners.end())
+                    return false;
+                index = it->second;
+            }
+
+            worker &w = *workers[index];
+            std::shared_ptr<feed> f;
+
+            {
+                std::lock_guard<std::mutex> lock(w.mutex);
+                auto it = w.feeds.find(id);
+                if (it == w.feeds.end())
+                    return false;
+
+                f = it->second;
+                forget(w, it);
+            }
+
+            std::lock_guard<std::mutex> lock(f->mutex);
+            if (f->closed)
+                return false;
+
+            close(id, *f);
+            return true;
+        }
+
+        // Returns true if the feed is still open
+        bool is_active(feed_id id) const
+        {
+            std::lock_guard<std::mutex> lock(mux_mutex);
+            return owners.find(id) != owners.end();
+        }
+
+        // Returns the number of open feeds
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(mux_mutex);
+            return owners.size();
+        }
+
+        // Starts the worker threads
+        void start()
+        {
+            for (auto &w: workers)
+            {
+                if (w->thread.joinable())
+                    continue;
+
+                w->stop_requested = false;
+                std::thread(run, this, w.get()).swap(w->thread);
+            }
+        }
+
+        // Stops the worker threads, blocking until they finish, and closes all feeds
+        void stop()
+        {
+            for (auto &w: workers)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(w->mutex);
+                    w->stop_requested = true;
+                }
+                w->wake.notify_all();
+
+                if (w->thread.joinable())
+                    w->thread.join();
+
+                std::map<feed_id, std::shared_ptr<feed>> feeds;
+                {
+                    std::lock_guard<std::mutex> lock(w->mutex);
+                    feeds.swap(w->feeds);
+                    w->ready.clear();
+                    w->polled = 0;
+                }
+
+                for (auto &item: feeds)
+                {
+                    std::lock_guard<std::mutex> lock(item.second->mutex);
+                    if (!item.second->closed)
+                        close(item.first, *item.second);
+                }
+            }
+        }
+
+        bool error_was_raised() const
+        {
+            std::lock_guard<std::mutex> lock(err_mutex);
+            return has_error;
+        }
+
+        error last_error() const
+        {
+            std::lock_guard<std::mutex> lock(err_mutex);
+            return err;
+        }
+
+    protected:
+        static void run(changes_multiplexer *mux, worker *w)
+        {
+            std::unique_lock<std::mutex> lock(w->mutex);
+
+            while (!w->stop_requested)
+            {
+                if (w->ready.empty() && w->polled == 0)
+                {
+                    // Only notified feeds are left, and none of them has data
+                    w->wake.wait(lock, [w]{return w->stop_requested || !w->ready.empty() || w->polled > 0;});
+                    continue;
+                }
+
+                // Service the ready feeds and all polled feeds with the worker unlocked, so add(), remove() and stop() are never kept waiting
+                std::vector<std::pair<feed_id, std::shared_ptr<feed>>> feeds, polled;
+                for (feed_id id: w->ready)
+                {
+                    auto it = w->feeds.find(id);
+                    if (it != w->feeds.end())
+                        feeds.push_back(*it);
+                }
+                w->ready.clear();
+
+                if (w->polled > 0)
+                    for (auto &item: w->feeds)
+                        if (!item.second->notified)
+                            polled.push_back(item);
+                feeds.insert(feeds.end(), polled.begin(), polled.end());
+                lock.unlock();
+
+                bool received = false;
+                std::vector<feed_id> closed, again;
+                for (auto &item: feeds)
+                {
+                    std::lock_guard<std::mutex> feed_lock(item.second->mutex);
+                    if (item.second->closed)
+                        continue;
+
+                    bool open = true;
+                    received |= mux->service(*item.second, open);
+
+                    if (!open)
+                    {
+                        mux->close(item.first, *item.second);
+                        closed.push_back(item.first);
+                    }
+                    else if (item.second->notified &&
+                             item.second->comm->get_client().wait_for_response_handle(item.second->handle, std::chrono::milliseconds(0)))
+                        again.push_back(item.first); // The sweep stopped before the available lines were all read
+                }
+
+                if (!received && !polled.empty())
+                {
+                    auto it = std::lower_bound(polled.begin(), polled.end(), w->next_wait,
+                                               [](const std::pair<feed_id, std::shared_ptr<feed>> &item, feed_id id) {return item.first < id;});
+                    if (it == polled.end())
+                        it = polled.begin();
+                    w->next_wait = it->first + 1;
+
+                    std::lock_guard<std::mutex> feed_lock(it->second->mutex);
+                    if (!it->second->closed)
+                        it->second->comm->get_client().wait_for_response_handle(it->second->handle, mux->idle_wait);
+                }
+
+                lock.lock();
+                for (feed_id id: closed)
+                {
+                    auto it = w->feeds.find(id);
+                    if (it != w->feeds.end())
+                        forget(*w, it);
+                }
+                w->ready.insert(again.begin(), again.end());
+            }
+        }
+
+        // Removes a feed from its worker, which must be locked
+        static void forget(worker &w, typename std::map<feed_id, std::shared_ptr<feed>>::iterator it)
+        {
+            if (!it->second->notified)
+                --w.polled;
+            w.ready.erase(it->first);
+            w.feeds.erase(it);
+        }
+
+        // Reads the lines available on a feed and fires its signaller, the feed must be locked
+        // Returns true if any line was read, and sets `open` to false if the feed was closed
+        bool service(feed &f, bool &open)
+        {
+            http_client &client = f.comm->get_client();
+            bool blocking = client.is_response_handle_blocking();
+            bool received = false;
+            std::vector<std::string> lines;
+
+            try
+            {
+                for (size_t i = 0; i < max_lines_per_sweep; ++i)
+                {
+                    if (!client.is_active_handle(f.handle))
+                        throw error(error::connection_lost);
+                    else if (blocking && !client.wait_for_response_handle(f.handle, std::chrono::milliseconds(0)))
+                        break;
+
+                    // A blank line is a heartbeat, or, from a non-blocking client, means no more data is available
+                    std::string line = client.read_line_from_response_handle(f.handle);
+                    if (line.empty())
+                    {
+                        if (!blocking)
+                            break;
+                        continue;
+                    }
+
+                    received = true;
+                    lines.push_back(std::move(line));
+                }
+            }
+            catch (const error &e)
+            {
+                open = false;
+
+                std::lock_guard<std::mutex> lock(err_mutex);
+                has_error = true;
+                err = e;
+            }
+
+            if (!lines.empty())
+                deliver(f, lines);
+
+            return received;
+        }
+
+        // Fires the feed's signaller with the lines read in a sweep, decoded as records if the signaller accepts them
+        void deliver(feed &f, const std::vector<std::string> &lines)
+        {
+            if (f.records)
+            {
+                std::vector<change_record> changes;
+                changes.reserve(lines.size());
+                for (const std::string &line: lines)
+                {
+                    changes.push_back(change_record());
+                    if (!change_record::parse(line, changes.back()))
+                        changes.pop_back();
+                }
+
+                if (changes.empty())
+                    return;
+
+                std::lock_guard<std::mutex> lock(f.signaller->mutex());
+                if (changes.size() == 1)
+                    f.records->change_record_occured(changes.front());
+                else
+                    f.records->change_records_occured(changes);
+            }
+            else
+            {
+                std::vector<json::value> changes;
+                changes.reserve(lines.size());
+                for (const std::string &line: lines)
+                    changes.push_back(string_to_json(line));
+
+                std::lock_guard<std::mutex> lock(f.signaller->mutex());
+                if (changes.size() == 1)
+                    f.signaller->change_occured(changes.front());
+                else
+                    f.signaller->changes_occured(changes);
+            }
+        }
+
+        // Releases the feed's response handle and fires changes_feed_closed(), the feed must be locked
+        void close(feed_id id, feed &f)
+        {
+            f.closed = true;
+            f.comm->get_client().release_response_handle(f.handle);
+            f.handle = f.comm->get_client().invalid_handle();
+
+            {
+                std::lock_guard<std::mutex> lock(f.signaller->mutex());
+                f.signaller->changes_feed_closed();
+            }
+
+            std::lock_guard<std::mutex> lock(mux_mutex);
+            auto it = owners.find(id);
+            if (it != owners.end())
+            {
+                --loads[it->second];
+                owners.erase(it);
+            }
+        }
+
+    private:
+        mutable std::mutex mux_mutex, err_mutex;
+
+        const http_client client; // Copied by each feed
+        std::chrono::milliseconds idle_wait;
+        size_t max_lines_per_sweep;
+
+        std::vector<std::unique_ptr<worker>> workers;
+        std::map<feed_id, size_t> owners; // The worker index of each open feed, protected by mux_mutex
+        std::vector<size_t> loads; // The number of feeds of each worker, protected by mux_mutex
+        feed_id next_id; // Protected by mux_mutex
+
+        bool has_error; // Protected by err_mutex
+        error err; // Protected by err_mutex
+    };
+}
+
+#endif // CPPCOUCH_CHANGES_MULTIPLEXER_H
@@ -0,0 +1,841 @@
+#ifndef CPPCOUCH_CHANGES_QUEUE_H
+#define CPPCOUCH_CHANGES_QUEUE_H
+
+#include "changes.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdint.h>
+
+namespace couchdb
+{
+    /* changes_queue class - A bounded, lock-free queue used to hand changes from the thread reading a changes feed
+     * to the threads handling them.
+     *
+     * Pushing and popping never take a lock while the queue is neither full nor empty. The queue may have any number
+     * of producers and consumers, but it is designed for a single producer (the network thread). The capacity is
+     * rounded up to a power of two.
+     *
+     * When the queue is full, push() applies the queue's overflow policy:
+     *     block_when_full - wait until a consumer makes room (or the queue is closed)
+     *       drop_oldest   - discard the oldest change in the queue to make room
+     *             spill   - move the change (and all following changes, to keep them in order) to an unbounded
+     *                       overflow list, which is drained once the queue is empty
+     *
+     * Once close()d, push() discards changes, and pop() returns false when the queue is empty.
+     */
+
+    template<typename T = json::value>
+    class changes_queue
+    {
+        changes_queue(const changes_queue &) {}
+        void operator=(const changes_queue &) {}
+
+        struct cell
+        {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+
+    public:
+        enum overflow_policy
+        {
+            block_when_full,
+            drop_oldest,
+            spill
+        };
+
+        /* changes_queue::stats struct - A snapshot of the queue's metrics
+         */
+
+        struct stats
+        {
+            size_t capacity;
+            size_t depth;           // Number of changes waiting in the queue, including spilled changes
+            size_t max_depth;       // Highest depth reached
+            size_t spilled_depth;   // Number of changes waiting in the overflow list
+            uint64_t pushed;        // Total changes pushed
+            uint64_t popped;        // Total changes popped
+            uint64_t dropped;       // Total changes discarded by drop_oldest
+            uint64_t spilled;       // Total changes moved to the overflow list
+            uint64_t full_waits;    // Number of times a producer waited for room
+        };
+
+        changes_queue(size_t capacity = 4096, overflow_policy policy = block_when_full)
+            : mask(round_up(capacity) - 1)
+            , cells(new cell[mask + 1])
+            , policy(policy)
+            , enqueue_pos(0)
+            , dequeue_pos(0)
+            , closed(false)
+            , waiters(0)
+            , spilled_count(0)
+            , max_depth(0)
+            , pushed(0)
+            , popped(0)
+            , dropped(0)
+            , spilled(0)
+            , full_waits(0)
+        {
+            for (size_t i = 0; i <= mask; ++i)
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        // Returns the maximum number of changes held in the queue (excluding spilled changes)
+        size_t capacity() const {return mask + 1;}
+
+        overflow_policy get_overflow_policy() const {return policy;}
+
+        // Adds a change to the queue, applying the overflow policy if the queue is full
+        // Returns false if the change was discarded because the queue is closed
+        bool push(T value)
+        {
+            while (true)
+            {
+                if (closed.load())
+                    return false;
+
+                if (policy == spill && spilled_count.load() > 0)
+                {
+                    std::lock_guard<std::mutex> lock(spill_mutex);
+                    if (!overflow.empty())
+                    {
+                        overflow.push_back(std::move(value));
+                        spilled_count.fetch_add(1);
+                        spilled.fetch_add(1, std::memory_order_relaxed);
+                        break;
+                    }
+                }
+
+                if (try_push(value))
+                    break;
+
+                switch (policy)
+                {
+                    case drop_oldest:
+                    {
+                        T discarded;
+                        if (try_pop(discarded))
+                            dropped.fetch_add(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                    case spill:
+                    {
+                        std::lock_guard<std::mutex> lock(spill_mutex);
+                        overflow.push_back(std::move(value));
+                        spilled_count.fetch_add(1);
+                        spilled.fetch_add(1, std::memory_order_relaxed);
+                        break;
+                    }
+                    default:
+                    {
+                        full_waits.fetch_add(1, std::memory_order_relaxed);
+                        wait([this]{return !full() || closed.load();});
+                        continue;
+                    }
+                }
+
+                break;
+            }
+
+            pushed.fetch_add(1, std::memory_order_relaxed);
+            update_max_depth();
+            notify();
+            return true;
+        }
+
+        // Removes the oldest change from the queue, waiting until one is available
+        // Returns false if the queue is closed and empty
+        bool pop(T &value)
+        {
+            while (!take(value))
+            {
+                if (closed.load() && empty())
+                    return false;
+
+                wait([this]{return !empty() || closed.load();});
+            }
+
+            notify();
+            return true;
+        }
+
+        // Removes up to `max` changes from the queue and appends them to `values`, waiting until at least one is available
+        // Returns the number of changes removed, or 0 if the queue is closed and empty
+        size_t pop_batch(std::vector<T> &values, size_t max)
+        {
+            T value;
+            if (max == 0 || !pop(value))
+                return 0;
+
+            size_t count = 1;
+            values.push_back(std::move(value));
+
+            while (count < max && take(value))
+            {
+                values.push_back(std::move(value));
+                ++count;
+            }
+
+            notify();
+            return count;
+        }
+
+        // Removes the oldest change from the queue if one is available, without waiting
+        bool try_pop_any(T &value)
+        {
+            if (!take(value))
+                return false;
+
+            notify();
+            return true;
+        }
+
+        // Wakes up all waiting producers and consumers. Changes still in the queue may be popped.
+        void close()
+        {
+            closed.store(true);
+
+            std::lock_guard<std::mutex> lock(wait_mutex);
+            cond.notify_all();
+        }
+
+        bool is_closed() const {return closed.load();}
+
+        // Returns the approximate number of changes waiting, including spilled changes
+        size_t depth() const
+        {
+            size_t enqueued = enqueue_pos.load(std::memory_order_relaxed), dequeued = dequeue_pos.load(std::memory_order_relaxed);
+            return (enqueued > dequeued? enqueued - dequeued: 0) + spilled_count.load(std::memory_order_relaxed);
+        }
+
+        bool empty() const {return depth() == 0;}
+
+        stats get_stats() const
+        {
+            stats s;
+            s.capacity = capacity();
+            s.depth = depth();
+            s.max_depth = max_depth.load(std::memory_order_relaxed);
+            s.spilled_depth = spilled_count.load(std::memory_order_relaxed);
+            s.pushed = pushed.load(std::memory_order_relaxed);
+            s.popped = popped.load(std::memory_order_relaxed);
+            s.dropped = dropped.load(std::memory_order_relaxed);
+            s.spilled = spilled.load(std::memory_order_relaxed);
+            s.full_waits = full_waits.load(std::memory_order_relaxed);
+            return s;
+        }
+
+    private:
+        static size_t round_up(size_t capacity)
+        {
+            size_t result = 2;
+            while (result < capacity)
+                result <<= 1;
+            return result;
+        }
+
+        // Same as try_pop_any(), but leaves notifying waiting producers to the caller
+        bool take(T &value)
+        {
+            if (try_pop(value) || (policy == spill && pop_spilled(value)))
+            {
+                popped.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+
+            return false;
+        }
+
+        bool full() const
+        {
+            return enqueue_pos.load(std::memory_order_relaxed) - dequeue_pos.load(std::memory_order_relaxed) > mask;
+        }
+
+        // Bounded queue algorithm by Dmitry Vyukov. Each cell's sequence tells whether it is ready to be written or read.
+        bool try_push(T &value)
+        {
+            size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+            cell *c;
+
+            while (true)
+            {
+                c = &cells[pos & mask];
+                size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+                if (diff == 0)
+                {
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+
+            c->data = std::move(value);
+            c->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T &value)
+        {
+            size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            cell *c;
+
+            while (true)
+            {
+                c = &cells[pos & mask];
+                size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+                if (diff == 0)
+                {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                    return false;
+                else
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+
+            value = std::move(c->data);
+            c->data = T();
+            c->sequence.store(pos + mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Spilled changes are only popped once the queue is empty, since they are newer than everything in it
+        bool pop_spilled(T &value)
+        {
+            if (spilled_count.load() == 0)
+                return false;
+
+            std::lock_guard<std::mutex> lock(spill_mutex);
+            if (overflow.empty() || !(enqueue_pos.load() == dequeue_pos.load()))
+                return false;
+
+            value = std::move(overflow.front());
+            overflow.pop_front();
+            spilled_count.fetch_sub(1);
+            return true;
+        }
+
+        void update_max_depth()
+        {
+            size_t current = depth(), max = max_depth.load(std::memory_order_relaxed);
+            while (current > max && !max_depth.compare_exchange_weak(max, current, std::memory_order_relaxed))
+                ;
+        }
+
+        /* Waits until the predicate is true. The lock is only taken by threads that have to wait.
+         * The queue positions are not updated under the lock, so a waiter registers itself before checking the predicate,
+         * and a notifier checks for waiters after updating the positions. The fences order each side's store before its
+         * load, so either the waiter sees the update or the notifier sees the waiter. The notifier then takes the lock,
+         * which the waiter holds from its check until it is waiting, so the wakeup cannot be lost.
+         */
+        template<typename predicate>
+        void wait(predicate pred)
+        {
+            std::unique_lock<std::mutex> lock(wait_mutex);
+            waiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (!pred())
+                cond.wait(lock);
+            waiters.fetch_sub(1);
+        }
+
+        // Must be called after every change to the queue positions that a waiter may be waiting for
+        void notify()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters.load() == 0)
+                return;
+
+            std::lock_guard<std::mutex> lock(wait_mutex);
+            cond.notify_all();
+        }
+
+        const size_t mask;
+        std::unique_ptr<cell[]> cells;
+        const overflow_policy policy;
+
+        char pad0[64];
+        std::atomic<size_t> enqueue_pos;
+        char pad1[64];
+        std::atomic<size_t> dequeue_pos;
+        char pad2[64];
+
+        std::atomic<bool> closed;
+
+        std::mutex wait_mutex;
+        std::condition_variable cond;
+        std::atomic<size_t> waiters;
+
+        std::mutex spill_mutex;
+        std::deque<T> overflow; // Protected by spill_mutex
+        std::atomic<size_t> spilled_count;
+
+        std::atomic<size_t> max_depth;
+        std::atomic<uint64_t> pushed, popped, dropped, spilled, full_waits;
+    };
+
+    /* changes_pipeline class - Follows a continuous changes feed with the network reading and the signal handling
+     * in separate threads, so a slow signal handler does not hold up reading the feed.
+     *
+     * The reader thread parses each change and pushes it into a changes_queue. The consumer threads pop changes in
+     * batches and fire changes_occured() on the signaller, locking its mutex once per batch. With more than one
+     * consumer, batches may be handled out of order. changes_feed_closed() fires after all queued changes have
+     * been handled.
+     */
+
+    template<typename http_client, typename signal_type>
+    class changes_pipeline
+    {
+        changes_pipeline(const changes_pipeline &) {}
+        void operator=(const changes_pipeline &) {}
+
+        typedef database<http_client> database_type;
+        typedef changes_queue<json::value> queue_type;
+
+        // Runs in the reader thread and pushes each change into the queue
+        class reader_signal : public signal_base
+        {
+        public:
+            reader_signal(changes_pipeline *pipeline) : pipeline(pipeline) {}
+
+            void changes_feed_opened()
+            {
+                std::lock_guard<std::mutex> lock(pipeline->signaller.mutex());
+                pipeline->signaller.changes_feed_opened();
+            }
+            void change_occured(const json::value &change) {pipeline->queue.push(change);}
+            void changes_feed_closed() {pipeline->queue.close();}
+
+        private:
+            changes_pipeline *pipeline;
+        };
+
+    public:
+        /*           db (IN): The database to follow.
+         *    signaller (IN): The signal handler to fire in the consumer threads. Must outlive the pipeline.
+         *     capacity (IN): The maximum number of changes waiting to be handled before the overflow policy applies.
+         *       policy (IN): What to do when the queue is full.
+         *    consumers (IN): The number of consumer threads.
+         * max_batch_size (IN): The maximum number of changes delivered by a single changes_occured() signal.
+         */
+        changes_pipeline(database_type db, signal_type &signaller, size_t capacity = 4096,
+                         typename queue_type::overflow_policy policy = queue_type::block_when_full,
+                         size_t consumers = 1, size_t max_batch_size = 256)
+            : signaller(signaller)
+            , queue(capacity, policy)
+            , reader(this)
+            , feed(db, reader)
+            , consumer_count(consumers? consumers: 1)
+            , max_batch_size(max_batch_size? max_batch_size: 1)
+        {}
+        ~changes_pipeline() {stop();}
+
+        // Sets the server-side filter of the feed, see changes::set_filter()
+        void set_filter(const changes_filter &filter) {feed.set_filter(filter);}
+
+        // Sets the heartbeat of the feed, see changes::set_heartbeat()
+        void set_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {feed.set_heartbeat(interval, timeout);}
+
+        // Starts the reader and consumer threads, following the feed with the provided queries
+        void start(const queries &q = queries())
+        {
+            for (size_t i = 0; i < consumer_count; ++i)
+                consumers.push_back(std::thread(consume, this));
+
+            feed.start_in_thread(reader_thread, q);
+        }
+
+        // Stops the feed, and blocks until all queued changes have been handled and all threads have finished
+        void stop()
+        {
+            feed.stop();
+            if (reader_thread.joinable())
+                reader_thread.join();
+
+            queue.close();
+            for (std::thread &thread: consumers)
+                thread.join();
+
+            if (!consumers.empty())
+            {
+                consumers.clear();
+
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.changes_feed_closed();
+            }
+        }
+
+        bool is_active() const {return feed.is_active();}
+
+        bool error_was_raised() const {return feed.error_was_raised();}
+        error last_error() const {return feed.last_error();}
+
+        // Returns the queue's metrics, e.g. to monitor how far the consumers are behind the feed
+        typename queue_type::stats get_stats() const {return queue.get_stats();}
+
+    private:
+        static void consume(changes_pipeline *pipeline)
+        {
+            std::vector<json::value> batch;
+            batch.reserve(pipeline->max_batch_size);
+
+            while (pipeline->queue.pop_batch(batch, pipeline->max_batch_size))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(pipeline->signaller.mutex());
+                    pipeline->signaller.changes_occured(batch);
+                }
+                batch.clear();
+            }
+        }
+
+        signal_type &signaller; // Protected by its own mutex in signal_base class
+        queue_type queue;
+        reader_signal reader;
+        changes<http_client, reader_signal> feed;
+
+        size_t consumer_count;
+        size_t max_batch_size;
+
+        std::thread reader_thread;
+        std::vector<std::thread> consumers;
+    };
+
+    /* changes_dispatcher class - Follows a continuous changes feed and handles the changes in parallel, while keeping
+     * the changes of each document in order.
+     *
+     * The reader thread decodes only the id of each change (see change_record), and pushes the change to the queue
+     * of the worker chosen by hashing the id. Each worker parses its changes and fires changes_occured() with them,
+     * in feed order. Since a document always maps to the same worker, its changes are never handled out of order
+     * or at the same time, but changes of different documents are handled concurrently.
+     *
+     * The committed sequence (see committed_seq()) only advances past a change once it and every change before it
+     * have been handled by all workers, so it is always safe to resume from. If a checkpoint_store is set, the committed
+     * sequence is saved to it at most once per interval and when stopped, and start() resumes from it.
+     *
+     * If handling a batch throws, the error is reported by error_was_raised() and last_error(), and the feed is stopped.
+     * The committed sequence stays before the failed batch, so it is delivered again when the dispatcher is restarted.
+     * stop() must still be called to finish the threads.
+     *
+     * NOTE: changes_occured() may be fired from several worker threads at once, so the signaller's mutex is NOT locked
+     * around it, and the signaller must be thread-safe. changes_feed_opened() and changes_feed_closed() are fired with
+     * the mutex locked.
+     */
+
+    template<typename http_client, typename signal_type>
+    class changes_dispatcher
+    {
+        changes_dispatcher(const changes_dispatcher &) = delete;
+        changes_dispatcher &operator=(const changes_dispatcher &) = delete;
+
+        typedef database<http_client> database_type;
+
+        struct item
+        {
+            item() : index(0) {}
+
+            uint64_t index; // Position in the feed
+            std::string text; // The raw change
+        };
+
+        typedef changes_queue<item> queue_type;
+
+        // Runs in the reader thread and routes each change to a worker
+        class reader_signal : public change_record_signal_base
+        {
+        public:
+            reader_signal(changes_dispatcher *dispatcher) : dispatcher(dispatcher) {}
+
+            void changes_feed_opened()
+            {
+                std::lock_guard<std::mutex> lock(dispatcher->signaller.mutex());
+                dispatcher->signaller.changes_feed_opened();
+            }
+            void change_record_occured(const change_record &change) {dispatcher->route(change);}
+
+        private:
+            changes_dispatcher *dispatcher;
+        };
+
+    public:
+        /*           db (IN): The database to follow.
+         *    signaller (IN): The signal handler to fire in the worker threads. Must be thread-safe, and outlive the dispatcher.
+         *      workers (IN): The number of worker threads.
+         *     capacity (IN): The maximum number of changes waiting in each worker's queue. The reader waits when a queue is full.
+         * max_batch_size (IN): The maximum number of changes delivered by a single changes_occured() signal.
+         */
+        changes_dispatcher(database_type db, signal_type &signaller, size_t workers = std::thread::hardware_concurrency(),
+                           size_t capacity = 1024, size_t max_batch_size = 64)
+            : signaller(signaller)
+            , reader(this)
+            , feed(db, reader)
+            , worker_count(workers? workers: 1)
+            , capacity(capacity)
+            , max_batch_size(max_batch_size? max_batch_size: 1)
+            , next_index(0)
+            , outstanding(worker_count)
+            , checkpoint_interval(1000)
+        {}
+        ~changes_dispatcher() {stop();}
+
+        /* Sets where the committed sequence is saved, and how often. An empty pointer disables checkpointing.
+         * Errors raised by the store are reported by error_was_raised() and last_error(), but do not stop the feed.
+         */
+        void set_checkpointing(std::shared_ptr<checkpoint_store> store, std::chrono::milliseconds interval = std::chrono::milliseconds(1000))
+        {
+            std::lock_guard<std::mutex> lock(store_mutex);
+            this->store = store;
+            checkpoint_interval = interval;
+            saved_seq.clear();
+        }
+
+        // Sets the server-side filter of the feed, see changes::set_filter()
+        void set_filter(const changes_filter &filter) {feed.set_filter(filter);}
+
+        // Sets the heartbeat of the feed, see changes::set_heartbeat()
+        void set_heartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {feed.set_heartbeat(interval, timeout);}
+
+        // Starts the reader and worker threads, following the feed with the provided queries
+        // If the queries do not contain "since", the feed starts from the sequence saved in the checkpoint store, if any
+        void start(const queries &options = queries())
+        {
+            queries q = options;
+            if (std::find_if(q.begin(), q.end(), [](const query &item){return item.first == "since";}) == q.end())
+            {
+                std::string since = load_checkpoint();
+                if (!since.empty())
+                    q.push_back(query("since", url_encode(since)));
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(store_mutex);
+                worker_error.reset();
+            }
+
+            queues.clear();
+            for (size_t i = 0; i < worker_count; ++i)
+                queues.push_back(std::unique_ptr<queue_type>(new queue_type(capacity)));
+            for (size_t i = 0; i < worker_count; ++i)
+                workers.push_back(std::thread(work, this, i));
+
+            feed.start_in_thread(reader_thread, q);
+        }
+
+        // Stops the feed, and blocks until all queued changes have been handled and all threads have finished
+        void stop()
+        {
+            feed.stop();
+            if (reader_thread.joinable())
+                reader_thread.join();
+
+            for (auto &queue: queues)
+                queue->close();
+            for (std::thread &thread: workers)
+                thread.join();
+
+            if (!workers.empty())
+            {
+                workers.clear();
+                save_checkpoint(true);
+
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                signaller.changes_feed_closed();
+            }
+        }
+
+        bool is_active() const {return feed.is_active();}
+
+        bool error_was_raised() const
+        {
+            std::lock_guard<std::mutex> lock(store_mutex);
+            return worker_error || store_error || feed.error_was_raised();
+        }
+
+        error last_error() const
+        {
+            std::lock_guard<std::mutex> lock(store_mutex);
+            if (worker_error)
+                return *worker_error;
+            return feed.error_was_raised() || !store_error? feed.last_error(): *store_error;
+        }
+
+        // Returns the sequence up to which every change has been handled, or an empty string if none was handled yet
+        std::string committed_seq() const
+        {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            return committed;
+        }
+
+        // Returns the metrics of a worker's queue
+        typename queue_type::stats get_stats(size_t worker) const {return queues.at(worker)->get_stats();}
+
+    private:
+        // Called by the reader thread for each change
+        void route(const change_record &change)
+        {
+            if (change.id.empty()) // The line that ends the feed
+                return;
+
+            item i;
+            size_t worker = std::hash<std::string>()(change.id_string()) % worker_count;
+
+            {
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                i.index = next_index++;
+                outstanding[worker].push_back(i.index);
+                sequences.push_back(std::make_pair(i.index, change.seq_string()));
+            }
+
+            i.text = change.raw.to_string();
+            queues[worker]->push(std::move(i));
+        }
+
+        static void work(changes_dispatcher *dispatcher, size_t worker)
+        {
+            queue_type &queue = *dispatcher->queues[worker];
+            std::vector<item> items;
+            std::vector<json::value> batch;
+            items.reserve(dispatcher->max_batch_size);
+            batch.reserve(dispatcher->max_batch_size);
+
+            bool failed = false;
+            while (queue.pop_batch(items, dispatcher->max_batch_size))
+            {
+                // After a failure, the rest of the queue is discarded
+                if (!failed)
+                {
+                    try
+                    {
+                        for (const item &i: items)
+                            batch.push_back(string_to_json(i.text));
+
+                        dispatcher->signaller.changes_occured(batch);
+                        dispatcher->complete(worker, items.size());
+                    }
+                    catch (const error &e) {failed = true; dispatcher->fail(worker, e);}
+                    catch (const std::exception &e) {failed = true; dispatcher->fail(worker, error(error::unknown_error, e.what()));}
+                    catch (...) {failed = true; dispatcher->fail(worker, error(error::unknown_error));}
+                }
+
+                items.clear();
+                batch.clear();
+            }
+        }
+
+        /* Records an error raised while handling changes, and stops the feed.
+         * The worker's queue is closed first, since the reader may be waiting to push to it with its signaller locked,
+         * which stopping the feed needs. Changes routed to the worker afterwards are dropped without being completed.
+         */
+        void fail(size_t worker, const error &e)
+        {
+            {
+                std::lock_guard<std::mutex> lock(store_mutex);
+                if (!worker_error)
+                    worker_error = std::make_shared<error>(e);
+            }
+
+            queues[worker]->close();
+            feed.stop();
+        }
+
+        // Marks the oldest `count` changes of a worker as handled, and advances the committed sequence
+        void complete(size_t worker, size_t count)
+        {
+            {
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                std::deque<uint64_t> &done = outstanding[worker];
+                done.erase(done.begin(), done.begin() + std::min(count, done.size()));
+
+                // Every change before the oldest outstanding change of any worker has been handled
+                uint64_t low = next_index;
+                for (const std::deque<uint64_t> &o: outstanding)
+                    if (!o.empty())
+                        low = std::min(low, o.front());
+
+                while (!sequences.empty() && sequences.front().first < low)
+                {
+                    committed.swap(sequences.front().second);
+                    sequences.pop_front();
+                }
+            }
+
+            save_checkpoint(false);
+        }
+
+        std::string load_checkpoint()
+        {
+            std::lock_guard<std::mutex> lock(store_mutex);
+            if (!store)
+                return std::string();
+
+            try {saved_seq = store->load();}
+            catch (const error &e) {store_error = std::make_shared<error>(e);}
+            return saved_seq;
+        }
+
+        // Saves the committed sequence if it changed, and if `force` is set or the checkpoint interval has elapsed
+        void save_checkpoint(bool force)
+        {
+            std::lock_guard<std::mutex> lock(store_mutex);
+            if (!store)
+                return;
+
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (!force && now - last_checkpoint < checkpoint_interval)
+                return;
+
+            std::string seq = committed_seq();
+            if (seq.empty() || seq == saved_seq)
+                return;
+
+            last_checkpoint = now;
+            try
+            {
+                store->save(seq);
+                saved_seq = seq;
+            }
+            catch (const error &e) {store_error = std::make_shared<error>(e);}
+        }
+
+        signal_type &signaller; // Only the opened and closed signals are protected by its mutex
+        reader_signal reader;
+        changes<http_client, reader_signal> feed;
+
+        size_t worker_count;
+        size_t capacity;
+        size_t max_batch_size;
+
+        std::thread reader_thread;
+        std::vector<std::thread> workers;
+        std::vector<std::unique_ptr<queue_type>> queues;
+
+        mutable std::mutex progress_mutex, store_mutex;
+        uint64_t next_index; // Protected by progress_mutex
+        std::vector<std::deque<uint64_t>> outstanding; // The feed positions queued to each worker and not handled yet, protected by progress_mutex
+        std::deque<std::pair<uint64_t, std::string>> sequences; // The sequence of each change not committed yet, protected by progress_mutex
+        std::string committed; // Protected by progress_mutex
+
+        std::shared_ptr<checkpoint_store> store; // Protected by store_mutex
+        std::chrono::milliseconds checkpoint_interval; // Protected by store_mutex
+        std::chrono::steady_clock::time_point last_checkpoint; // Protected by store_mutex
+        std::string saved_seq; // Protected by store_mutex
+        std::shared_ptr<error> store_error; // The last error raised by the store, protected by store_mutex
+        std::shared_ptr<error> worker_error; // The first error raised while handling changes, protected by store_mutex
+    };
+}
+
+#endif // CPPCOUCH_CHANGES_QUEUE_H
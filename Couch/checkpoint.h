@@ -0,0 +1,145 @@
+#ifndef CPPCOUCH_CHECKPOINT_H
+#define CPPCOUCH_CHECKPOINT_H
+
+#include "communication.h"
+#include "database.h"
+
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace couchdb
+{
+    /* checkpoint_store class - This class is a base class for the persistent storage of a changes feed's sequence,
+     * so a feed can resume where it left off after a restart. Subclasses must reimplement load() and save().
+     *
+     * load() returns an empty string if no checkpoint was saved. Both may throw an error, which is reported
+     * by the changes feed but does not stop it.
+     */
+    class checkpoint_store
+    {
+    public:
+        virtual ~checkpoint_store() {}
+
+        virtual std::string load() = 0;
+        virtual void save(const std::string &seq) = 0;
+    };
+
+    /* file_checkpoint_store class - Stores a checkpoint in a local file.
+     * The checkpoint is written to a temporary file, flushed to disk, then renamed over the previous one,
+     * so a crash while saving leaves either the previous or the new checkpoint intact.
+     */
+    class file_checkpoint_store : public checkpoint_store
+    {
+    public:
+        file_checkpoint_store(const std::string &path) : path(path) {}
+
+        std::string load()
+        {
+            std::ifstream file(path.c_str(), std::ios_base::in | std::ios_base::binary);
+            return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        }
+
+        void save(const std::string &seq)
+        {
+            std::string temp = path + ".tmp";
+
+            FILE *file = std::fopen(temp.c_str(), "wb");
+            if (file == NULL)
+                throw error(error::unknown_error, "Could not write checkpoint file " + temp);
+
+            bool written = std::fwrite(seq.data(), 1, seq.size(), file) == seq.size() && std::fflush(file) == 0;
+#ifdef _WIN32
+            written = written && _commit(_fileno(file)) == 0;
+#else
+            written = written && fsync(fileno(file)) == 0;
+#endif
+            written = std::fclose(file) == 0 && written;
+            if (!written)
+                throw error(error::unknown_error, "Could not write checkpoint file " + temp);
+
+            // rename() replaces an existing file atomically on POSIX, but fails on Windows if the file exists
+#ifdef _WIN32
+            if (!MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+#else
+            if (std::rename(temp.c_str(), path.c_str()) != 0)
+#endif
+                throw error(error::unknown_error, "Could not replace checkpoint file " + path);
+        }
+
+    private:
+        std::string path;
+    };
+
+    /* local_checkpoint_store class - Stores a checkpoint in a _local document of a database, which is never replicated.
+     * The checkpoint is saved as {"seq": "..."}, in the document `_local/<id>`.
+     *
+     * NOTE: this class uses its own communication object and client, duplicated from the database passed to the constructor.
+     */
+    template<typename http_client>
+    class local_checkpoint_store : public checkpoint_store
+    {
+    public:
+        typedef database<http_client> database_type;
+
+        local_checkpoint_store(database_type db, const std::string &id)
+            : comm(db.get_connection().lowest_level().duplicate())
+            , url("/" + url_encode(db.get_db_name()) + "/_local/" + url_encode(id))
+        {}
+
+        std::string load()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            json::value doc;
+
+            try {doc = comm->get_data(url);}
+            catch (const error &e)
+            {
+                if (e.type() == error::content_not_found)
+                    return std::string();
+                throw;
+            }
+
+            rev = doc["_rev"].get_string("");
+            return doc["seq"].get_string("");
+        }
+
+        void save(const std::string &seq)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            json::value doc = json::object_t();
+            doc["seq"] = seq;
+            if (!rev.empty())
+                doc["_rev"] = rev;
+
+            json::value response;
+            try {response = comm->get_data(url, "PUT", json_to_string(doc));}
+            catch (const error &e)
+            {
+                if (e.type() != error::document_conflict)
+                    throw;
+
+                // Someone else saved the checkpoint, overwrite it with the latest revision
+                doc["_rev"] = comm->get_data(url)["_rev"];
+                response = comm->get_data(url, "PUT", json_to_string(doc));
+            }
+
+            rev = response["rev"].get_string("");
+        }
+
+    private:
+        std::mutex mutex;
+        std::shared_ptr<communication<http_client>> comm; // Protected by mutex
+        std::string url;
+        std::string rev; // Protected by mutex
+    };
+}
+
+#endif // CPPCOUCH_CHECKPOINT_H
@@ -95,6 +95,15 @@ namespace couchdb
 
         http_client &get_client() {return client;}
 
+        // Returns a new communication object with the same state (server URL, credentials, timeout, etc.) using the given client
+        // Communication objects are not thread-safe, so this should be used to make requests from another thread
+        std::shared_ptr<communication> duplicate(const http_client &_client = http_client()) const
+        {
+            std::shared_ptr<communication> result = std::make_shared<communication>(_client);
+            result->set_current_state(d);
+            return result;
+        }
+
         // Save and restore the current state
         // State objects are not modifiable except by this class
         const state &get_current_state() const {return d;}
@@ -13,6 +13,11 @@
 #include "node_connection.h"
 #include "locator.h"
 #include "changes.h"
+#include "changes_queue.h"
+#include "changes_multiplexer.h"
+#include "db_updates.h"
+#include "view_warmer.h"
+#include "materialized_view.h"
 #include "uuid.h"
 
 #endif // CPPCOUCH_H
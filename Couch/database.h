@@ -399,6 +399,17 @@ namespace couchdb
             return docs;
         }
 
+        // Lists documents with the specified options (e.g. include_docs or startkey), returning a stream that reads rows as they arrive
+        // Unlike the list_xxx() functions, the response is never held in memory all at once
+        virtual std::shared_ptr<view_stream<http_client>> all_docs_stream(const view_options &options = view_options())
+        {
+            std::string url = "/" + url_encode(name_) + "/_all_docs";
+            if (!options.empty())
+                url += "?" + options.str();
+
+            return std::make_shared<view_stream<http_client>>(comm_, url, comm_->get_server_url() + "/" + url_encode(name_));
+        }
+
         // Returns a document with given id, and optional revision
         virtual document_type get_doc(const std::string &id, const std::string &rev = "")
         {
@@ -529,7 +540,7 @@ namespace couchdb
                 throw error(error::document_unavailable, response["reason"].get_string());
             }
 
-            return design_document_type(comm_, name_, response["_id"].get_string(), response["_rev"].get_string());
+            return design_document_type(comm_, name_, response["_id"].get_string(), response["_rev"].get_string(), response);
         }
 
         // Creates a design document with given body
@@ -0,0 +1,645 @@
+#ifndef CPPCOUCH_DB_UPDATES_H
+#define CPPCOUCH_DB_UPDATES_H
+
+#include "communication.h"
+#include "connection.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace couchdb
+{
+    /* db_updates_signal_base class - This class is a base class for db_updates_watcher signal handlers.
+     * Subclasses must reimplement the changes_occured() member, which fires with each page of changes caught up
+     * for a database. The convenience functions database_created() and database_deleted() fire when the global
+     * feed reports a database being created or deleted.
+     *
+     * The signals are fired in the context of the watcher's threads, with the mutex member locked.
+     */
+    class db_updates_signal_base
+    {
+        std::mutex mutex_;
+
+    public:
+        virtual ~db_updates_signal_base() {}
+
+        std::mutex &mutex() {return mutex_;}
+
+        virtual void database_created(const std::string &db) {(void) db;}
+        virtual void changes_occured(const std::string &db, const std::vector<json::value> &changes) = 0;
+        virtual void database_deleted(const std::string &db) {(void) db;}
+    };
+
+    /* db_updates_watcher class - Follows the changes of every database on a server with a single connection to
+     * /_db_updates, instead of one continuous feed per database.
+     *
+     * When the global feed reports that a database was updated, the database is queued, and a catch-up thread
+     * requests /db/_changes?since=<checkpoint> in pages of `page_size` until it is up to date. Each page is delivered
+     * with changes_occured(), then the database's checkpoint is moved to the page's last_seq. Updates that arrive
+     * while a database is being caught up are coalesced into a single extra catch-up, and the changes of a database
+     * are always delivered in order. A database that fails to be caught up is retried after a growing delay.
+     *
+     * Databases without a checkpoint are caught up from the start, unless a checkpoint (e.g. "now") is set with
+     * set_checkpoint(). The checkpoints and the sequence of the global feed can be saved and loaded, so a restarted
+     * watcher resumes where it left off. The saved sequence only moves past an update once its database has been caught
+     * up. Without a global sequence, the feed starts from now, and every database with a checkpoint is caught up once
+     * when started.
+     *
+     * NOTE: /_db_updates requires admin rights, and reports sequences only since CouchDB 2.0.
+     * This class uses its own communication objects, copied from the connection passed to the constructor.
+     */
+    template<typename http_client>
+    class db_updates_watcher
+    {
+        db_updates_watcher(const db_updates_watcher &) = delete;
+        db_updates_watcher &operator=(const db_updates_watcher &) = delete;
+
+        typedef communication<http_client> communication_type;
+        typedef connection<http_client> connection_type;
+
+        struct db_info
+        {
+            db_info() : queued(false), running(false), rerun(false), deleted(false), delayed(false), retry(0)
+                , first_update(0), rerun_update(0) {}
+
+            std::string seq; // Empty if the database has no checkpoint
+            bool queued;
+            bool running;
+            bool rerun; // Updated while being caught up
+            bool deleted; // Deleted while being caught up
+            bool delayed; // Waiting to be retried after a failed catch-up
+            std::chrono::milliseconds retry; // Delay before the next retry, zero if the last catch-up did not fail
+            uint64_t first_update; // Number of the oldest global feed line not caught up yet, zero if none
+            uint64_t rerun_update; // Number of the oldest global feed line received while being caught up, zero if none
+        };
+
+    public:
+        // Returns false for databases that should be ignored
+        typedef std::function<bool (const std::string &db)> filter_function;
+
+        /*      conn (IN): The connection to copy the communication settings of.
+         * signaller (IN): The signal handler to fire. Must outlive the watcher.
+         * page_size (IN): The number of changes requested at once when catching up a database.
+         * heartbeat (IN): The heartbeat requested for the global feed. A blocking client only notices stop() when a line
+         *                 arrives, so this also bounds how long stop() may take.
+         */
+        db_updates_watcher(connection_type &conn, db_updates_signal_base &signaller, size_t page_size = 1000,
+                           std::chrono::milliseconds heartbeat = std::chrono::milliseconds(10000))
+            : comm(conn.lowest_level().duplicate())
+            , signaller(signaller)
+            , page_size(page_size? page_size: 1)
+            , heartbeat(heartbeat)
+            , filter(default_filter)
+            , update_count(0)
+            , stop_requested(false)
+            , has_error(false)
+            , err(error::unknown_error)
+        {
+            update_seqs[0] = std::string();
+        }
+        ~db_updates_watcher() {stop();}
+
+        // Sets which databases are followed. By default, databases beginning with '_' and shards are ignored.
+        void set_filter(filter_function f)
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            filter = f? f: default_filter;
+        }
+
+        // Returns the checkpoint of a database, or an empty string if it has none
+        std::string get_checkpoint(const std::string &db) const
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            auto it = dbs.find(db);
+            return it != dbs.end()? it->second.seq: std::string();
+        }
+
+        // Sets the sequence the next catch-up of a database starts from
+        void set_checkpoint(const std::string &db, const std::string &seq)
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            dbs[db].seq = seq;
+        }
+
+        // Returns the checkpoint of every database
+        std::map<std::string, std::string> checkpoints() const
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            std::map<std::string, std::string> result;
+            for (auto it = dbs.begin(); it != dbs.end(); ++it)
+                if (!it->second.seq.empty())
+                    result[it->first] = it->second.seq;
+            return result;
+        }
+
+        /* Returns the sequence of /_db_updates up to which every update has been caught up, or an empty string if it is
+         * unknown. This is the sequence saved by save().
+         */
+        std::string since() const
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            return caught_up_seq();
+        }
+
+        // Returns the number of databases waiting to be caught up or retried
+        size_t pending() const
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            return queue.size() + delayed.size();
+        }
+
+        // Queues a database to be caught up, as if the global feed reported an update
+        void notify_update(const std::string &db)
+        {
+            {
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                if (!filter(db))
+                    return;
+                enqueue(db);
+            }
+            wake.notify_one();
+        }
+
+        // Saves the checkpoints and the sequence of the global feed, so they can be restored later with load()
+        void save(std::ostream &stream) const
+        {
+            json::value saved = json::object_t();
+            json::value &saved_dbs = saved["dbs"] = json::object_t();
+
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            saved["since"] = caught_up_seq();
+            for (auto it = dbs.begin(); it != dbs.end(); ++it)
+                if (!it->second.seq.empty())
+                    saved_dbs[it->first] = it->second.seq;
+
+            stream << json_to_string(saved);
+        }
+
+        // Replaces the checkpoints with ones previously saved with save()
+        void load(std::istream &stream)
+        {
+            std::string data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+            json::value saved = string_to_json(data);
+            if (!saved.is_object() || !saved["dbs"].is_object())
+                throw error(error::invalid_argument, "Invalid database checkpoint data");
+
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            updates_seq = saved["since"].get_string("");
+            update_count = 0;
+            update_seqs.clear();
+            update_seqs[0] = updates_seq;
+            outstanding.clear();
+            for (auto it = dbs.begin(); it != dbs.end(); ++it)
+            {
+                it->second.seq.clear();
+                it->second.first_update = it->second.rerun_update = 0;
+            }
+
+            const json::object_t &saved_dbs = saved["dbs"].get_object();
+            for (auto it = saved_dbs.begin(); it != saved_dbs.end(); ++it)
+                dbs[it->first].seq = it->second.get_string("");
+        }
+
+        // Starts following /_db_updates, with `catch_up_threads` threads catching up updated databases
+        void start(size_t catch_up_threads = 1)
+        {
+            std::lock_guard<std::mutex> lock(thread_mutex);
+            if (feed_thread.joinable())
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                stop_requested = false;
+
+                // Updates made while not watching are only replayed if the global sequence is known
+                if (updates_seq.empty())
+                    for (auto it = dbs.begin(); it != dbs.end(); ++it)
+                        if (!it->second.seq.empty())
+                            enqueue(it->first);
+            }
+
+            for (size_t i = 0; i < (catch_up_threads? catch_up_threads: 1); ++i)
+                catch_up_threads_.push_back(std::thread(catch_up_loop, this, comm->duplicate()));
+            std::thread(follow, this).swap(feed_thread);
+        }
+
+        // Stops the threads, blocking until they finish. Databases being caught up finish their current page first.
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                stop_requested = true;
+            }
+            wake.notify_all();
+
+            std::lock_guard<std::mutex> lock(thread_mutex);
+            if (feed_thread.joinable())
+                feed_thread.join();
+            for (std::thread &thread: catch_up_threads_)
+                thread.join();
+            catch_up_threads_.clear();
+        }
+
+        // Returns true if the watcher threads are running
+        bool is_running() const
+        {
+            std::lock_guard<std::mutex> lock(thread_mutex);
+            return feed_thread.joinable();
+        }
+
+        /* Catches up a database from its checkpoint in the current thread, delivering its changes to the signaller.
+         * Returns the number of changes delivered.
+         *
+         * NOTE: this should not be used on a database that the watcher threads may be catching up at the same time.
+         */
+        size_t catch_up(const std::string &db)
+        {
+            bool complete;
+            return catch_up(*comm->duplicate(), db, complete);
+        }
+
+        bool error_was_raised() const
+        {
+            std::lock_guard<std::mutex> lock(err_mutex);
+            return has_error;
+        }
+
+        error last_error() const
+        {
+            std::lock_guard<std::mutex> lock(err_mutex);
+            return err;
+        }
+
+    protected:
+        static bool default_filter(const std::string &db)
+        {
+            return db.find('_') != 0 && db.find("shards/") != 0;
+        }
+
+        static std::string seq_to_string(const json::value &seq)
+        {
+            return seq.is_string()? seq.get_string(): json_to_string(seq);
+        }
+
+        /* Queues a database to be caught up, must be called with dbs_mutex locked.
+         * `update` is the number of the global feed line that reported the update, or zero if it did not come from
+         * the feed.
+         */
+        void enqueue(const std::string &db, uint64_t update = 0)
+        {
+            db_info &info = dbs[db];
+            if (update && info.running && !info.rerun_update)
+            {
+                info.rerun_update = update;
+                outstanding.insert(update);
+            }
+            else if (update && !info.running && !info.first_update)
+            {
+                info.first_update = update;
+                outstanding.insert(update);
+            }
+
+            if (info.delayed) // Caught up when retried
+                return;
+            else if (info.running)
+                info.rerun = true;
+            else if (!info.queued)
+            {
+                info.queued = true;
+                queue.push_back(db);
+            }
+        }
+
+        // Forgets the global feed lines a database has not been caught up for, must be called with dbs_mutex locked
+        void drop_updates(db_info &info)
+        {
+            if (info.first_update)
+                outstanding.erase(outstanding.find(info.first_update));
+            if (info.rerun_update)
+                outstanding.erase(outstanding.find(info.rerun_update));
+            info.first_update = info.rerun_update = 0;
+        }
+
+        // Returns the number of the line before the oldest one not caught up yet, must be called with dbs_mutex locked
+        uint64_t caught_up_line() const
+        {
+            return outstanding.empty()? update_count: *outstanding.begin() - 1;
+        }
+
+        // Returns the sequence of caught_up_line(), must be called with dbs_mutex locked
+        const std::string &caught_up_seq() const
+        {
+            return update_seqs.find(caught_up_line())->second;
+        }
+
+        void set_error(const error &e)
+        {
+            std::lock_guard<std::mutex> lock(err_mutex);
+            has_error = true;
+            err = e;
+        }
+
+        // Sets `complete` to false if the catch-up was stopped before reaching the end of the database's changes
+        size_t catch_up(communication_type &comm, const std::string &db, bool &complete)
+        {
+            size_t delivered = 0;
+            complete = false;
+
+            while (true)
+            {
+                std::string seq = get_checkpoint(db);
+                std::string url = "/" + url_encode(db) + "/_changes?limit=" + std::to_string(page_size);
+                if (!seq.empty())
+                    url += "&since=" + url_encode(seq);
+
+                json::value response = comm.get_data(url);
+                if (!response.is_object() || !response["results"].is_array())
+                    throw error(error::database_unavailable, "Invalid changes feed response");
+
+                const json::array_t &results = response["results"].get_array();
+                if (!results.empty())
+                {
+                    std::lock_guard<std::mutex> lock(signaller.mutex());
+                    signaller.changes_occured(db, results);
+                    delivered += results.size();
+                }
+
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                db_info &info = dbs[db];
+                if (info.deleted) // Keep the checkpoint cleared
+                    break;
+                else if (response.is_member("last_seq"))
+                    info.seq = seq_to_string(response["last_seq"]);
+
+                if (results.size() < page_size)
+                {
+                    complete = true;
+                    break;
+                }
+                else if (stop_requested)
+                    break;
+            }
+
+            return delivered;
+        }
+
+        /* Updates the state of a database after it was caught up, must be called with dbs_mutex locked.
+         * A failed database is retried after a delay, and one that was not caught up completely is queued again.
+         */
+        void finish(const std::string &db, bool complete, bool failed)
+        {
+            db_info &info = dbs[db];
+            info.running = false;
+
+            if (info.deleted)
+            {
+                info.deleted = false;
+                if (!info.rerun) // Not created again meanwhile
+                {
+                    dbs.erase(db);
+                    return;
+                }
+
+                complete = true;
+                failed = false;
+            }
+
+            if (complete)
+            {
+                if (info.first_update)
+                    outstanding.erase(outstanding.find(info.first_update));
+                info.first_update = info.rerun_update;
+                info.retry = std::chrono::milliseconds(0);
+            }
+            else
+            {
+                if (!info.first_update)
+                    info.first_update = info.rerun_update;
+                else if (info.rerun_update)
+                    outstanding.erase(outstanding.find(info.rerun_update));
+                info.rerun = true;
+            }
+            info.rerun_update = 0;
+
+            if (failed)
+            {
+                info.retry = std::max(info.retry * 2, std::chrono::milliseconds(500));
+                info.retry = std::min(info.retry, std::chrono::milliseconds(30000));
+                info.rerun = false;
+                info.delayed = true;
+                delayed.insert(std::make_pair(std::chrono::steady_clock::now() + info.retry, db));
+            }
+            else if (info.rerun)
+            {
+                info.rerun = false;
+                enqueue(db);
+            }
+        }
+
+        static void catch_up_loop(db_updates_watcher *watcher, std::shared_ptr<communication_type> comm)
+        {
+            std::unique_lock<std::mutex> lock(watcher->dbs_mutex);
+
+            while (!watcher->stop_requested)
+            {
+                // Queue the failed databases whose delay has passed
+                auto now = std::chrono::steady_clock::now();
+                while (!watcher->delayed.empty() && watcher->delayed.begin()->first <= now)
+                {
+                    std::string db = watcher->delayed.begin()->second;
+                    watcher->delayed.erase(watcher->delayed.begin());
+                    watcher->dbs[db].delayed = false;
+                    watcher->enqueue(db);
+                }
+
+                if (watcher->queue.empty())
+                {
+                    if (watcher->delayed.empty())
+                        watcher->wake.wait(lock);
+                    else
+                        watcher->wake.wait_until(lock, watcher->delayed.begin()->first);
+                    continue;
+                }
+
+                std::string db = watcher->queue.front();
+                watcher->queue.pop_front();
+
+                db_info &info = watcher->dbs[db];
+                info.queued = false;
+                info.running = true;
+                lock.unlock();
+
+                bool complete = false, failed = false;
+                try {watcher->catch_up(*comm, db, complete);}
+                catch (const error &e)
+                {
+#ifdef CPPCOUCH_DEBUG
+                    std::cout << "Could not catch up " << db << ": " << e.reason() << std::endl;
+#endif
+                    watcher->set_error(e);
+                    failed = true;
+                }
+
+                lock.lock();
+                watcher->finish(db, complete, failed);
+            }
+        }
+
+        // Handles a single line of the global feed
+        void update(const json::value &line)
+        {
+            if (!line.is_object() || !line["db_name"].is_string())
+                return;
+
+            std::string db = line["db_name"].get_string("");
+            std::string type = line["type"].get_string("");
+            bool followed;
+
+            {
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                if (line.is_member("seq"))
+                    updates_seq = seq_to_string(line["seq"]);
+                update_seqs[++update_count] = updates_seq;
+
+                followed = filter(db);
+                if (followed && type == "deleted")
+                {
+                    auto it = dbs.find(db);
+                    if (it != dbs.end())
+                    {
+                        queue.erase(std::remove(queue.begin(), queue.end(), db), queue.end());
+                        drop_updates(it->second);
+                        if (it->second.delayed)
+                        {
+                            for (auto delayed_it = delayed.begin(); delayed_it != delayed.end(); ++delayed_it)
+                                if (delayed_it->second == db)
+                                {
+                                    delayed.erase(delayed_it);
+                                    break;
+                                }
+                            it->second.delayed = false;
+                        }
+
+                        if (it->second.running)
+                        {
+                            it->second.seq.clear();
+                            it->second.rerun = false;
+                            it->second.deleted = true;
+                        }
+                        else
+                            dbs.erase(it);
+                    }
+                }
+                else if (followed)
+                    enqueue(db, update_count);
+
+                // Only the sequences from the line before the oldest one not caught up yet are needed
+                update_seqs.erase(update_seqs.begin(), update_seqs.find(caught_up_line()));
+            }
+
+            if (!followed)
+                return;
+
+            if (type == "created" || type == "deleted")
+            {
+                std::lock_guard<std::mutex> lock(signaller.mutex());
+                if (type == "created")
+                    signaller.database_created(db);
+                else
+                    signaller.database_deleted(db);
+            }
+
+            wake.notify_one();
+        }
+
+        // Returns the sequence of the last line read from /_db_updates
+        std::string feed_seq() const
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            return updates_seq;
+        }
+
+        bool stopping() const
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            return stop_requested;
+        }
+
+        // Follows /_db_updates, reconnecting with a growing delay if the feed fails
+        static void follow(db_updates_watcher *watcher)
+        {
+            http_client &client = watcher->comm->get_client();
+            std::chrono::milliseconds retry(500);
+
+            while (!watcher->stopping())
+            {
+                typename http_client::response_handle_type handle = client.invalid_handle();
+
+                try
+                {
+                    std::string url = "/_db_updates?feed=continuous&heartbeat=" + std::to_string(watcher->heartbeat.count());
+                    std::string seq = watcher->feed_seq();
+                    url += "&since=" + (seq.empty()? std::string("now"): url_encode(seq));
+
+                    handle = watcher->comm->get_raw_data_response(url);
+                    retry = std::chrono::milliseconds(500);
+
+                    while (!watcher->stopping() && client.is_active_handle(handle))
+                    {
+                        if (!client.wait_for_response_handle(handle, std::chrono::milliseconds(100)))
+                            continue;
+
+                        std::string line = client.read_line_from_response_handle(handle);
+                        if (!line.empty())
+                            watcher->update(string_to_json(line));
+                    }
+                }
+                catch (const error &e)
+                {
+                    watcher->set_error(e);
+                }
+
+                client.release_response_handle(handle);
+
+                std::unique_lock<std::mutex> lock(watcher->dbs_mutex);
+                watcher->wake.wait_for(lock, retry, [watcher]{return watcher->stop_requested;});
+                retry = std::min(retry * 2, std::chrono::milliseconds(30000));
+            }
+        }
+
+    private:
+        mutable std::mutex dbs_mutex, err_mutex, thread_mutex;
+
+        std::shared_ptr<communication_type> comm; // Only used by the feed thread, or by catch_up()
+        db_updates_signal_base &signaller; // Protected by its own mutex
+        size_t page_size;
+        std::chrono::milliseconds heartbeat;
+
+        filter_function filter; // Protected by dbs_mutex
+        std::map<std::string, db_info> dbs; // Protected by dbs_mutex
+        std::deque<std::string> queue; // Databases waiting to be caught up, protected by dbs_mutex
+        std::multimap<std::chrono::steady_clock::time_point, std::string> delayed; // Protected by dbs_mutex
+        std::string updates_seq; // Sequence of the last line read, protected by dbs_mutex
+        uint64_t update_count; // Number of lines read, protected by dbs_mutex
+        std::map<uint64_t, std::string> update_seqs; // Sequence after each line still needed, protected by dbs_mutex
+        std::multiset<uint64_t> outstanding; // first_update and rerun_update of every database, protected by dbs_mutex
+        bool stop_requested; // Protected by dbs_mutex
+        std::condition_variable wake;
+
+        std::thread feed_thread; // Protected by thread_mutex
+        std::vector<std::thread> catch_up_threads_; // Protected by thread_mutex
+
+        bool has_error; // Protected by err_mutex
+        error err; // Protected by err_mutex
+    };
+}
+
+#endif // CPPCOUCH_DB_UPDATES_H
@@ -175,9 +175,9 @@ namespace couchdb
 
         // Returns the body of the document with given queries
         // If include_revision_in_request is false, the most up-to-date revision is used
-        virtual json::value get_data(bool include_revision_in_request, const queries &queries = queries()) const
+        virtual json::value get_data(bool include_revision_in_request, const queries &_queries = queries()) const
         {
-            json::value obj = comm_->get_data(add_url_queries(get_doc_url_path(include_revision_in_request), queries));
+            json::value obj = comm_->get_data(add_url_queries(get_doc_url_path(include_revision_in_request), _queries));
             if (!obj.is_object())
                 throw error(error::document_unavailable);
 
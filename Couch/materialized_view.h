@@ -0,0 +1,454 @@
+#ifndef CPPCOUCH_MATERIALIZED_VIEW_H
+#define CPPCOUCH_MATERIALIZED_VIEW_H
+
+#include "changes.h"
+#include "database.h"
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace couchdb
+{
+    /* view_collation struct - Compares JSON values in the order CouchDB sorts view keys:
+     * null < false < true < numbers < strings < arrays < objects
+     *
+     * Arrays and objects are compared element by element. Strings are compared by code point, not with the
+     * ICU collation CouchDB uses, so strings that differ only in case or accents may sort differently than
+     * they would on the server.
+     */
+
+    struct view_collation
+    {
+        static int rank(const json::value &v)
+        {
+            if (v.is_null())
+                return 0;
+            else if (v.is_bool())
+                return v.get_bool()? 2: 1;
+            else if (v.is_real())
+                return 3;
+            else if (v.is_string())
+                return 4;
+            else if (v.is_array())
+                return 5;
+            return 6;
+        }
+
+        // Returns a negative number if a sorts before b, a positive number if b sorts before a, or zero if they are equal
+        static int compare(const json::value &a, const json::value &b)
+        {
+            int ra = rank(a), rb = rank(b);
+            if (ra != rb)
+                return ra - rb;
+
+            switch (ra)
+            {
+                case 3:
+                    if (a.is_int() && b.is_int())
+                        return a.get_int() < b.get_int()? -1: a.get_int() > b.get_int();
+                    return a.get_real() < b.get_real()? -1: a.get_real() > b.get_real();
+                case 4:
+                    return a.get_string().compare(b.get_string());
+                case 5:
+                {
+                    const json::array_t &la = a.get_array(), &lb = b.get_array();
+                    for (size_t i = 0; i < la.size() && i < lb.size(); ++i)
+                        if (int c = compare(la[i], lb[i]))
+                            return c;
+                    return la.size() < lb.size()? -1: la.size() > lb.size();
+                }
+                case 6:
+                {
+                    const json::object_t &oa = a.get_object(), &ob = b.get_object();
+                    auto ia = oa.begin(), ib = ob.begin();
+                    for (; ia != oa.end() && ib != ob.end(); ++ia, ++ib)
+                    {
+                        if (int c = ia->first.compare(ib->first))
+                            return c;
+                        if (int c = compare(ia->second, ib->second))
+                            return c;
+                    }
+                    return oa.size() < ob.size()? -1: oa.size() > ob.size();
+                }
+                default:
+                    return 0;
+            }
+        }
+
+        bool operator()(const json::value &a, const json::value &b) const {return compare(a, b) < 0;}
+    };
+
+    /* emitter class - Collects the key/value pairs emitted by a materialized_view map function
+     */
+
+    class emitter
+    {
+    public:
+        typedef std::vector<std::pair<json::value, json::value>> rows_type;
+
+        void operator()(const json::value &key, const json::value &value = json::value()) {rows_.push_back(std::make_pair(key, value));}
+
+        const rows_type &rows() const {return rows_;}
+        rows_type &rows() {return rows_;}
+
+    private:
+        rows_type rows_;
+    };
+
+    /* materialized_view class - A view that is computed and stored locally, so it can be queried without any network round trip.
+     *
+     * The user provides a C++ map function, which is called with the id and body of every document and emits key/value pairs,
+     * like a CouchDB map function. The emitted rows are kept in memory, sorted like a CouchDB view (by key, then by document id).
+     * The index is updated incrementally from the database's changes feed, starting from a checkpointed sequence.
+     *
+     * Use sync() to catch up with the database in the current thread, or start() to catch up and then follow a continuous
+     * changes feed in a separate thread. The sequence the index is up to date with is returned by since(), and the index can
+     * be saved and loaded, so it does not have to be rebuilt from the start of the database.
+     *
+     * All member functions are thread-safe. Design documents are never passed to the map function. If the map function
+     * throws an exception, the document is not indexed.
+     */
+    template<typename http_client>
+    class materialized_view
+    {
+        materialized_view(const materialized_view &) {}
+        void operator=(const materialized_view &) {}
+
+        typedef database<http_client> database_type;
+
+        struct index_key
+        {
+            json::value key;
+            std::string id;
+        };
+
+        struct index_compare
+        {
+            bool operator()(const index_key &a, const index_key &b) const
+            {
+                int c = view_collation::compare(a.key, b.key);
+                return c? c < 0: a.id < b.id;
+            }
+        };
+
+        typedef std::multimap<index_key, json::value, index_compare> index_type;
+
+        // Forwards changes from the feed to the view
+        class signal_adaptor : public signal_base
+        {
+        public:
+            signal_adaptor(materialized_view *view) : view(view) {}
+
+            void change_occured(const json::value &change) {view->apply_change(change);}
+
+        private:
+            materialized_view *view;
+        };
+
+    public:
+        typedef std::function<void (const std::string &id, const json::value &doc, emitter &emit)> map_function;
+
+        struct row
+        {
+            json::value key;
+            std::string id;
+            json::value value;
+        };
+
+        /*    db (IN): The database to index.
+         *   map (IN): The map function, which should call `emit(key, value)` for each row to add for the document.
+         * since (IN): The sequence to start following changes from. This should only be used with an index that was load()ed.
+         */
+        materialized_view(database_type db, map_function map, const std::string &since = "0")
+            : db(db)
+            , comm(db.get_connection().lowest_level().duplicate())
+            , map(map)
+            , last_seq(since)
+            , following(false)
+            , signaller(this)
+            , feed(db, signaller)
+        {}
+        ~materialized_view() {stop();}
+
+        // Returns the database this view indexes
+        database_type get_db() {return db;}
+
+        // Returns the sequence of the last change applied to the index
+        std::string since() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return last_seq;
+        }
+
+        // Catches up with the changes made to the database since the last change applied, in the current thread
+        // Changes are requested in pages of `page_size`
+        // Throws an error while the changes feed is followed (between start() and stop()), as the pages would race with the feed
+        void sync(size_t page_size = 1000)
+        {
+            std::lock_guard<std::mutex> lock(sync_mutex);
+            if (following)
+                throw error(error::invalid_argument, "materialized_view::sync() cannot be called while following the changes feed");
+
+            catch_up(page_size);
+        }
+
+        // Catches up with the database, then follows a continuous changes feed in a separate thread until stop() is called
+        void start()
+        {
+            {
+                std::lock_guard<std::mutex> lock(sync_mutex);
+                if (following)
+                    throw error(error::invalid_argument, "materialized_view::start() cannot be called again before stop()");
+
+                catch_up(1000);
+                following = true;
+            }
+
+            queries q;
+            q.push_back(query("include_docs", "true"));
+            q.push_back(query("since", url_encode(since())));
+            feed.start_in_thread(thread, q);
+        }
+
+        // Stops following the changes feed, blocking until the feed thread finishes
+        void stop()
+        {
+            feed.stop();
+            if (thread.joinable())
+                thread.join();
+
+            std::lock_guard<std::mutex> lock(sync_mutex);
+            following = false;
+        }
+
+        // Returns true if the continuous changes feed is active
+        bool is_active() const {return feed.is_active();}
+
+        bool error_was_raised() const {return feed.error_was_raised();}
+        error last_error() const {return feed.last_error();}
+
+        // Applies a change from a changes feed requested with include_docs=true
+        void apply_change(const json::value &change)
+        {
+            std::lock_guard<std::mutex> lock(sync_mutex);
+            apply(change);
+        }
+
+        // Returns all rows with the specified key
+        std::vector<row> lookup(const json::value &key) const {return range(key, key);}
+
+        // Returns the rows with keys from startkey to endkey, at most `limit` rows if not zero
+        std::vector<row> range(const json::value &startkey, const json::value &endkey, bool inclusive_end = true, size_t limit = 0) const
+        {
+            std::vector<row> rows;
+
+            for_each(startkey, endkey, [&](const json::value &key, const std::string &id, const json::value &value)
+            {
+                row r;
+                r.key = key;
+                r.id = id;
+                r.value = value;
+                rows.push_back(r);
+                return limit == 0 || rows.size() < limit;
+            }, inclusive_end);
+
+            return rows;
+        }
+
+        /* Calls `f(key, id, value)` for each row with keys from startkey to endkey, without copying.
+         * If `f` returns false, iteration stops. The index is locked while iterating, so `f` must not modify the view.
+         */
+        template<typename F>
+        void for_each(const json::value &startkey, const json::value &endkey, F f, bool inclusive_end = true) const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            index_key start;
+            start.key = startkey;
+
+            for (auto it = index.lower_bound(start); it != index.end(); ++it)
+            {
+                int c = view_collation::compare(it->first.key, endkey);
+                if (c > 0 || (c == 0 && !inclusive_end))
+                    break;
+
+                if (!f(it->first.key, it->first.id, it->second))
+                    break;
+            }
+        }
+
+        // Returns the number of rows in the index
+        size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return index.size();
+        }
+
+        // Returns the number of documents that emitted at least one row
+        size_t document_count() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return docs.size();
+        }
+
+        // Saves the index and its sequence, so it can be restored later with load()
+        void save(std::ostream &stream) const
+        {
+            json::value saved = json::object_t();
+            json::value &saved_docs = saved["docs"] = json::object_t();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            saved["since"] = last_seq;
+            for (auto doc = docs.begin(); doc != docs.end(); ++doc)
+            {
+                json::array_t &rows = saved_docs[doc->first].get_array();
+                for (auto it: doc->second)
+                {
+                    json::array_t row;
+                    row.push_back(it->first.key);
+                    row.push_back(it->second);
+                    rows.push_back(row);
+                }
+            }
+
+            stream << json_to_string(saved);
+        }
+
+        // Replaces the index with one previously saved with save()
+        void load(std::istream &stream)
+        {
+            std::string data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+            json::value saved = string_to_json(data);
+            if (!saved.is_object() || !saved["docs"].is_object())
+                throw error(error::invalid_argument, "Invalid materialized view data");
+
+            std::lock_guard<std::mutex> lock(mutex);
+            index.clear();
+            docs.clear();
+            last_seq = saved["since"].get_string("0");
+
+            const json::object_t &saved_docs = saved["docs"].get_object();
+            for (auto doc = saved_docs.begin(); doc != saved_docs.end(); ++doc)
+            {
+                emitter::rows_type rows;
+                for (const json::value &r: doc->second.get_array())
+                    if (r.is_array() && r.size() == 2)
+                        rows.push_back(std::make_pair(r[0], r[1]));
+                replace(doc->first, rows);
+            }
+        }
+
+    private:
+        // Requests and applies the changes since the last change applied. Must be called with sync_mutex locked.
+        void catch_up(size_t page_size)
+        {
+            while (true)
+            {
+                std::string url = "/" + url_encode(db.get_db_name()) + "/_changes?include_docs=true&limit=" + std::to_string(page_size) + "&since=" + url_encode(since());
+                json::value response = comm->get_data(url);
+                if (!response.is_object() || !response["results"].is_array())
+                    throw error(error::database_unavailable, "Invalid changes feed response");
+
+                const json::array_t &results = response["results"].get_array();
+                for (const json::value &change: results)
+                    apply(change);
+
+                if (response.is_member("last_seq"))
+                    set_since(response["last_seq"]);
+
+                if (results.size() < page_size)
+                    break;
+            }
+        }
+
+        // Applies a change. Must be called with sync_mutex locked.
+        void apply(const json::value &change)
+        {
+            if (!change.is_object())
+                return;
+            else if (change.is_member("last_seq")) // End of a continuous feed
+            {
+                set_since(change["last_seq"]);
+                return;
+            }
+            else if (!change["id"].is_string())
+                return;
+
+            std::string id = change["id"].get_string();
+            json::value doc = change["doc"];
+            emitter emit;
+
+            if (!change["deleted"].get_bool(false) && doc.is_object() && id.find("_design/") != 0)
+            {
+                try {map(id, doc, emit);}
+                catch (...) {emit.rows().clear();}
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            replace(id, emit.rows());
+            if (change.is_member("seq"))
+                last_seq = seq_to_string(change["seq"]);
+        }
+
+        static std::string seq_to_string(const json::value &seq)
+        {
+            return seq.is_string()? seq.get_string(): json_to_string(seq);
+        }
+
+        void set_since(const json::value &seq)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            last_seq = seq_to_string(seq);
+        }
+
+        // Replaces the rows emitted by a document. Must be called with the mutex locked.
+        void replace(const std::string &id, const emitter::rows_type &rows)
+        {
+            auto doc = docs.find(id);
+            if (doc != docs.end())
+            {
+                for (auto it: doc->second)
+                    index.erase(it);
+
+                if (rows.empty())
+                {
+                    docs.erase(doc);
+                    return;
+                }
+
+                doc->second.clear();
+            }
+            else if (rows.empty())
+                return;
+            else
+                doc = docs.insert(std::make_pair(id, std::vector<typename index_type::iterator>())).first;
+
+            doc->second.reserve(rows.size());
+            for (const auto &r: rows)
+            {
+                index_key key;
+                key.key = r.first;
+                key.id = id;
+                doc->second.push_back(index.insert(std::make_pair(key, r.second)));
+            }
+        }
+
+        database_type db;
+        std::shared_ptr<communication<http_client>> comm; // Duplicated from the database's, as sync() may run in any thread. Protected by sync_mutex
+        map_function map;
+
+        mutable std::mutex mutex, sync_mutex; // sync_mutex serializes the changes applied by sync(), the feed and apply_change()
+        index_type index; // Protected by mutex
+        std::unordered_map<std::string, std::vector<typename index_type::iterator>> docs; // Map of document ID -> rows in the index, protected by mutex
+        std::string last_seq; // Protected by mutex
+        bool following; // Set from start() until stop(), protected by sync_mutex
+
+        signal_adaptor signaller;
+        std::thread thread;
+        changes<http_client, signal_adaptor> feed;
+    };
+}
+
+#endif // CPPCOUCH_MATERIALIZED_VIEW_H
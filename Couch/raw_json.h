@@ -0,0 +1,391 @@
+#ifndef CPPCOUCH_RAW_JSON_H
+#define CPPCOUCH_RAW_JSON_H
+
+#include "shared.h"
+
+#include <ctype.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <locale>
+#include <sstream>
+
+namespace couchdb
+{
+    /* string_ref struct - A non-owning reference to a range of characters. This is used to refer to
+     * parts of a raw JSON buffer without copying them. The referenced buffer must outlive the string_ref.
+     */
+
+    struct string_ref
+    {
+        string_ref() : data_(NULL), size_(0) {}
+        string_ref(const char *data, size_t size) : data_(data), size_(size) {}
+        string_ref(const char *begin, const char *end) : data_(begin), size_(end - begin) {}
+        string_ref(const std::string &str) : data_(str.data()), size_(str.size()) {}
+
+        const char *data() const {return data_;}
+        size_t size() const {return size_;}
+        bool empty() const {return size_ == 0;}
+
+        const char *begin() const {return data_;}
+        const char *end() const {return data_ + size_;}
+
+        char operator[](size_t pos) const {return data_[pos];}
+
+        std::string to_string() const {return empty()? std::string(): std::string(data_, size_);}
+
+        bool operator==(const string_ref &other) const {return size_ == other.size_ && (size_ == 0 || memcmp(data_, other.data_, size_) == 0);}
+        bool operator!=(const string_ref &other) const {return !(*this == other);}
+
+    private:
+        const char *data_;
+        size_t size_;
+    };
+
+    /* raw_json namespace - Functions to scan JSON text without building a json::value tree.
+     *
+     * The skip_xxx() functions take a pointer to the first character of a token and return a pointer
+     * just past the end of it. If the buffer ends before the token is complete, NULL is returned so the
+     * caller can wait for more data. Malformed input throws error::bad_response.
+     */
+
+    namespace raw_json
+    {
+        inline bool is_whitespace(char c) {return c == ' ' || c == '\t' || c == '\r' || c == '\n';}
+
+        inline const char *skip_whitespace(const char *p, const char *end)
+        {
+            while (p != end && is_whitespace(*p))
+                ++p;
+            return p;
+        }
+
+        // p must point to the opening quote
+        inline const char *skip_string(const char *p, const char *end)
+        {
+            if (p == end || *p != '"')
+                throw error(error::bad_response, "Expected JSON string");
+
+            for (++p; p != end; ++p)
+            {
+                if (*p == '\\')
+                {
+                    if (++p == end)
+                        return NULL;
+                }
+                else if (*p == '"')
+                    return p + 1;
+            }
+
+            return NULL;
+        }
+
+        // Scalars that are not followed by a delimiter are considered incomplete
+        inline const char *skip_scalar(const char *p, const char *end)
+        {
+            const char *start = p;
+            while (p != end && !is_whitespace(*p) && !strchr(",:]}", *p))
+            {
+                if (strchr("[{\"", *p))
+                    throw error(error::bad_response, "Malformed JSON value");
+                ++p;
+            }
+
+            if (p == end)
+                return NULL;
+            else if (p == start)
+                throw error(error::bad_response, "Expected JSON value");
+
+            return p;
+        }
+
+        inline const char *skip_value(const char *p, const char *end)
+        {
+            p = skip_whitespace(p, end);
+            if (p == end)
+                return NULL;
+
+            if (*p == '"')
+                return skip_string(p, end);
+            else if (*p != '[' && *p != '{')
+                return skip_scalar(p, end);
+
+            size_t depth = 0;
+            while (p != end)
+            {
+                switch (*p)
+                {
+                    case '"':
+                        p = skip_string(p, end);
+                        if (p == NULL)
+                            return NULL;
+                        continue;
+                    case '[':
+                    case '{':
+                        ++depth;
+                        break;
+                    case ']':
+                    case '}':
+                        if (--depth == 0)
+                            return p + 1;
+                        break;
+                    default:
+                        break;
+                }
+                ++p;
+            }
+
+            return NULL;
+        }
+
+        // Returns the unquoted, unescaped content of the raw JSON string (including quotes)
+        inline std::string decode_string(string_ref raw)
+        {
+            static const char hex[] = "0123456789ABCDEF";
+            std::string result;
+
+            if (raw.size() < 2 || raw[0] != '"' || raw[raw.size()-1] != '"')
+                return result;
+
+            const char *p = raw.begin() + 1, *end = raw.end() - 1;
+            const char *escape = static_cast<const char *>(memchr(p, '\\', end - p));
+            if (escape == NULL) // Fast path, no escape sequences
+                return std::string(p, end);
+
+            result.reserve(end - p);
+            result.append(p, escape);
+            for (p = escape; p != end; ++p)
+            {
+                if (*p != '\\')
+                {
+                    result.push_back(*p);
+                    continue;
+                }
+
+                if (++p == end)
+                    break;
+
+                switch (*p)
+                {
+                    case 'b': result.push_back('\b'); break;
+                    case 'f': result.push_back('\f'); break;
+                    case 'n': result.push_back('\n'); break;
+                    case 'r': result.push_back('\r'); break;
+                    case 't': result.push_back('\t'); break;
+                    case 'u':
+                    {
+                        uint32_t code = 0;
+                        for (int i = 0; i < 4; ++i)
+                        {
+                            if (++p == end)
+                                throw error(error::bad_response, "Unexpected end of JSON string");
+                            const char *pos = strchr(hex, toupper(static_cast<unsigned char>(*p)));
+                            if (pos == NULL || *pos == 0)
+                                throw error(error::bad_response, "Invalid JSON escape sequence");
+                            code = (code << 4) | (pos - hex);
+                        }
+
+                        // Combine UTF-16 surrogate pairs
+                        if (code >= 0xD800 && code < 0xDC00 && end - p > 6 && p[1] == '\\' && p[2] == 'u')
+                        {
+                            uint32_t low = 0;
+                            bool valid = true;
+                            for (int i = 3; i < 7 && valid; ++i)
+                            {
+                                const char *pos = strchr(hex, toupper(static_cast<unsigned char>(p[i])));
+                                valid = pos != NULL && *pos != 0;
+                                if (valid)
+                                    low = (low << 4) | (pos - hex);
+                            }
+
+                            if (valid && low >= 0xDC00 && low < 0xE000)
+                            {
+                                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                                p += 6;
+                            }
+                        }
+
+                        // Encode as UTF-8
+                        if (code < 0x80)
+                            result.push_back(static_cast<char>(code));
+                        else if (code < 0x800)
+                        {
+                            result.push_back(static_cast<char>(0xC0 | (code >> 6)));
+                            result.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                        }
+                        else if (code < 0x10000)
+                        {
+                            result.push_back(static_cast<char>(0xE0 | (code >> 12)));
+                            result.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                            result.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                        }
+                        else
+                        {
+                            result.push_back(static_cast<char>(0xF0 | (code >> 18)));
+                            result.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+                            result.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+                            result.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+                        }
+                        break;
+                    }
+                    default: result.push_back(*p); break;
+                }
+            }
+
+            return result;
+        }
+
+        // Returns true if the raw JSON string (including quotes) is equal to the given unescaped key
+        inline bool string_equals(string_ref raw, const char *key, size_t key_size)
+        {
+            if (raw.size() < 2)
+                return false;
+
+            string_ref content(raw.begin() + 1, raw.end() - 1);
+            if (memchr(content.data(), '\\', content.size()) == NULL)
+                return content == string_ref(key, key_size);
+
+            return decode_string(raw) == std::string(key, key_size);
+        }
+
+        /* Calls `f(raw_key, raw_value)` for each member of the complete raw JSON object.
+         * If `f` returns false, iteration stops. Returns false if the value is not an object.
+         */
+        template<typename F>
+        bool for_each_member(string_ref object, F f)
+        {
+            const char *p = skip_whitespace(object.begin(), object.end()), *end = object.end();
+            if (p == end || *p != '{')
+                return false;
+
+            p = skip_whitespace(p + 1, end);
+            while (p != end && *p != '}')
+            {
+                const char *key_end = skip_string(p, end);
+                if (key_end == NULL)
+                    throw error(error::bad_response, "Unexpected end of JSON object");
+                string_ref key(p, key_end);
+
+                p = skip_whitespace(key_end, end);
+                if (p == end || *p != ':')
+                    throw error(error::bad_response, "Expected ':' in JSON object");
+
+                p = skip_whitespace(p + 1, end);
+                const char *value_end = skip_value(p, end);
+                if (value_end == NULL)
+                    throw error(error::bad_response, "Unexpected end of JSON object");
+
+                if (!f(key, string_ref(p, value_end)))
+                    return true;
+
+                p = skip_whitespace(value_end, end);
+                if (p != end && *p == ',')
+                    p = skip_whitespace(p + 1, end);
+            }
+
+            return true;
+        }
+
+        /* Calls `f(raw_value)` for each element of the complete raw JSON array.
+         * If `f` returns false, iteration stops. Returns false if the value is not an array.
+         */
+        template<typename F>
+        bool for_each_element(string_ref array, F f)
+        {
+            const char *p = skip_whitespace(array.begin(), array.end()), *end = array.end();
+            if (p == end || *p != '[')
+                return false;
+
+            p = skip_whitespace(p + 1, end);
+            while (p != end && *p != ']')
+            {
+                const char *value_end = skip_value(p, end);
+                if (value_end == NULL)
+                    throw error(error::bad_response, "Unexpected end of JSON array");
+
+                if (!f(string_ref(p, value_end)))
+                    return true;
+
+                p = skip_whitespace(value_end, end);
+                if (p != end && *p == ',')
+                    p = skip_whitespace(p + 1, end);
+            }
+
+            return true;
+        }
+
+        // Returns the raw value of the given member of the complete raw JSON object, or an empty reference if not found
+        inline string_ref find_member(string_ref object, const char *key)
+        {
+            string_ref result;
+            size_t key_size = strlen(key);
+
+            for_each_member(object, [&](string_ref k, string_ref v)
+            {
+                if (!string_equals(k, key, key_size))
+                    return true;
+
+                result = v;
+                return false;
+            });
+
+            return result;
+        }
+
+        // Parses a raw JSON number. Returns false if the value is not a number.
+        // The raw value must be followed by a non-numeric character or the end of a null-terminated buffer.
+        inline bool to_number(string_ref raw, double &result)
+        {
+            char *end = NULL;
+            if (raw.empty() || !(isdigit(static_cast<unsigned char>(raw[0])) || raw[0] == '-'))
+                return false;
+
+            // strtod() follows the C locale, which may use a decimal comma, so fall back to the classic locale then
+            const char *point = localeconv()->decimal_point;
+            if (point[0] != '.' || point[1] != 0)
+            {
+                std::istringstream stream(raw.to_string());
+                stream.imbue(std::locale::classic());
+                stream >> result;
+                return !stream.fail();
+            }
+
+            result = strtod(raw.data(), &end);
+            return end != raw.data() && end <= raw.end();
+        }
+
+        inline bool to_number(string_ref raw, json::int_t &result)
+        {
+            char *end = NULL;
+            if (raw.empty() || !(isdigit(static_cast<unsigned char>(raw[0])) || raw[0] == '-'))
+                return false;
+
+            result = strtoll(raw.data(), &end, 10);
+            if (end == raw.end())
+                return true;
+            else if (end == raw.data() || end > raw.end())
+                return false;
+
+            // Real number, truncate it
+            double real;
+            if (!to_number(raw, real))
+                return false;
+
+            result = static_cast<json::int_t>(real);
+            return true;
+        }
+
+        // Parses a complete raw JSON value into a json::value
+        inline json::value to_json(string_ref raw)
+        {
+            if (raw.empty())
+                return json::value();
+
+            return string_to_json(raw.to_string());
+        }
+    }
+}
+
+#endif // CPPCOUCH_RAW_JSON_H
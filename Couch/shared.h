@@ -7,6 +7,10 @@
 #include <iostream>
 #include <map>
 #include <memory>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
 
 namespace couchdb
 {
@@ -112,6 +116,39 @@ namespace couchdb
          * if this function does not block)
          */
         virtual std::string read_line_from_response_handle(response_handle_type handle) = 0;
+
+        /* Release a response handle that is no longer needed.
+         * If the response was not completely read, the implementation should close the underlying connection
+         * so it is not reused. The default implementation does nothing.
+         */
+        virtual void release_response_handle(response_handle_type handle) {(void) handle;}
+
+        /* Wake up a thread blocked reading or waiting on a response handle, which then sees the end of the response.
+         * Unlike the other functions, this one may be called from another thread than the one using the handle,
+         * but not while the handle is released. The default implementation does nothing, so blocked reads only
+         * return once data arrives.
+         */
+        virtual void interrupt_response_handle(response_handle_type handle) {(void) handle;}
+
+        /* Register a function to call whenever a line, or the end of the response, becomes available on a response handle,
+         * so that a single thread can wait on many handles. The function may be called from any thread until the handle is
+         * released, and must not call back into the client. Returns false if the client cannot notify for this handle, which
+         * must then be waited on with wait_for_response_handle(). The default implementation returns false.
+         */
+        virtual bool notify_response_handle(response_handle_type handle, std::function<void ()> ready) {(void) handle; (void) ready; return false;}
+
+        /* Wait until a line may be read from a response handle, or until the timeout elapses.
+         * Returns true if data (or the end of the response) is available, false if the timeout elapsed.
+         * Implementations with non-blocking handles should wait for network events instead of sleeping.
+         * The default implementation returns immediately for blocking handles, and sleeps for at most 1 ms otherwise.
+         */
+        virtual bool wait_for_response_handle(response_handle_type handle, std::chrono::milliseconds timeout)
+        {
+            (void) handle;
+            if (!is_response_handle_blocking())
+                std::this_thread::sleep_for(std::min(timeout, std::chrono::milliseconds(1)));
+            return true;
+        }
     };
 
     // This class must be used as the base class of a URL implementation
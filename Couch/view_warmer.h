@@ -0,0 +1,396 @@
+#ifndef CPPCOUCH_VIEW_WARMER_H
+#define CPPCOUCH_VIEW_WARMER_H
+
+#include "communication.h"
+#include "connection.h"
+#include "raw_json.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace couchdb
+{
+    /* view_warmer class - This class keeps view indexes up to date in the background, so interactive queries
+     * can use update=false without seeing very stale results or triggering an index build themselves.
+     *
+     * Databases are marked as written to either explicitly with notify_write(), or by watching them with watch(),
+     * which polls the database's update sequence. Every interval, each written database has one view of each of its
+     * design documents queried with limit=0 (and update=lazy, by default), which makes CouchDB update all views of
+     * that design document. Design documents that already have an indexer running (according to _active_tasks) are
+     * skipped and retried on the next interval, so indexer jobs do not pile up.
+     *
+     * Start the background thread with start(), or call warm() to run a single pass in the current thread.
+     *
+     * NOTE: this class uses its own communication object, copied from the connection passed to the constructor.
+     */
+    template<typename http_client>
+    class view_warmer
+    {
+        view_warmer(const view_warmer &) {}
+        void operator=(const view_warmer &) {}
+
+        typedef communication<http_client> communication_type;
+        typedef connection<http_client> connection_type;
+
+        struct design_info
+        {
+            std::string revision;
+            std::string view; // Empty if the design document has no views
+        };
+
+        struct db_info
+        {
+            db_info() : watched(false), dirty(false) {}
+
+            bool watched;
+            bool dirty;
+            std::set<std::string> retry; // Design documents that were being indexed on the last pass
+            std::string last_seq; // Raw JSON, or empty if not polled yet
+            std::map<std::string, design_info> designs;
+        };
+
+    public:
+        /*     conn (IN): The connection to copy the communication settings of.
+         * interval (IN): How often to check for writes and warm views.
+         *     lazy (IN): If true, queries use update=lazy and return immediately (CouchDB 2.1+).
+         *                If false, queries wait for the index to be updated.
+         */
+        view_warmer(connection_type &conn, std::chrono::milliseconds interval = std::chrono::milliseconds(10000), bool lazy = true)
+            : comm(conn.lowest_level().duplicate())
+            , interval(interval)
+            , lazy(lazy)
+            , stop_requested(false)
+            , has_error(false)
+            , err(error::unknown_error)
+        {}
+        ~view_warmer() {stop();}
+
+        // Polls the update sequence of the database every interval, and warms its views when it changes
+        void watch(const std::string &db)
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            dbs[db].watched = true;
+        }
+
+        // Stops warming the views of the database
+        void unwatch(const std::string &db)
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            dbs.erase(db);
+        }
+
+        // Marks the database as written to, so its views are warmed on the next interval
+        void notify_write(const std::string &db)
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            dbs[db].dirty = true;
+        }
+
+        // Starts warming views in a background thread
+        void start()
+        {
+            std::lock_guard<std::mutex> lock(thread_mutex);
+            if (thread.joinable())
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                stop_requested = false;
+            }
+            std::thread(run, this).swap(thread);
+        }
+
+        // Stops the background thread, blocking until it finishes
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                stop_requested = true;
+            }
+            wake.notify_all();
+
+            std::lock_guard<std::mutex> lock(thread_mutex);
+            if (thread.joinable())
+                thread.join();
+        }
+
+        // Returns true if the background thread is running
+        bool is_running() const
+        {
+            std::lock_guard<std::mutex> lock(thread_mutex);
+            return thread.joinable();
+        }
+
+        // Runs a single pass in the current thread: polls watched databases, and warms the views of written databases
+        // Returns the number of design documents that were queried
+        size_t warm()
+        {
+            std::lock_guard<std::mutex> lock(comm_mutex);
+            std::map<std::string, std::set<std::string>> retry; // Databases to warm, and the design documents to retry if not dirty
+            std::vector<std::string> written;
+            std::set<std::string> indexing;
+            size_t warmed = 0;
+
+            poll_watched();
+
+            {
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                for (auto it = dbs.begin(); it != dbs.end(); ++it)
+                {
+                    if (it->second.dirty)
+                        written.push_back(it->first);
+                    else if (!it->second.retry.empty())
+                        retry[it->first].swap(it->second.retry);
+                    else
+                        continue;
+
+                    it->second.dirty = false;
+                    it->second.retry.clear();
+                }
+            }
+
+            for (const std::string &db: written)
+                retry[db].clear();
+
+            if (retry.empty())
+                return 0;
+
+            // _active_tasks requires admin rights, warm everything if it is not available
+            try {indexing = get_active_indexers();}
+            catch (const error &e)
+            {
+                std::lock_guard<std::mutex> lock(err_mutex);
+                has_error = true;
+                err = e;
+            }
+
+            for (auto &item: retry)
+            {
+                const std::string &db = item.first;
+                bool all = std::find(written.begin(), written.end(), db) != written.end();
+                std::set<std::string> busy;
+
+                try
+                {
+                    if (all)
+                        update_design_info(db);
+
+                    for (const auto &design: get_designs(db))
+                    {
+                        if (design.second.view.empty() || (!all && item.second.find(design.first) == item.second.end()))
+                            continue;
+                        else if (indexing.find(db + '\n' + design.first) != indexing.end())
+                        {
+                            busy.insert(design.first);
+                            continue;
+                        }
+
+                        std::string url = "/" + url_encode(db) + "/" + url_encode_doc_id(design.first) + "/_view/" + url_encode(design.second.view) + "?limit=0";
+                        if (lazy)
+                            url += "&update=lazy";
+
+                        comm->get_raw_data(url);
+                        ++warmed;
+                    }
+                }
+                catch (const error &e)
+                {
+#ifdef CPPCOUCH_DEBUG
+                    std::cout << "Could not warm views of " << db << ": " << e.reason() << std::endl;
+#endif
+                    {
+                        std::lock_guard<std::mutex> lock(err_mutex);
+                        has_error = true;
+                        err = e;
+                    }
+
+                    // Try the whole database again on the next pass
+                    std::lock_guard<std::mutex> lock(dbs_mutex);
+                    auto it = dbs.find(db);
+                    if (it != dbs.end())
+                        it->second.dirty = true;
+                    continue;
+                }
+
+                // Retry design documents that were busy on the next pass
+                if (!busy.empty())
+                {
+                    std::lock_guard<std::mutex> lock(dbs_mutex);
+                    auto it = dbs.find(db);
+                    if (it != dbs.end())
+                        it->second.retry.insert(busy.begin(), busy.end());
+                }
+            }
+
+            return warmed;
+        }
+
+        bool error_was_raised() const
+        {
+            std::lock_guard<std::mutex> lock(err_mutex);
+            return has_error;
+        }
+
+        error last_error() const
+        {
+            std::lock_guard<std::mutex> lock(err_mutex);
+            return err;
+        }
+
+    protected:
+        static void run(view_warmer *warmer)
+        {
+            std::unique_lock<std::mutex> lock(warmer->dbs_mutex);
+
+            while (!warmer->stop_requested)
+            {
+                lock.unlock();
+                warmer->warm();
+                lock.lock();
+
+                warmer->wake.wait_for(lock, warmer->interval, [warmer]{return warmer->stop_requested;});
+            }
+        }
+
+        // Marks watched databases whose update sequence has changed as written to
+        void poll_watched()
+        {
+            std::vector<std::string> watched;
+
+            {
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                for (auto it = dbs.begin(); it != dbs.end(); ++it)
+                    if (it->second.watched)
+                        watched.push_back(it->first);
+            }
+
+            for (const std::string &db: watched)
+            {
+                std::string response, seq;
+
+                try
+                {
+                    response = comm->get_raw_data("/" + url_encode(db) + "/_changes?descending=true&limit=1");
+                    seq = raw_json::find_member(response, "last_seq").to_string();
+                }
+                catch (const error &e)
+                {
+                    std::lock_guard<std::mutex> lock(err_mutex);
+                    has_error = true;
+                    err = e;
+                    continue;
+                }
+
+                std::lock_guard<std::mutex> lock(dbs_mutex);
+                auto it = dbs.find(db);
+                if (it == dbs.end())
+                    continue;
+
+                // The first poll only records the sequence
+                if (!it->second.last_seq.empty() && it->second.last_seq != seq)
+                    it->second.dirty = true;
+                it->second.last_seq = seq;
+            }
+        }
+
+        // Returns the database and design document of each running indexer, as "db\nddoc"
+        std::set<std::string> get_active_indexers()
+        {
+            std::set<std::string> result;
+            std::string response = comm->get_raw_data("/_active_tasks");
+
+            raw_json::for_each_element(response, [&](string_ref task)
+            {
+                std::string type = raw_json::decode_string(raw_json::find_member(task, "type"));
+                if (type != "indexer" && type != "view_compaction")
+                    return true;
+
+                std::string db = raw_json::decode_string(raw_json::find_member(task, "database"));
+                std::string ddoc = raw_json::decode_string(raw_json::find_member(task, "design_document"));
+
+                // Clustered databases report shards, e.g. "shards/00000000-1fffffff/name.1234567890"
+                if (db.find("shards/") == 0)
+                {
+                    size_t slash = db.find('/', 7);
+                    size_t dot = db.rfind('.');
+                    if (slash != std::string::npos && dot != std::string::npos && dot > slash)
+                        db = db.substr(slash + 1, dot - slash - 1);
+                }
+
+                result.insert(db + '\n' + ddoc);
+                return true;
+            });
+
+            return result;
+        }
+
+        // Refreshes the list of design documents in the database, and the view used to warm each one
+        void update_design_info(const std::string &db)
+        {
+            std::map<std::string, design_info> designs = get_designs(db);
+            std::map<std::string, design_info> updated;
+            std::string response = comm->get_raw_data("/" + url_encode(db) + "/_all_docs?startkey=%22_design%2F%22&endkey=%22_design0%22");
+
+            raw_json::for_each_element(raw_json::find_member(response, "rows"), [&](string_ref row)
+            {
+                std::string id = raw_json::decode_string(raw_json::find_member(row, "id"));
+                std::string rev = raw_json::decode_string(raw_json::find_member(raw_json::find_member(row, "value"), "rev"));
+
+                auto it = designs.find(id);
+                if (it != designs.end() && it->second.revision == rev)
+                {
+                    updated[id] = it->second;
+                    return true;
+                }
+
+                // Find the name of the first view in the design document
+                design_info info;
+                std::string doc = comm->get_raw_data("/" + url_encode(db) + "/" + url_encode_doc_id(id));
+
+                info.revision = rev;
+                raw_json::for_each_member(raw_json::find_member(doc, "views"), [&](string_ref name, string_ref)
+                {
+                    info.view = raw_json::decode_string(name);
+                    return false;
+                });
+
+                updated[id] = info;
+                return true;
+            });
+
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            auto it = dbs.find(db);
+            if (it != dbs.end())
+                it->second.designs.swap(updated);
+        }
+
+        std::map<std::string, design_info> get_designs(const std::string &db) const
+        {
+            std::lock_guard<std::mutex> lock(dbs_mutex);
+            auto it = dbs.find(db);
+            return it != dbs.end()? it->second.designs: std::map<std::string, design_info>();
+        }
+
+    private:
+        mutable std::mutex comm_mutex, dbs_mutex, err_mutex, thread_mutex;
+
+        std::shared_ptr<communication_type> comm; // Protected by comm_mutex
+        std::chrono::milliseconds interval;
+        bool lazy;
+
+        std::map<std::string, db_info> dbs; // Protected by dbs_mutex
+        bool stop_requested; // Protected by dbs_mutex
+        std::condition_variable wake;
+
+        std::thread thread; // Protected by thread_mutex
+
+        bool has_error; // Protected by err_mutex
+        error err; // Protected by err_mutex
+    };
+}
+
+#endif // CPPCOUCH_VIEW_WARMER_H
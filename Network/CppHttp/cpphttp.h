@@ -54,6 +54,14 @@
 #endif
 #include <boost/bind.hpp> /* Asynchronous callbacks */
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
@@ -1234,6 +1242,51 @@ namespace CppHttp
             std::string body_;
         };
 
+        // Runs a single io_service on a fixed number of threads, so that many connections can share them.
+        // Connections created on a pool serialize their own handlers with a strand, so a connection never runs on two threads at once.
+        // The pool must not be destroyed by one of its own threads, e.g. by releasing the last connection in a handler.
+        class IoServicePool : public boost::noncopyable
+        {
+        public:
+            explicit IoServicePool(size_t threads = std::thread::hardware_concurrency())
+                : work_(new boost::asio::io_service::work(io_serv_))
+            {
+                for (size_t i = 0; i < (threads? threads: 1); ++i)
+                    threads_.push_back(std::thread(&IoServicePool::run, this));
+            }
+            ~IoServicePool()
+            {
+                work_.reset();
+                io_serv_.stop();
+                for (std::thread &thread: threads_)
+                    thread.join();
+            }
+
+            size_t size() const {return threads_.size();}
+
+            const boost::asio::io_service &io_service() const {return io_serv_;}
+            boost::asio::io_service &io_service() {return io_serv_;}
+
+        private:
+            void run()
+            {
+                // An exception thrown by a handler must not take down a thread shared by other connections
+                while (true)
+                {
+                    try
+                    {
+                        io_serv_.run();
+                        return;
+                    }
+                    catch (...) {}
+                }
+            }
+
+            boost::asio::io_service io_serv_;
+            std::unique_ptr<boost::asio::io_service::work> work_;
+            std::vector<std::thread> threads_;
+        };
+
         class Connection : public boost::noncopyable
         {
         protected:
@@ -1315,6 +1368,51 @@ namespace CppHttp
                 , download_progress_callback()
                 , partial_response_type(ResponseWhole)
                 , in_progress(false)
+                , own_io_serv_(new boost::asio::io_service())
+                , io_serv(*own_io_serv_)
+                , strand_(io_serv)
+                , resolver_(io_serv)
+#ifdef ENABLE_SSL
+                , sock_ctx()
+                , sock_secure(false)
+                , ssock()
+#endif
+                , sock()
+                , running_(false)
+                , reconnect_if_aborted(false)
+                , reconnecting_(false)
+                , connect_work()
+                , connection_work()
+                , transaction_work()
+                , timeout_mode_(TimeoutPerOperation)
+                , timeout_(timeout)
+                , deadline_(io_serv)
+                , deadline_running_(false)
+                , pending_(0)
+                , events_(0)
+                , stops_(0)
+                , disconnects_(0)
+            {
+            }
+            // Creates a connection whose handlers run on the threads of a shared pool, instead of in the threads that wait on it
+            explicit Connection(std::shared_ptr<IoServicePool> pool, const boost::posix_time::time_duration &timeout = boost::posix_time::pos_infin)
+                : do_not_poll(false)
+                , connect_callback(DefaultConnectHandler)
+                , disconnect_callback()
+                , request_callback()
+                , response_callback()
+                , partial_response_callback()
+                , destructor_callback()
+#ifdef ENABLE_SSL
+                , verify_callback()
+#endif
+                , upload_progress_callback()
+                , download_progress_callback()
+                , partial_response_type(ResponseWhole)
+                , in_progress(false)
+                , pool_(pool)
+                , io_serv(pool->io_service())
+                , strand_(io_serv)
                 , resolver_(io_serv)
 #ifdef ENABLE_SSL
                 , sock_ctx()
@@ -1332,6 +1430,10 @@ namespace CppHttp
                 , timeout_(timeout)
                 , deadline_(io_serv)
                 , deadline_running_(false)
+                , pending_(0)
+                , events_(0)
+                , stops_(0)
+                , disconnects_(0)
             {
             }
             Connection(const Uri &url, const boost::posix_time::time_duration &timeout = boost::posix_time::pos_infin)
@@ -1349,6 +1451,9 @@ namespace CppHttp
                 , download_progress_callback()
                 , partial_response_type(ResponseWhole)
                 , in_progress(false)
+                , own_io_serv_(new boost::asio::io_service())
+                , io_serv(*own_io_serv_)
+                , strand_(io_serv)
                 , resolver_(io_serv)
 #ifdef ENABLE_SSL
                 , sock_ctx()
@@ -1366,6 +1471,10 @@ namespace CppHttp
                 , timeout_(timeout)
                 , deadline_(io_serv)
                 , deadline_running_(false)
+                , pending_(0)
+                , events_(0)
+                , stops_(0)
+                , disconnects_(0)
             {
                 connect(url);
             }
@@ -1384,6 +1493,9 @@ namespace CppHttp
                 , download_progress_callback()
                 , partial_response_type(ResponseWhole)
                 , in_progress(false)
+                , own_io_serv_(new boost::asio::io_service())
+                , io_serv(*own_io_serv_)
+                , strand_(io_serv)
                 , resolver_(io_serv)
 #ifdef ENABLE_SSL
                 , sock_ctx()
@@ -1401,12 +1513,26 @@ namespace CppHttp
                 , timeout_(timeout)
                 , deadline_(io_serv)
                 , deadline_running_(false)
+                , pending_(0)
+                , events_(0)
+                , stops_(0)
+                , disconnects_(0)
             {
                 connect(request);
             }
             ~Connection()
             {
-                disconnectImmediately();
+                {
+                    std::unique_lock<std::recursive_mutex> lock(mutex_);
+                    disconnectImmediately();
+
+                    // Handlers still queued on a shared pool refer to this connection, so let them finish first
+                    if (pool_)
+                    {
+                        resolver_.cancel();
+                        event_cond_.wait(lock, [this]{return pending_ == 0;});
+                    }
+                }
                 if (!destructor_callback.empty())
                 {
                     do_not_poll = true;
@@ -1416,9 +1542,12 @@ namespace CppHttp
             }
 
             bool handlingCallback() const {return do_not_poll;}
+            bool sharesIoService() const {return pool_ != NULL;}
             bool connecting() const {return connect_work != NULL;}
             bool reconnecting() const {return reconnecting_;}
             bool inTransaction() const {return transaction_work != NULL;}
+            // The number of completion handlers queued for this connection, zero if nothing is in progress
+            size_t pendingHandlers() const {return pending_;}
 
             void reconnectOnConnAborted(bool b = true) {reconnect_if_aborted = b;}
 
@@ -1494,9 +1623,9 @@ namespace CppHttp
 
                     deadline_.expires_from_now(timeout_);
 
-                    resolver_.async_resolve(query, boost::bind(&Connection::handle_resolve, this,
+                    resolver_.async_resolve(query, wrap(boost::bind(&Connection::handle_resolve, this,
                                                                boost::asio::placeholders::error,
-                                                               boost::asio::placeholders::iterator));
+                                                               boost::asio::placeholders::iterator)));
 
                     connect_work.reset(new boost::asio::io_service::work(io_serv));
 
@@ -1536,6 +1665,16 @@ namespace CppHttp
                 disconnect_internal(true);
             }
 
+            // Disconnects this client from the server in one of its handlers, so a thread running or waiting on the connection
+            // sees it disconnected. Unlike the other functions, this one may be called from any thread.
+            // Does nothing if the connection is disconnected by other means before the handler runs.
+            // DO NOT CALL FROM A HANDLER! Use disconnectImmediately() in the handler instead.
+            void disconnectAsync()
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                io_serv.post(wrap(boost::bind(&Connection::handle_disconnect_async, this, disconnects_.load())));
+            }
+
             // Disconnects this client from the server. This is not necessarily done immediately.
             // Use wait_for_disconnect() or a disconnect handler for the true end of the connection.
             // If immediate disconnection is needed, use disconnectImmediately().
@@ -1549,6 +1688,15 @@ namespace CppHttp
             // Cannot be invoked in any handler
             void wait_for_connect()
             {
+                if (pool_)
+                {
+                    std::unique_lock<std::recursive_mutex> lock(mutex_);
+                    if (!connect_work && !running_)
+                        connect_work.reset(new boost::asio::io_service::work(io_serv));
+                    wait_for_event(lock, [this]{return !connect_work;});
+                    return;
+                }
+
                 if (io_serv.stopped())
                     io_serv.reset();
                 if (!connect_work && !running_)
@@ -1567,6 +1715,15 @@ namespace CppHttp
             // Cannot be invoked in any handler
             void wait_for_disconnect()
             {
+                if (pool_)
+                {
+                    std::unique_lock<std::recursive_mutex> lock(mutex_);
+                    if (!connection_work && running_)
+                        connection_work.reset(new boost::asio::io_service::work(io_serv));
+                    wait_for_event(lock, [this]{return !connection_work;});
+                    return;
+                }
+
                 if (io_serv.stopped())
                     io_serv.reset();
                 if (!connection_work && running_)
@@ -1585,6 +1742,15 @@ namespace CppHttp
             // Cannot be invoked in any handler
             void wait_for_transaction()
             {
+                if (pool_)
+                {
+                    std::unique_lock<std::recursive_mutex> lock(mutex_);
+                    if (!transaction_work && running_)
+                        transaction_work.reset(new boost::asio::io_service::work(io_serv));
+                    wait_for_event(lock, [this]{return !transaction_work;});
+                    return;
+                }
+
                 if (io_serv.stopped())
                     io_serv.reset();
                 if (!transaction_work && running_)
@@ -1602,9 +1768,10 @@ namespace CppHttp
 
             // Starts the asynchronous jobs in this connection
             // Cannot be invoked in any handler
+            // Connections on a shared pool are run by the pool's threads, so polling them does nothing
             size_t poll()
             {
-                if (!do_not_poll)
+                if (!do_not_poll && !pool_)
                 {
                     if (io_serv.stopped())
                         io_serv.reset();
@@ -1616,7 +1783,7 @@ namespace CppHttp
             // Cannot be invoked in any handler
             size_t poll_one()
             {
-                if (!do_not_poll)
+                if (!do_not_poll && !pool_)
                 {
                     if (io_serv.stopped())
                         io_serv.reset();
@@ -1626,22 +1793,77 @@ namespace CppHttp
             }
             // Starts one synchronous job in this connection (blocking)
             // Cannot be invoked in any handler
+            // On a shared pool, waits until one of the connection's handlers has run instead
             size_t run_one()
             {
                 if (!do_not_poll)
                 {
+                    if (pool_)
+                    {
+                        std::unique_lock<std::recursive_mutex> lock(mutex_);
+                        uint64_t events = events_;
+                        wait_for_event(lock, [this, events]{return events_ != events || pending_ == 0;});
+                        return events_ != events;
+                    }
+
                     if (io_serv.stopped())
                         io_serv.reset();
                     return io_serv.run_one();
                 }
                 return 0;
             }
+            // Same as run_one(), but gives up after the timeout and returns zero
+            // Cannot be invoked in any handler
+            size_t run_one_for(const boost::posix_time::time_duration &timeout)
+            {
+                if (!do_not_poll)
+                {
+                    if (pool_)
+                    {
+                        std::unique_lock<std::recursive_mutex> lock(mutex_);
+                        uint64_t events = events_, stops = stops_;
+                        event_cond_.wait_for(lock, std::chrono::microseconds(timeout.total_microseconds()),
+                                             [this, events, stops]{return events_ != events || stops_ != stops || pending_ == 0;});
+                        return events_ != events;
+                    }
+
+                    if (io_serv.stopped())
+                        io_serv.reset();
+
+                    // The flag is shared with the handler, in case the io_service is stopped before the handler runs
+                    std::shared_ptr<bool> timer_ran = std::make_shared<bool>(false);
+                    boost::asio::deadline_timer timer(io_serv, timeout);
+                    timer.async_wait([timer_ran](const boost::system::error_code &) {*timer_ran = true;});
+
+                    size_t count = 0;
+                    if (io_serv.run_one() && !*timer_ran)
+                    {
+                        // Another handler ran first, so cancel the timer and run its handler now,
+                        // otherwise it would be the only handler run by the next call
+                        count = 1;
+                        timer.cancel();
+                        while (!*timer_ran && io_serv.run_one())
+                            if (!*timer_ran)
+                                ++count;
+                    }
+                    return count;
+                }
+                return 0;
+            }
             // Starts the synchronous jobs in this connection (blocking)
             // Cannot be invoked in any handler
             size_t run()
             {
                 if (!do_not_poll)
                 {
+                    if (pool_)
+                    {
+                        std::unique_lock<std::recursive_mutex> lock(mutex_);
+                        uint64_t events = events_;
+                        wait_for_event(lock, [this]{return pending_ == 0;});
+                        return events_ - events;
+                    }
+
                     if (io_serv.stopped())
                         io_serv.reset();
                     return io_serv.run();
@@ -1650,11 +1872,24 @@ namespace CppHttp
             }
             // Stops the asynchronous jobs in this connection
             // Can be invoked in any handler
+            // On a shared pool, the io_service keeps running, and only the threads waiting on this connection return
             void stop()
             {
-                io_serv.stop();
+                if (pool_)
+                {
+                    std::lock_guard<std::recursive_mutex> lock(mutex_);
+                    ++stops_;
+                    event_cond_.notify_all();
+                }
+                else
+                    io_serv.stop();
             }
 
+            // Returns a lock that keeps the handlers of this connection from running while it is held.
+            // On a shared pool, hold it while reading or changing the state of the connection from outside a handler,
+            // e.g. to set up and send a request. Never hold it while waiting on or running the connection.
+            std::unique_lock<std::recursive_mutex> lockHandlers() {return std::unique_lock<std::recursive_mutex>(mutex_);}
+
             const std::string &host() const {return host_;}
             const std::string &topLevelDomain() const {return topLevel_;}
             const std::string &service() const {return service_;}
@@ -1666,6 +1901,7 @@ namespace CppHttp
             std::string &httpMethod() {return method;}
 
             const Response &response() const {return response_;}
+            Response &response() {return response_;}
 
             const boost::asio::streambuf &request_streambuf() const {return request_buf;}
             boost::asio::streambuf &request_streambuf() {return request_buf;}
@@ -1686,6 +1922,31 @@ namespace CppHttp
             }
             bool disconnected() const {return !connected();}
 
+            // Whether an idle connection can be reused for another request. Peeks at the socket without blocking:
+            // anything readable on an idle connection is either the server closing it or data nobody asked for.
+            bool reusable()
+            {
+                if (in_progress || inTransaction() || disconnected() || ec)
+                    return false;
+
+#ifdef ENABLE_SSL
+                tcp::socket &s = ssock? ssock->next_layer(): *sock;
+#else
+                tcp::socket &s = *sock;
+#endif
+                boost::system::error_code err, ignored;
+                bool non_blocking = s.non_blocking();
+                s.non_blocking(true, err);
+                if (!err)
+                {
+                    char c;
+                    s.receive(boost::asio::buffer(&c, 1), tcp::socket::message_peek, err);
+                }
+                s.non_blocking(non_blocking, ignored);
+
+                return err == boost::asio::error::would_block;
+            }
+
             // The HTTP_METHOD() functions send a request immediately,
             // and this connection must already be connected to a server.
             // They return true on a successful request initiation, false
@@ -1896,15 +2157,15 @@ namespace CppHttp
                     if (ssock)
                     {
                         boost::asio::async_write(*ssock, request_buf,
-                                  boost::bind(&Connection::handle_write_request, this,
-                                    boost::asio::placeholders::error));
+                                  wrap(boost::bind(&Connection::handle_write_request, this,
+                                    boost::asio::placeholders::error)));
                     }
                     else
 #endif
                     {
                         boost::asio::async_write(*sock, request_buf,
-                                  boost::bind(&Connection::handle_write_request, this,
-                                    boost::asio::placeholders::error));
+                                  wrap(boost::bind(&Connection::handle_write_request, this,
+                                    boost::asio::placeholders::error)));
                     }
 
                     start_timeout();
@@ -1977,6 +2238,7 @@ namespace CppHttp
             void disconnect_internal(bool sent_from_handler)
             {
                 boost::system::error_code ignored_ec;
+                ++disconnects_;
                 running_ = reconnecting_ = false;
                 stop_timeout();
 #ifdef ENABLE_SSL
@@ -1992,7 +2254,7 @@ namespace CppHttp
                         }
                         else
                         {
-                            ssock->async_shutdown(boost::bind(&Connection::handle_ssl_shutdown, this, _1));
+                            ssock->async_shutdown(wrap(boost::bind(&Connection::handle_ssl_shutdown, this, _1)));
                             return;
                         }
                     }
@@ -2053,7 +2315,7 @@ namespace CppHttp
                         }
                         else
                         {
-                            ssock->async_shutdown(boost::bind(&Connection::handle_ssl_shutdown_reconnect, this, _1));
+                            ssock->async_shutdown(wrap(boost::bind(&Connection::handle_ssl_shutdown_reconnect, this, _1)));
                             return;
                         }
                     }
@@ -2097,9 +2359,9 @@ namespace CppHttp
 
                     deadline_.expires_from_now(timeout_);
 
-                    resolver_.async_resolve(query, boost::bind(&Connection::handle_resolve, this,
+                    resolver_.async_resolve(query, wrap(boost::bind(&Connection::handle_resolve, this,
                                                                boost::asio::placeholders::error,
-                                                               boost::asio::placeholders::iterator));
+                                                               boost::asio::placeholders::iterator)));
 
                     if (!connect_work)
                         connect_work.reset(new boost::asio::io_service::work(io_serv));
@@ -2140,6 +2402,15 @@ namespace CppHttp
 #endif
             }
 
+            void handle_disconnect_async(uint64_t disconnects)
+            {
+#ifdef NET_REQUEST_DEBUG
+                std::cout << "NETREQUEST: handle_disconnect_async" << std::endl;
+#endif
+                if (disconnects == disconnects_)
+                    disconnectImmediately();
+            }
+
             void handle_ssl_shutdown(const boost::system::error_code &err)
             {
 #ifdef NET_REQUEST_DEBUG
@@ -2164,10 +2435,57 @@ namespace CppHttp
                 in_progress = false;
             }
 
+            // Calls a handler with the connection locked, then wakes the threads waiting on the connection
+            template<typename Handler>
+            struct EventHandler
+            {
+                // Counts the handler as run even if it throws, otherwise waits on the connection and its destructor would hang
+                struct Done
+                {
+                    ~Done()
+                    {
+                        --c->pending_;
+                        ++c->events_;
+                        // Notify before unlocking, since a waiting destructor may delete the connection as soon as it is unlocked
+                        c->event_cond_.notify_all();
+                    }
+
+                    Connection *c;
+                };
+
+                template<typename... Args>
+                void operator()(Args&&... args)
+                {
+                    std::unique_lock<std::recursive_mutex> lock(c->mutex_);
+                    Done done = {c};
+                    handler(std::forward<Args>(args)...);
+                }
+
+                Connection *c;
+                Handler handler;
+            };
+
+            // Wraps a completion handler in the strand of this connection, and counts it as pending until it runs
+            template<typename Handler>
+            auto wrap(Handler handler) -> decltype(std::declval<boost::asio::io_service::strand &>().wrap(std::declval<EventHandler<Handler>>()))
+            {
+                ++pending_;
+                EventHandler<Handler> event = {this, handler};
+                return strand_.wrap(event);
+            }
+
+            // Waits on a shared pool until the predicate is true, stop() is called, or no handler is left to make progress
+            template<typename Predicate>
+            void wait_for_event(std::unique_lock<std::recursive_mutex> &lock, Predicate predicate)
+            {
+                uint64_t stops = stops_;
+                event_cond_.wait(lock, [this, stops, &predicate]{return predicate() || stops_ != stops || pending_ == 0;});
+            }
+
             void start_timeout()
             {
                 deadline_running_ = true;
-                deadline_.async_wait(boost::bind(&Connection::check_timeout, this));
+                deadline_.async_wait(wrap(boost::bind(&Connection::check_timeout, this)));
             }
 
             void stop_timeout()
@@ -2241,13 +2559,13 @@ namespace CppHttp
                     if (ssock)
                     {
                         ssock->lowest_layer().async_connect(endpoint_iterator->endpoint(),
-                                            boost::bind(&Connection::handle_connect, this, endpoint_iterator, _1));
+                                            wrap(boost::bind(&Connection::handle_connect, this, endpoint_iterator, _1)));
                     }
                     else
 #endif
                     {
                         sock->async_connect(endpoint_iterator->endpoint(),
-                                            boost::bind(&Connection::handle_connect, this, endpoint_iterator, _1));
+                                            wrap(boost::bind(&Connection::handle_connect, this, endpoint_iterator, _1)));
                     }
                 }
                 else
@@ -2341,7 +2659,7 @@ namespace CppHttp
                             deadline_.expires_from_now(timeout_);
 
                         ssock->async_handshake(boost::asio::ssl::stream_base::client,
-                                               boost::bind(&Connection::handle_handshake, this, _1));
+                                               wrap(boost::bind(&Connection::handle_handshake, this, _1)));
                         return;
                     }
 #endif
@@ -2423,15 +2741,15 @@ namespace CppHttp
                         if (ssock)
                         {
                             boost::asio::async_read_until(*ssock, response_buf, "\r\n",
-                                boost::bind(&Connection::handle_read_status_line, this,
-                                  boost::asio::placeholders::error));
+                                wrap(boost::bind(&Connection::handle_read_status_line, this,
+                                  boost::asio::placeholders::error)));
                         }
                         else
 #endif
                         {
                             boost::asio::async_read_until(*sock, response_buf, "\r\n",
-                                boost::bind(&Connection::handle_read_status_line, this,
-                                  boost::asio::placeholders::error));
+                                wrap(boost::bind(&Connection::handle_read_status_line, this,
+                                  boost::asio::placeholders::error)));
                         }
                     }
                     else
@@ -2459,15 +2777,15 @@ namespace CppHttp
                             if (ssock)
                             {
                                 boost::asio::async_write(*ssock, request_buf,
-                                          boost::bind(&Connection::handle_write_request, this,
-                                            boost::asio::placeholders::error));
+                                          wrap(boost::bind(&Connection::handle_write_request, this,
+                                            boost::asio::placeholders::error)));
                             }
                             else
 #endif
                             {
                                 boost::asio::async_write(*sock, request_buf,
-                                          boost::bind(&Connection::handle_write_request, this,
-                                            boost::asio::placeholders::error));
+                                          wrap(boost::bind(&Connection::handle_write_request, this,
+                                            boost::asio::placeholders::error)));
                             }
                         }
                         else // not a full buffer, we need to send a trailing empty chunk
@@ -2476,15 +2794,15 @@ namespace CppHttp
                             if (ssock)
                             {
                                 boost::asio::async_write(*ssock, request_buf,
-                                          boost::bind(&Connection::handle_write_last_chunk_request, this,
-                                            boost::asio::placeholders::error));
+                                          wrap(boost::bind(&Connection::handle_write_last_chunk_request, this,
+                                            boost::asio::placeholders::error)));
                             }
                             else
 #endif
                             {
                                 boost::asio::async_write(*sock, request_buf,
-                                          boost::bind(&Connection::handle_write_last_chunk_request, this,
-                                            boost::asio::placeholders::error));
+                                          wrap(boost::bind(&Connection::handle_write_last_chunk_request, this,
+                                            boost::asio::placeholders::error)));
                             }
                         }
                     }
@@ -2519,15 +2837,15 @@ namespace CppHttp
                     if (ssock)
                     {
                         boost::asio::async_write(*ssock, request_buf,
-                                  boost::bind(&Connection::handle_write_request, this,
-                                    boost::asio::placeholders::error));
+                                  wrap(boost::bind(&Connection::handle_write_request, this,
+                                    boost::asio::placeholders::error)));
                     }
                     else
 #endif
                     {
                         boost::asio::async_write(*sock, request_buf,
-                                  boost::bind(&Connection::handle_write_request, this,
-                                    boost::asio::placeholders::error));
+                                  wrap(boost::bind(&Connection::handle_write_request, this,
+                                    boost::asio::placeholders::error)));
                     }
                 }
                 else if (!should_reconnect(err))
@@ -2587,15 +2905,15 @@ namespace CppHttp
                     if (ssock)
                     {
                         boost::asio::async_read_until(*ssock, response_buf, "\r\n\r\n",
-                            boost::bind(&Connection::handle_read_headers, this,
-                              boost::asio::placeholders::error));
+                            wrap(boost::bind(&Connection::handle_read_headers, this,
+                              boost::asio::placeholders::error)));
                     }
                     else
 #endif
                     {
                         boost::asio::async_read_until(*sock, response_buf, "\r\n\r\n",
-                            boost::bind(&Connection::handle_read_headers, this,
-                              boost::asio::placeholders::error));
+                            wrap(boost::bind(&Connection::handle_read_headers, this,
+                              boost::asio::placeholders::error)));
                     }
                 }
                 else if (!should_reconnect(err))
@@ -2692,15 +3010,15 @@ namespace CppHttp
                         if (ssock)
                         {
                             boost::asio::async_read_until(*ssock, response_buf, "\r\n",
-                                boost::bind(&Connection::handle_read_content_chunk_size, this,
-                                  boost::asio::placeholders::error));
+                                wrap(boost::bind(&Connection::handle_read_content_chunk_size, this,
+                                  boost::asio::placeholders::error)));
                         }
                         else
 #endif
                         {
                             boost::asio::async_read_until(*sock, response_buf, "\r\n",
-                                boost::bind(&Connection::handle_read_content_chunk_size, this,
-                                  boost::asio::placeholders::error));
+                                wrap(boost::bind(&Connection::handle_read_content_chunk_size, this,
+                                  boost::asio::placeholders::error)));
                         }
                     }
                     else
@@ -2712,7 +3030,10 @@ namespace CppHttp
                     {
                         // chunk_size holds bytes left to read, total_size holds entire response size
                         chunk_size = total_size = boost::lexical_cast<uint64_t>(lcase_headers["content-length"]);
-                        handle_read_content_sized(boost::system::error_code());
+                        if (request_.ostream() == NULL && (partial_response_callback.empty() || partial_response_type == ResponseWhole))
+                            read_content_direct();
+                        else
+                            handle_read_content_sized(boost::system::error_code());
                     }
                     else
                     {
@@ -2747,16 +3068,16 @@ namespace CppHttp
                             {
                                 boost::asio::async_read(*ssock, response_buf,
                                     boost::asio::transfer_exactly(chunk_size + 2 - response_buf.size()),
-                                    boost::bind(&Connection::handle_read_content_chunk, this,
-                                      boost::asio::placeholders::error));
+                                    wrap(boost::bind(&Connection::handle_read_content_chunk, this,
+                                      boost::asio::placeholders::error)));
                             }
                             else
 #endif
                             {
                                 boost::asio::async_read(*sock, response_buf,
                                     boost::asio::transfer_exactly(chunk_size + 2 - response_buf.size()),
-                                    boost::bind(&Connection::handle_read_content_chunk, this,
-                                      boost::asio::placeholders::error));
+                                    wrap(boost::bind(&Connection::handle_read_content_chunk, this,
+                                      boost::asio::placeholders::error)));
                             }
                             return;
                         }
@@ -2770,15 +3091,15 @@ namespace CppHttp
                     if (ssock)
                     {
                         boost::asio::async_read_until(*ssock, response_buf, "\r\n",
-                            boost::bind(&Connection::handle_read_content_chunk_trailers, this,
-                              boost::asio::placeholders::error));
+                            wrap(boost::bind(&Connection::handle_read_content_chunk_trailers, this,
+                              boost::asio::placeholders::error)));
                     }
                     else
 #endif
                     {
                         boost::asio::async_read_until(*sock, response_buf, "\r\n",
-                            boost::bind(&Connection::handle_read_content_chunk_trailers, this,
-                              boost::asio::placeholders::error));
+                            wrap(boost::bind(&Connection::handle_read_content_chunk_trailers, this,
+                              boost::asio::placeholders::error)));
                     }
                 }
                 else
@@ -2801,13 +3122,7 @@ namespace CppHttp
                 {
                     // When this handler is called, the response buffer contains AT LEAST the chunk size
                     // PLUS the ending CRLF
-                    boost::asio::streambuf::const_buffers_type bufs = response_buf.data();
-                    std::string chunk = std::string(boost::asio::buffers_begin(bufs),
-                                                    boost::asio::buffers_begin(bufs) + chunk_size);
-                    if (request_.ostream() == NULL)
-                        response_.body() += chunk;
-                    else
-                        *request_.ostream() << chunk;
+                    store_content(response_data(), (size_t) chunk_size, err);
 
                     total_size += chunk_size;
 
@@ -2821,31 +3136,20 @@ namespace CppHttp
                         do_not_poll = false;
                     }
 
-                    if (!partial_response_callback.empty() && partial_response_type == ResponseAny)
-                    {
-                        Response r(response_);
-                        r.setBody(chunk);
-                        do_not_poll = true;
-                        partial_response_callback(*this, r, err);
-                        do_not_poll = false;
-                    }
-
-                    handle_partial_response_newline(chunk, err);
-
                     // Read the next chunk's size
 #ifdef ENABLE_SSL
                     if (ssock)
                     {
                         boost::asio::async_read_until(*ssock, response_buf, "\r\n",
-                            boost::bind(&Connection::handle_read_content_chunk_size, this,
-                              boost::asio::placeholders::error));
+                            wrap(boost::bind(&Connection::handle_read_content_chunk_size, this,
+                              boost::asio::placeholders::error)));
                     }
                     else
 #endif
                     {
                         boost::asio::async_read_until(*sock, response_buf, "\r\n",
-                            boost::bind(&Connection::handle_read_content_chunk_size, this,
-                              boost::asio::placeholders::error));
+                            wrap(boost::bind(&Connection::handle_read_content_chunk_size, this,
+                              boost::asio::placeholders::error)));
                     }
                 }
                 else
@@ -2934,15 +3238,15 @@ namespace CppHttp
                         if (ssock)
                         {
                             boost::asio::async_read_until(*ssock, response_buf, "\r\n",
-                                boost::bind(&Connection::handle_read_content_chunk_trailers, this,
-                                  boost::asio::placeholders::error));
+                                wrap(boost::bind(&Connection::handle_read_content_chunk_trailers, this,
+                                  boost::asio::placeholders::error)));
                         }
                         else
 #endif
                         {
                             boost::asio::async_read_until(*sock, response_buf, "\r\n",
-                                boost::bind(&Connection::handle_read_content_chunk_trailers, this,
-                                  boost::asio::placeholders::error));
+                                wrap(boost::bind(&Connection::handle_read_content_chunk_trailers, this,
+                                  boost::asio::placeholders::error)));
                         }
                         return;
                     }
@@ -2994,26 +3298,9 @@ namespace CppHttp
                     if (chunk_size)
                     {
                         uint64_t size = std::min(chunk_size, (uint64_t) response_buf.size());
-                        boost::asio::streambuf::const_buffers_type bufs = response_buf.data();
-                        std::string chunk = std::string(boost::asio::buffers_begin(bufs),
-                                                        boost::asio::buffers_begin(bufs) + size);
-
-                        if (request_.ostream() == NULL)
-                            response_.body() += chunk;
-                        else
-                            *request_.ostream() << chunk;
-
-                        response_buf.consume((size_t) size);
                         chunk_size -= size;
-
-                        if (!partial_response_callback.empty() && partial_response_type == ResponseAny)
-                        {
-                            Response r(response_);
-                            r.setBody(chunk);
-                            do_not_poll = true;
-                            partial_response_callback(*this, r, err);
-                            do_not_poll = false;
-                        }
+                        store_content(response_data(), (size_t) size, err);
+                        response_buf.consume((size_t) size);
 
                         if (!download_progress_callback.empty())
                         {
@@ -3021,8 +3308,6 @@ namespace CppHttp
                             download_progress_callback(*this, size, total_size - chunk_size, total_size);
                             do_not_poll = false;
                         }
-
-                        handle_partial_response_newline(chunk, err);
                     }
 
 #ifdef NET_RESPONSE_DEBUG
@@ -3039,16 +3324,16 @@ namespace CppHttp
                         {
                             boost::asio::async_read(*ssock, response_buf,
                                 boost::asio::transfer_at_least(1),
-                                boost::bind(&Connection::handle_read_content_sized, this,
-                                  boost::asio::placeholders::error));
+                                wrap(boost::bind(&Connection::handle_read_content_sized, this,
+                                  boost::asio::placeholders::error)));
                         }
                         else
 #endif
                         {
                             boost::asio::async_read(*sock, response_buf,
                                 boost::asio::transfer_at_least(1),
-                                boost::bind(&Connection::handle_read_content_sized, this,
-                                  boost::asio::placeholders::error));
+                                wrap(boost::bind(&Connection::handle_read_content_sized, this,
+                                  boost::asio::placeholders::error)));
                         }
                         return;
                     }
@@ -3059,46 +3344,125 @@ namespace CppHttp
                 handle_end_transaction(err);
             }
 
-            void handle_read_content_unsized(const boost::system::error_code &err)
+            // Reads a body of known size straight into its final buffer, only copying what arrived with the headers
+            void read_content_direct()
+            {
+                uint64_t size = std::min(chunk_size, (uint64_t) response_buf.size());
+                content_.clear();
+                if (!grow_content(size))
+                    return;
+
+                std::copy(response_data(), response_data() + size, &content_[0]);
+                response_buf.consume((size_t) size);
+
+                handle_read_content_direct(boost::system::error_code(), (size_t) size);
+            }
+
+            /* Grows the body buffer to at least `needed` bytes, doubling it up to the size announced by the server, so a bogus
+             * Content-Length does not allocate memory for data that never arrives. Ends the transaction and returns false
+             * if the memory cannot be allocated.
+             */
+            bool grow_content(uint64_t needed)
+            {
+                uint64_t size = std::max<uint64_t>(needed, std::max<uint64_t>(content_.size() * 2, 64 * 1024));
+
+                try
+                {
+                    content_.resize((size_t) std::min(size, total_size));
+                }
+                catch (const std::exception &)
+                {
+                    raise_error(boost::asio::error::no_memory, "Response body is too large");
+                    handle_end_transaction(ec);
+                    return false;
+                }
+
+                return true;
+            }
+
+            void handle_read_content_direct(const boost::system::error_code &err, size_t bytes)
             {
 #ifdef NET_RESPONSE_DEBUG
-                std::cout << "NETRESPONSE: handle_read_content_unsized" << std::endl;
+                std::cout << "NETRESPONSE: handle_read_content_direct" << std::endl;
 #endif
                 if (!running_ || ec)
                     return;
 
                 if (!err)
                 {
-                    // Write all of the data that has been read so far.
-                    boost::asio::streambuf::const_buffers_type bufs = response_buf.data();
-                    std::string chunk = std::string(boost::asio::buffers_begin(bufs),
-                                                    boost::asio::buffers_begin(bufs) + response_buf.size());
-                    if (request_.ostream() == NULL)
-                        response_.body() += chunk;
-                    else
-                        *request_.ostream() << chunk;
-
-                    total_size += response_buf.size();
-                    response_buf.consume(response_buf.size());
+                    chunk_size -= bytes;
 
-                    if (!partial_response_callback.empty() && partial_response_type == ResponseAny)
+                    if (bytes && !download_progress_callback.empty())
                     {
-                        Response r(response_);
-                        r.setBody(chunk);
                         do_not_poll = true;
-                        partial_response_callback(*this, r, err);
+                        download_progress_callback(*this, bytes, total_size - chunk_size, total_size);
                         do_not_poll = false;
                     }
 
+                    if (chunk_size)
+                    {
+                        // Read remaining data.
+                        if (timeout_mode_ == TimeoutPerOperation)
+                            deadline_.expires_from_now(timeout_);
+
+                        size_t filled = (size_t) (total_size - chunk_size);
+                        if (filled == content_.size() && !grow_content(filled + 1))
+                            return;
+
+                        char *data = &content_[filled];
+                        size_t room = content_.size() - filled;
+#ifdef ENABLE_SSL
+                        if (ssock)
+                        {
+                            ssock->async_read_some(boost::asio::buffer(data, room),
+                                wrap(boost::bind(&Connection::handle_read_content_direct, this,
+                                  boost::asio::placeholders::error,
+                                  boost::asio::placeholders::bytes_transferred)));
+                        }
+                        else
+#endif
+                        {
+                            sock->async_read_some(boost::asio::buffer(data, room),
+                                wrap(boost::bind(&Connection::handle_read_content_direct, this,
+                                  boost::asio::placeholders::error,
+                                  boost::asio::placeholders::bytes_transferred)));
+                        }
+                        return;
+                    }
+
+                    response_.body().swap(content_);
+                    content_.clear();
+                }
+                else
+                    raise_error(err);
+                // End connection and handle response as necessary
+                handle_end_transaction(err);
+            }
+
+            void handle_read_content_unsized(const boost::system::error_code &err)
+            {
+#ifdef NET_RESPONSE_DEBUG
+                std::cout << "NETRESPONSE: handle_read_content_unsized" << std::endl;
+#endif
+                if (!running_ || ec)
+                    return;
+
+                if (!err)
+                {
+                    // Write all of the data that has been read so far.
+                    size_t size = response_buf.size();
+                    store_content(response_data(), size, err);
+
+                    total_size += size;
+                    response_buf.consume(size);
+
                     if (!download_progress_callback.empty())
                     {
                         do_not_poll = true;
-                        download_progress_callback(*this, chunk.size(), total_size, UINT64_MAX);
+                        download_progress_callback(*this, size, total_size, UINT64_MAX);
                         do_not_poll = false;
                     }
 
-                    handle_partial_response_newline(chunk, err);
-
                     if (timeout_mode_ == TimeoutPerOperation)
                         deadline_.expires_from_now(timeout_);
 
@@ -3108,16 +3472,16 @@ namespace CppHttp
                     {
                         boost::asio::async_read(*ssock, response_buf,
                             boost::asio::transfer_at_least(1),
-                            boost::bind(&Connection::handle_read_content_unsized, this,
-                              boost::asio::placeholders::error));
+                            wrap(boost::bind(&Connection::handle_read_content_unsized, this,
+                              boost::asio::placeholders::error)));
                     }
                     else
 #endif
                     {
                         boost::asio::async_read(*sock, response_buf,
                             boost::asio::transfer_at_least(1),
-                            boost::bind(&Connection::handle_read_content_unsized, this,
-                              boost::asio::placeholders::error));
+                            wrap(boost::bind(&Connection::handle_read_content_unsized, this,
+                              boost::asio::placeholders::error)));
                     }
                 }
                 else
@@ -3173,25 +3537,57 @@ namespace CppHttp
                 }
             }
 
-            void handle_partial_response_newline(const std::string &chunk, const boost::system::error_code &err)
+            void handle_partial_response_newline(const char *data, size_t size, const boost::system::error_code &err)
             {
                 if (!partial_response_callback.empty() && partial_response_type == ResponseLine)
                 {
-                    Response r(response_);
-                    size_t newline;
+                    // Only the new data can hold a newline, and complete lines are erased all at once
+                    size_t start = 0, newline = chunk_line.size();
 
-                    chunk_line += chunk;
-                    newline = chunk_line.find('\n');
+                    chunk_line.append(data, size);
+                    newline = chunk_line.find('\n', newline);
                     while (newline != std::string::npos)
                     {
-                        r.setBody(chunk_line.substr(0, newline+1));
-                        partial_response_callback(*this, r, err);
-                        chunk_line.erase(0, newline+1);
-                        newline = chunk_line.find('\n');
+                        std::string line = chunk_line.substr(start, newline+1 - start);
+                        call_partial_response_handler(line, err);
+                        start = newline+1;
+                        newline = chunk_line.find('\n', start);
                     }
+                    chunk_line.erase(0, start);
                 }
             }
 
+            // Returns the data read into the response buffer, which is always contiguous
+            const char *response_data() const {return boost::asio::buffer_cast<const char *>(response_buf.data());}
+
+            // Appends part of the body, straight from the response buffer, to the response or the request's output stream,
+            // and passes it to the partial response handler
+            void store_content(const char *data, size_t size, const boost::system::error_code &err)
+            {
+                if (request_.ostream() == NULL)
+                    response_.body().append(data, size);
+                else
+                    request_.ostream()->write(data, size);
+
+                if (!partial_response_callback.empty() && partial_response_type == ResponseAny)
+                {
+                    std::string chunk(data, size);
+                    call_partial_response_handler(chunk, err);
+                }
+
+                handle_partial_response_newline(data, size, err);
+            }
+
+            // Calls the partial response handler with part of the body, by lending the body to the response instead of copying the response
+            void call_partial_response_handler(std::string &body, const boost::system::error_code &err)
+            {
+                response_.body().swap(body);
+                do_not_poll = true;
+                partial_response_callback(*this, response_, err);
+                do_not_poll = false;
+                response_.body().swap(body);
+            }
+
             bool should_reconnect(const boost::system::error_code &err)
             {
                 if (reconnect_if_aborted &&
@@ -3232,6 +3628,7 @@ namespace CppHttp
             std::string chunk_line; // Current incomplete line of response, only enabled if partial_response_type == ResponseLine
             Request request_; // Request to send
             Response response_; // Response to parse into
+            std::string content_; // Body of known size being read straight from the socket, kept apart from response_ as raise_error() replaces it
 
             // Temporary response cache data
             Headers lcase_headers;
@@ -3241,7 +3638,10 @@ namespace CppHttp
             Headers::iterator lcase_trailer_iterator;
 
             // Local network/buffer objects
-            boost::asio::io_service io_serv;
+            std::shared_ptr<IoServicePool> pool_; // The shared pool running this connection, if any
+            std::unique_ptr<boost::asio::io_service> own_io_serv_; // The io_service of this connection, if it has no pool
+            boost::asio::io_service &io_serv;
+            boost::asio::io_service::strand strand_;
             tcp::resolver resolver_;
 #ifdef ENABLE_SSL
             std::shared_ptr<boost::asio::ssl::context> sock_ctx;
@@ -3267,12 +3667,25 @@ namespace CppHttp
             boost::posix_time::time_duration timeout_;
             boost::asio::deadline_timer deadline_;
             bool deadline_running_;
+
+            // Handler bookkeeping, so threads can wait on a connection running on a shared pool
+            std::recursive_mutex mutex_; // Held while a handler runs
+            std::condition_variable_any event_cond_; // Notified after each handler, and by stop()
+            std::atomic<size_t> pending_; // Handlers queued but not yet run
+            uint64_t events_; // Handlers run so far, protected by mutex_
+            uint64_t stops_; // Calls to stop() so far, protected by mutex_
+            std::atomic<uint64_t> disconnects_; // Calls to disconnect_internal() so far, so a late disconnectAsync() handler is ignored
         };
 
         typedef std::shared_ptr<Connection> ConnectionPtr;
 
+        // Creates connections and keeps idle ones for reuse, pooled by scheme, host and port.
+        // Idle connections are checked before reuse, evicted after idleTimeout(), and the number of connections to a host
+        // can be limited with setMaxConnectionsPerHost(). A manager may be used from several threads at once.
         class ConnectionManager : public boost::noncopyable
         {
+            typedef std::list<ConnectionPtr> IdleList; // Most recently freed first
+
             struct ConnectionObject
             {
                 ConnectionObject(ConnectionPtr c = 0)
@@ -3296,281 +3709,307 @@ namespace CppHttp
                 Connection::ProgressHandler uploadProgress;
                 Connection::ProgressHandler downloadProgress;
                 bool free;
+                std::string key; // The pool of the connection, empty until it is created for or freed from a URL
+                std::chrono::steady_clock::time_point freed; // When the connection became idle
+                IdleList::iterator idle; // The position of the connection in its pool's idle list, if free
             };
 
+            struct HostPool
+            {
+                HostPool() : size(0) {}
+
+                IdleList idle;
+                size_t size; // The number of connections in the pool, idle or not
+            };
+
+            typedef std::unordered_map<Connection *, ConnectionObject> ConnectionMap;
+
             void destructor_handler(Connection &c)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c.get() == &c)
-                    {
-                        if (!async_connections_[i].destructor.empty())
-                            async_connections_[i].destructor(c);
-                        async_connections_.erase(async_connections_.begin() + i);
-                        break;
-                    }
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                ConnectionMap::iterator it = connections_.find(&c);
+                if (it != connections_.end())
+                {
+                    if (!it->second.destructor.empty())
+                        it->second.destructor(c);
+                    release(it);
+                    connections_.erase(it);
+                }
             }
 
             void registerConnection(ConnectionPtr conn)
             {
-                async_connections_.push_back(ConnectionObject(conn));
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                connections_.insert(std::make_pair(conn.get(), ConnectionObject(conn)));
             }
 
             void unregisterConnection(ConnectionPtr conn)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == conn)
-                    {
-                        async_connections_.erase(async_connections_.begin() + i);
-                        --i;
-                    }
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                ConnectionMap::iterator it = connections_.find(conn.get());
+                if (it != connections_.end())
+                {
+                    release(it);
+                    connections_.erase(it);
+                }
             }
 
         public:
 #ifdef ENABLE_SSL
-            ConnectionManager() : polling_(false), ctx() {setSslContext();}
+            ConnectionManager() : polling_(0), event_loop_interval_(boost::posix_time::milliseconds(10)), idle_timeout_(boost::posix_time::seconds(60)), max_per_host_(0), ctx() {setSslContext();}
+            // Creates connections that share the io_service and threads of a pool
+            explicit ConnectionManager(std::shared_ptr<IoServicePool> pool) : polling_(0), event_loop_interval_(boost::posix_time::milliseconds(10)), idle_timeout_(boost::posix_time::seconds(60)), max_per_host_(0), pool_(pool), ctx() {setSslContext();}
 #else
-            ConnectionManager() : polling_(false) {}
+            ConnectionManager() : polling_(0), event_loop_interval_(boost::posix_time::milliseconds(10)), idle_timeout_(boost::posix_time::seconds(60)), max_per_host_(0) {}
+            // Creates connections that share the io_service and threads of a pool
+            explicit ConnectionManager(std::shared_ptr<IoServicePool> pool) : polling_(0), event_loop_interval_(boost::posix_time::milliseconds(10)), idle_timeout_(boost::posix_time::seconds(60)), max_per_host_(0), pool_(pool) {}
 #endif
             ~ConnectionManager()
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
+                for (ConnectionMap::iterator it = connections_.begin(); it != connections_.end(); ++it)
                 {
-                    async_connections_[i].c->setDestructorHandler(async_connections_[i].destructor);
-                    async_connections_[i].c->disconnectImmediately();
+                    auto lock = it->second.c->lockHandlers();
+                    it->second.c->setDestructorHandler(it->second.destructor);
+                    it->second.c->disconnectImmediately();
                 }
             }
 
             ConnectionPtr createConnection()
             {
-                ConnectionPtr connection = std::make_shared<Connection>();
-#ifdef ENABLE_SSL
-                connection->setSslContext(ctx);
-                connection->setVerifyHandler(verify_callback);
-#endif
-                connection->setDestructorHandler(boost::bind(&ConnectionManager::destructor_handler, this, _1));
-                async_connections_.push_back(ConnectionObject(connection));
-                return connection;
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                return create(std::string());
             }
 
             ConnectionPtr createConnection(const Request &request) {return createConnection(request.url());}
+
+            /* Returns an idle connection to the same scheme, host and port as the URL, or a new connection.
+             * Idle connections that were closed by the server, or that received data while idle, are dropped instead of reused.
+             * If the host already has maxConnectionsPerHost() connections, blocks until one is freed by another thread.
+             */
             ConnectionPtr createConnection(const Uri &url)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
+                std::unique_lock<std::recursive_mutex> lock(mutex_);
+                std::string key = poolKey(url);
+
+                while (true)
                 {
-                    if (async_connections_[i].free && async_connections_[i].c->topLevelDomain() == url.topLevel())
+                    HostPool &host = hosts_[key];
+                    evict(host, std::chrono::steady_clock::now());
+
+                    while (!host.idle.empty())
                     {
-                        async_connections_[i].free = false;
-                        async_connections_[i].c->reconnectOnConnAborted();
-                        return async_connections_[i].c;
+                        ConnectionMap::iterator it = connections_.find(host.idle.front().get());
+                        ConnectionPtr c = it->second.c;
+                        host.idle.pop_front();
+                        it->second.free = false;
+
+                        bool reusable;
+                        {
+                            auto handlers = c->lockHandlers();
+                            reusable = c->reusable();
+                        }
+
+                        if (reusable)
+                        {
+                            c->reconnectOnConnAborted();
+                            return c;
+                        }
+
+                        drop(it);
                     }
+
+                    if (!max_per_host_ || host.size < max_per_host_)
+                        return create(key);
+
+                    freed_.wait(lock);
                 }
-                return createConnection();
             }
 
+            /* Returns a connection to the manager once its transaction is over. Connections that are still
+             * connected and idle are kept for reuse by createConnection(), the others are dropped.
+             */
             void freeConnection(ConnectionPtr c)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].free = true;
-                        break;
-                    }
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                ConnectionMap::iterator it = connections_.find(c.get());
+                if (it == connections_.end() || it->second.free)
+                    return;
+
+                bool reusable;
+                Uri url;
+                {
+                    auto handlers = c->lockHandlers();
+                    reusable = c->connected() && !c->busy() && !c->inTransaction() && c->success();
+                    url = c->request().url();
+                }
+
+                if (it->second.key.empty())
+                {
+                    it->second.key = poolKey(url);
+                    ++hosts_[it->second.key].size;
+                }
+
+                if (!reusable)
+                    drop(it);
+                else
+                {
+                    HostPool &host = hosts_[it->second.key];
+                    host.idle.push_front(c);
+                    it->second.idle = host.idle.begin();
+                    it->second.freed = std::chrono::steady_clock::now();
+                    it->second.free = true;
+                    evict(host, it->second.freed);
+                }
+
+                freed_.notify_all();
+            }
+
+            // Drops the connections that have been idle for longer than idleTimeout()
+            void evictIdleConnections()
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                for (auto it = hosts_.begin(); it != hosts_.end(); )
+                {
+                    evict(it->second, now);
+                    if (it->second.size == 0)
+                        it = hosts_.erase(it);
+                    else
+                        ++it;
+                }
+            }
+
+            // The number of connections held by the manager, idle or not
+            size_t size() const
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                return connections_.size();
+            }
+
+            // Set/get how long a connection may stay idle before it is dropped, pos_infin to keep idle connections forever
+            const boost::posix_time::time_duration &idleTimeout() const {return idle_timeout_;}
+            void setIdleTimeout(const boost::posix_time::time_duration &timeout)
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                idle_timeout_ = timeout;
+            }
+
+            // Set/get the maximum number of connections to a single scheme, host and port, or zero for no limit.
+            // Long-lived responses, like continuous changes feeds, hold their connection, so leave room for them.
+            size_t maxConnectionsPerHost() const {return max_per_host_;}
+            void setMaxConnectionsPerHost(size_t max)
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                max_per_host_ = max;
+                freed_.notify_all();
             }
 
             void setConnectHandler(ConnectionPtr c, Connection::ConnectHandler handler)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].c->setConnectHandler(handler);
-                        break;
-                    }
+                if (findConnection(c))
+                    c->setConnectHandler(handler);
             }
 
             void setDisconnectHandler(ConnectionPtr c, Connection::DisconnectHandler handler)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].c->setDisconnectHandler(handler);
-                        break;
-                    }
+                if (findConnection(c))
+                    c->setDisconnectHandler(handler);
             }
 
             void setRequestHandler(ConnectionPtr c, Connection::RequestHandler handler)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].c->setRequestHandler(handler);
-                        break;
-                    }
+                if (findConnection(c))
+                    c->setRequestHandler(handler);
             }
 
             void setResponseHandler(ConnectionPtr c, Connection::ResponseHandler handler)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].c->setResponseHandler(handler);
-                        break;
-                    }
+                if (findConnection(c))
+                    c->setResponseHandler(handler);
             }
 
             void setPartialResponseHandler(ConnectionPtr c, Connection::ResponseHandler handler)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].c->setPartialResponseHandler(handler);
-                        break;
-                    }
+                if (findConnection(c))
+                    c->setPartialResponseHandler(handler);
             }
 
 #ifdef ENABLE_SSL
             void setVerifyHandler(ConnectionPtr c, Connection::VerifyHandler handler)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].c->setVerifyHandler(handler);
-                        break;
-                    }
+                if (findConnection(c))
+                    c->setVerifyHandler(handler);
             }
 #endif
 
             void setUploadProgressHandler(ConnectionPtr c, Connection::ProgressHandler handler)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].c->setUploadProgressHandler(handler);
-                        break;
-                    }
+                if (findConnection(c))
+                    c->setUploadProgressHandler(handler);
             }
 
             void setDownloadProgressHandler(ConnectionPtr c, Connection::ProgressHandler handler)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].c->setDownloadProgressHandler(handler);
-                        break;
-                    }
+                if (findConnection(c))
+                    c->setDownloadProgressHandler(handler);
             }
 
+            // The handler is called by the manager, which keeps its own destructor handler on the connection
             void setDestructorHandler(ConnectionPtr c, Connection::DestructorHandler handler)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                    {
-                        async_connections_[i].c->setDestructorHandler(handler);
-                        break;
-                    }
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                ConnectionMap::iterator it = connections_.find(c.get());
+                if (it != connections_.end())
+                    it->second.destructor = handler;
             }
 
-            void wait_for_connect(ConnectionPtr c) {wait_for_connect_event_loop(c, null);}
-            void wait_for_transaction(ConnectionPtr c) {wait_for_transaction_event_loop(c, null);}
-            void wait_for_disconnect(ConnectionPtr c) {wait_for_disconnect_event_loop(c, null);}
+            // Block until the connection is connected, has finished its transaction, or is disconnected.
+            // The waiting thread sleeps until one of the connection's handlers runs. Without a shared pool, other connections
+            // of this manager are polled every eventLoopInterval() while they have work in progress, and otherwise are left alone.
+            void wait_for_connect(ConnectionPtr c) {c->wait_later_for_connect(); wait_event_loop(c, Connecting(), null, false);}
+            void wait_for_transaction(ConnectionPtr c) {c->wait_later_for_transaction(); wait_event_loop(c, InTransaction(), null, false);}
+            void wait_for_disconnect(ConnectionPtr c) {c->wait_later_for_disconnect(); wait_event_loop(c, Connected(), null, false);}
 
+            // Same as above, but processEvents() is also called at least once every eventLoopInterval() while waiting
             template<typename T>
-            void wait_for_connect_event_loop(ConnectionPtr c, T processEvents)
-            {
-                size_t idx = findConnection(c);
-                if (idx != SIZE_MAX)
-                {
-                    ++polling_;
-                    c->wait_later_for_connect();
-                    while (1)
-                    {
-                        for (size_t i = 0; i < async_connections_.size(); ++i)
-                        {
-                            if (async_connections_[i].c == c && !c->connecting())
-                            {
-                                --polling_;
-                                return;
-                            }
-                            async_connections_[i].c->poll();
-                            processEvents();
-                        }
-                    }
-                }
-            }
-
+            void wait_for_connect_event_loop(ConnectionPtr c, T processEvents) {c->wait_later_for_connect(); wait_event_loop(c, Connecting(), processEvents, true);}
             template<typename T>
-            void wait_for_transaction_event_loop(ConnectionPtr c, T processEvents)
-            {
-                size_t idx = findConnection(c);
-                if (idx != SIZE_MAX)
-                {
-                    ++polling_;
-                    c->wait_later_for_transaction();
-                    while (1)
-                    {
-                        for (size_t i = 0; i < async_connections_.size(); ++i)
-                        {
-                            if (async_connections_[i].c == c && !c->inTransaction())
-                            {
-                                --polling_;
-                                return;
-                            }
-                            async_connections_[i].c->poll();
-                            processEvents();
-                        }
-                    }
-                }
-            }
-
+            void wait_for_transaction_event_loop(ConnectionPtr c, T processEvents) {c->wait_later_for_transaction(); wait_event_loop(c, InTransaction(), processEvents, true);}
             template<typename T>
-            void wait_for_disconnect_event_loop(ConnectionPtr c, T processEvents)
-            {
-                size_t idx = findConnection(c);
-                if (idx != SIZE_MAX)
-                {
-                    ++polling_;
-                    c->wait_later_for_disconnect();
-                    while (1)
-                    {
-                        for (size_t i = 0; i < async_connections_.size(); ++i)
-                        {
-                            if (async_connections_[i].c == c && c->disconnected())
-                            {
-                                --polling_;
-                                return;
-                            }
-                            async_connections_[i].c->poll();
-                            processEvents();
-                        }
-                    }
-                }
-            }
+            void wait_for_disconnect_event_loop(ConnectionPtr c, T processEvents) {c->wait_later_for_disconnect(); wait_event_loop(c, Connected(), processEvents, true);}
+
+            const boost::posix_time::time_duration &eventLoopInterval() const {return event_loop_interval_;}
+            void setEventLoopInterval(const boost::posix_time::time_duration &interval) {event_loop_interval_ = interval;}
 
             void poll()
             {
                 if (!polling_)
                 {
                     ++polling_;
-                    for (size_t i = 0; i < async_connections_.size(); ++i)
-                        async_connections_[i].c->poll();
+                    for (ConnectionPtr c: connectionList())
+                        c->poll();
                     --polling_;
                 }
             }
 
             void stop()
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    async_connections_[i].c->stop();
+                for (ConnectionPtr c: connectionList())
+                    c->stop();
             }
 
             size_t polling() const {return polling_;}
 
+            std::shared_ptr<IoServicePool> pool() const {return pool_;}
+
 #ifdef ENABLE_SSL
             std::shared_ptr<boost::asio::ssl::context> sslContext() {return ctx;}
             void setSslContext(std::shared_ptr<boost::asio::ssl::context> context = std::shared_ptr<boost::asio::ssl::context>())
             {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
                 ctx = context;
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    async_connections_[i].c->setSslContext(ctx);
+                for (ConnectionMap::iterator it = connections_.begin(); it != connections_.end(); ++it)
+                    it->second.c->setSslContext(ctx);
             }
 
             Connection::VerifyHandler verifyHandler() const {return verify_callback;}
@@ -3580,16 +4019,152 @@ namespace CppHttp
         private:
             static void null() {}
 
-            size_t findConnection(ConnectionPtr c)
+            // Conditions that wait_event_loop() waits to become false
+            struct Connecting {bool operator()(const Connection &c) const {return c.connecting();}};
+            struct InTransaction {bool operator()(const Connection &c) const {return c.inTransaction();}};
+            struct Connected {bool operator()(const Connection &c) const {return c.connected();}};
+
+            // Runs the connection until `waiting` returns false, or until no handler is left that could change it
+            template<typename Condition, typename T>
+            void wait_event_loop(ConnectionPtr c, Condition waiting, T processEvents, bool processing)
             {
-                for (size_t i = 0; i < async_connections_.size(); ++i)
-                    if (async_connections_[i].c == c)
-                        return i;
-                return SIZE_MAX;
+                if (!findConnection(c))
+                    return;
+
+                ++polling_;
+                while (true)
+                {
+                    {
+                        auto lock = c->lockHandlers();
+                        if (!waiting(*c) || c->pendingHandlers() == 0)
+                            break;
+                    }
+
+                    // Connections on a shared pool make progress on their own
+                    bool others = false;
+                    if (!pool_)
+                    {
+                        for (ConnectionPtr other: connectionList())
+                        {
+                            if (other != c && other->pendingHandlers() != 0)
+                            {
+                                other->poll();
+                                others = true;
+                            }
+                        }
+                    }
+
+                    if (processing)
+                    {
+                        processEvents();
+                        c->run_one_for(event_loop_interval_);
+                    }
+                    else if (others)
+                        c->run_one_for(event_loop_interval_);
+                    else
+                        c->run_one();
+                }
+                --polling_;
+            }
+
+            bool findConnection(ConnectionPtr c) const
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                return connections_.find(c.get()) != connections_.end();
+            }
+
+            // Returns a copy of the connections, so they can be run without holding the manager locked
+            std::vector<ConnectionPtr> connectionList() const
+            {
+                std::lock_guard<std::recursive_mutex> lock(mutex_);
+                std::vector<ConnectionPtr> list;
+                list.reserve(connections_.size());
+                for (ConnectionMap::const_iterator it = connections_.begin(); it != connections_.end(); ++it)
+                    list.push_back(it->second.c);
+                return list;
+            }
+
+            // Returns the pool of a URL, e.g. "http://localhost:5984", with the default port filled in
+            static std::string poolKey(const Uri &url)
+            {
+                std::string scheme = boost::to_lower_copy(url.scheme());
+                int port = url.port();
+                if (port < 0)
+                    port = scheme == "https"? 443: scheme == "http"? 80: -1;
+                return scheme + "://" + boost::to_lower_copy(url.host()) + ":" + boost::lexical_cast<std::string>(port);
+            }
+
+            // Creates and registers a new connection in a pool, the manager must be locked
+            ConnectionPtr create(const std::string &key)
+            {
+                ConnectionPtr connection = pool_? std::make_shared<Connection>(pool_): std::make_shared<Connection>();
+#ifdef ENABLE_SSL
+                connection->setSslContext(ctx);
+                connection->setVerifyHandler(verify_callback);
+#endif
+                connection->setDestructorHandler(boost::bind(&ConnectionManager::destructor_handler, this, _1));
+
+                ConnectionObject object(connection);
+                object.key = key;
+                connections_.insert(std::make_pair(connection.get(), object));
+                if (!key.empty())
+                    ++hosts_[key].size;
+                return connection;
+            }
+
+            // Removes a connection from its pool's bookkeeping, the manager must be locked
+            void release(ConnectionMap::iterator it)
+            {
+                if (it->second.key.empty())
+                    return;
+
+                HostPool &host = hosts_[it->second.key];
+                if (it->second.free)
+                    host.idle.erase(it->second.idle);
+                --host.size;
+                it->second.free = false;
+            }
+
+            // Disconnects a connection and stops managing it, the manager must be locked
+            // The connection is destroyed once its last user lets go of it
+            void drop(ConnectionMap::iterator it)
+            {
+                ConnectionPtr c = it->second.c;
+                Connection::DestructorHandler destructor = it->second.destructor;
+                release(it);
+                connections_.erase(it);
+
+                auto lock = c->lockHandlers();
+                c->setDestructorHandler(destructor);
+                c->disconnectImmediately();
+                freed_.notify_all();
+            }
+
+            // Drops the connections of a pool that have been idle for too long, the manager must be locked
+            void evict(HostPool &host, std::chrono::steady_clock::time_point now)
+            {
+                if (idle_timeout_.is_special())
+                    return;
+
+                std::chrono::microseconds timeout(idle_timeout_.total_microseconds());
+                while (!host.idle.empty())
+                {
+                    ConnectionMap::iterator it = connections_.find(host.idle.back().get());
+                    if (now - it->second.freed < timeout)
+                        break;
+                    drop(it);
+                }
             }
 
-            size_t polling_;
-            std::vector<ConnectionObject> async_connections_;
+            mutable std::recursive_mutex mutex_;
+            std::condition_variable_any freed_; // Notified when a connection is freed or dropped
+            std::atomic<size_t> polling_;
+            boost::posix_time::time_duration event_loop_interval_;
+            boost::posix_time::time_duration idle_timeout_; // Protected by mutex_
+            size_t max_per_host_; // Protected by mutex_
+            std::shared_ptr<IoServicePool> pool_;
+            ConnectionMap connections_; // Protected by mutex_
+            std::unordered_map<std::string, HostPool> hosts_; // Protected by mutex_
 #ifdef ENABLE_SSL
             std::shared_ptr<boost::asio::ssl::context> ctx;
             Connection::VerifyHandler verify_callback;
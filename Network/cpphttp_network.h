@@ -60,10 +60,28 @@ namespace couchdb
         {
             if (!ec)
                 responses.push_back(response.body());
+            if (ready)
+                ready();
         }
 
+        // Called when the response ends or the connection is closed, so a waiter registered with notify_response_handle() wakes up
+        void end_response(CppHttp::Http::Connection &, const CppHttp::Http::Response &, const boost::system::error_code &)
+        {
+            if (ready)
+                ready();
+        }
+        void disconnected(CppHttp::Http::Connection &, const boost::system::error_code &)
+        {
+            if (ready)
+                ready();
+        }
+
+        asio_http_response_handle() : interrupted(false) {}
+
         std::shared_ptr<CppHttp::Http::Connection> connection;
         std::deque<std::string> responses;
+        bool interrupted; // Set by interrupt_response_handle(), protected by the connection's handler lock
+        std::function<void ()> ready; // Set by notify_response_handle(), protected by the connection's handler lock
     };
 
     template<bool allow_caching = true, bool blocking_response_handle = true>
@@ -72,6 +90,7 @@ namespace couchdb
                                                CppHttp::Http::Connection::TimeoutMode, /* Timeout mode */
                                                std::shared_ptr<asio_http_response_handle> /* Response handle */>
     {
+        // To run the connections on a fixed set of threads, pass a manager created with a shared CppHttp::Http::IoServicePool
         asio_http_impl(std::shared_ptr<CppHttp::Http::ConnectionManager> manager = std::make_shared<CppHttp::Http::ConnectionManager>())
             : client(manager) {}
 
@@ -81,7 +100,11 @@ namespace couchdb
 
         bool is_active_handle(response_handle_type handle) const
         {
-            return handle && handle->connection && handle->connection->connected() && handle->connection->success();
+            if (!handle || !handle->connection)
+                return false;
+
+            auto lock = handle->connection->lockHandlers();
+            return handle->connection->connected() && handle->connection->success();
         }
 
         bool is_response_handle_blocking() const {return blocking_response_handle;}
@@ -118,18 +141,31 @@ namespace couchdb
             request.setBody(data);
 
             auto connection = client->createConnection(request);
-            connection->setTimeout(timeout);
-            connection->setTimeoutMode(timeout_mode);
-            connection->setRequest(request, method);
-            if (connection->disconnected())
-                connection->connect();
-            else
-                connection->sendRequest();
+            {
+                // Connections on a shared pool may still be running a handler of their previous request
+                auto lock = connection->lockHandlers();
+                connection->setTimeout(timeout);
+                connection->setTimeoutMode(timeout_mode);
+                connection->setRequest(request, method);
+                if (connection->disconnected())
+                    connection->connect();
+                else
+                    connection->sendRequest();
+
+                // Wait for the transaction before unlocking, as a pooled connection may finish it before wait_for_transaction() is called
+                connection->wait_later_for_transaction();
+            }
             connection->wait_for_transaction();
-            client->freeConnection(connection);
 
-            CppHttp::Http::Response response = connection->response();
-            response_buffer = response.body();
+            // Take the response before the connection goes back to the pool, where another thread may reuse it
+            // The body is moved, not copied, all the way to the caller's buffer
+            CppHttp::Http::Response response;
+            {
+                auto lock = connection->lockHandlers();
+                response = std::move(connection->response());
+            }
+            client->freeConnection(connection);
+            response_buffer = std::move(response.body());
 
             int status = static_cast<int>(response.code());
             network_error = status / 100 != 2;
@@ -182,20 +218,41 @@ namespace couchdb
 
             auto connection = client->createConnection(request);
             response_handle->connection = connection;
-            connection->setTimeout(timeout);
-            connection->setTimeoutMode(timeout_mode);
-            connection->setPartialResponseHandler(boost::bind(&asio_http_response_handle::add_response, response_handle.get(), _1, _2, _3));
-            connection->setPartialResponseType(CppHttp::Http::Connection::ResponseLine);
-            connection->setRequest(request, method);
-            if (connection->disconnected())
-                connection->connect();
-            else
-                connection->sendRequest();
+            {
+                auto lock = connection->lockHandlers();
+                connection->setTimeout(timeout);
+                connection->setTimeoutMode(timeout_mode);
+                connection->setPartialResponseHandler(boost::bind(&asio_http_response_handle::add_response, response_handle.get(), _1, _2, _3));
+                connection->setPartialResponseType(CppHttp::Http::Connection::ResponseLine);
+                connection->setRequest(request, method);
+                if (connection->disconnected())
+                    connection->connect();
+                else
+                    connection->sendRequest();
+            }
 
-            while (connection->response().code() == CppHttp::Http::Invalid && connection->run_one())
-                ;
+            CppHttp::Http::Response response;
+            while (true)
+            {
+                {
+                    auto lock = connection->lockHandlers();
+                    if (connection->response().code() != CppHttp::Http::Invalid)
+                        break;
+                }
 
-            CppHttp::Http::Response response = connection->response();
+                if (!connection->run_one())
+                    break;
+            }
+
+            {
+                // The body only holds lines already passed to the handle, so leave it behind
+                auto lock = connection->lockHandlers();
+                const CppHttp::Http::Response &r = connection->response();
+                response.setCode(r.code());
+                response.setGroup(r.group());
+                response.setMessage(r.message());
+                response.setHeaders(r.headers());
+            }
 
             int status = static_cast<int>(response.code());
             network_error = status / 100 != 2;
@@ -223,17 +280,15 @@ namespace couchdb
             std::string line;
             if (handle && handle->connection)
             {
-                if (handle->connection->connected())
+                if (blocking_response_handle)
                 {
-                    if (blocking_response_handle)
-                    {
-                        while (handle->responses.empty() && handle->connection->run_one())
-                            ;
-                    }
-                    else
-                        handle->connection->poll();
+                    while (!has_response(handle) && handle->connection->run_one())
+                        ;
                 }
+                else if (!has_response(handle))
+                    handle->connection->poll();
 
+                auto lock = handle->connection->lockHandlers();
                 if (!handle->responses.empty())
                 {
                     line = handle->responses.front();
@@ -247,7 +302,89 @@ namespace couchdb
             return line;
         }
 
+        /* Wait until a line may be read from a response handle, or until the timeout elapses.
+         * The connection is run (or, on a shared pool, waited on) until a line arrives or the timeout expires, so no time is spent polling.
+         */
+        virtual bool wait_for_response_handle(response_handle_type handle, std::chrono::milliseconds timeout)
+        {
+            if (!handle || !handle->connection || has_response(handle))
+                return true;
+
+            std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+            for (std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now(); now < deadline; now = std::chrono::steady_clock::now())
+            {
+                boost::posix_time::time_duration remaining = boost::posix_time::microseconds(std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count());
+                if (!handle->connection->run_one_for(remaining) || has_response(handle))
+                    break;
+            }
+
+            return has_response(handle);
+        }
+
+        /* Release a response handle that is no longer needed.
+         * The connection is returned to the connection manager, and is disconnected first if the response was not completely read.
+         */
+        virtual void release_response_handle(response_handle_type handle)
+        {
+            if (!handle || !handle->connection)
+                return;
+
+            {
+                auto lock = handle->connection->lockHandlers();
+                handle->connection->setPartialResponseHandler(CppHttp::Http::Connection::ResponseHandler());
+                handle->connection->setPartialResponseType(CppHttp::Http::Connection::ResponseWhole);
+                if (handle->ready)
+                {
+                    handle->connection->setResponseHandler(CppHttp::Http::Connection::ResponseHandler());
+                    handle->connection->setDisconnectHandler(CppHttp::Http::Connection::DisconnectHandler());
+                    handle->ready = nullptr;
+                }
+                if (handle->connection->inTransaction() || handle->interrupted)
+                    handle->connection->disconnectImmediately();
+            }
+
+            client->freeConnection(handle->connection);
+            handle->connection.reset();
+            handle->responses.clear();
+        }
+
+        /* Wake up a thread blocked reading or waiting on a response handle.
+         * The connection is disconnected by one of its handlers, which the blocked thread runs (or, on a shared pool, waits for).
+         */
+        virtual void interrupt_response_handle(response_handle_type handle)
+        {
+            if (!handle || !handle->connection)
+                return;
+
+            auto lock = handle->connection->lockHandlers();
+            handle->interrupted = true;
+            handle->connection->disconnectAsync();
+        }
+
+        /* Register a function to call whenever a line, or the end of the response, becomes available on a response handle.
+         * This is only possible on a shared pool, whose threads run the connection. Other connections only make progress
+         * while a thread waits on them, so false is returned.
+         */
+        virtual bool notify_response_handle(response_handle_type handle, std::function<void ()> ready)
+        {
+            if (!handle || !handle->connection || !handle->connection->sharesIoService())
+                return false;
+
+            auto lock = handle->connection->lockHandlers();
+            handle->ready = ready;
+            handle->connection->setResponseHandler(boost::bind(&asio_http_response_handle::end_response, handle.get(), _1, _2, _3));
+            handle->connection->setDisconnectHandler(boost::bind(&asio_http_response_handle::disconnected, handle.get(), _1, _2));
+            return true;
+        }
+
     private:
+        // Returns true if a line is waiting on the handle, or if no more lines can arrive
+        static bool has_response(response_handle_type handle)
+        {
+            auto lock = handle->connection->lockHandlers();
+            return !handle->responses.empty() || !handle->connection->connected();
+        }
+
         std::shared_ptr<CppHttp::Http::ConnectionManager> client;
     };
 }
@@ -10,6 +10,8 @@
 #include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPSClientSession.h>
 #include <Poco/Net/NetException.h>
+#include <Poco/Net/Socket.h>
+#include <Poco/Timespan.h>
 
 #include <Poco/URI.h>
 
@@ -92,13 +94,13 @@ namespace couchdb
                                                std::istream * /* Response handle */>
     {
         poco_http_impl(std::shared_ptr<Poco::Net::HTTPClientSession> c = std::make_shared<Poco::Net::HTTPClientSession>(),
-                  std::shared_ptr<Poco::Net::HTTPSClientSession> s = std::make_shared<Poco::Net::HTTPSClientSession>()) : client(c), sclient(s) {}
+                  std::shared_ptr<Poco::Net::HTTPSClientSession> s = std::make_shared<Poco::Net::HTTPSClientSession>()) : client(c), sclient(s), active(NULL) {}
 
         typedef poco_http_impl type;
 
         response_handle_type invalid_handle() const {return NULL;}
 
-        bool is_active_handle(response_handle_type handle) const {return handle != NULL;}
+        bool is_active_handle(response_handle_type handle) const {return handle != NULL && handle->good();}
 
         bool is_response_handle_blocking() const {return true;}
 
@@ -290,6 +292,7 @@ namespace couchdb
 
                     Poco::Net::HTTPResponse response;
                     response_buffer = &sclient->receiveResponse(response);
+                    active = sclient.get();
 
                     int status = static_cast<int>(response.getStatus());
                     network_error = status / 100 != 2;
@@ -327,6 +330,7 @@ namespace couchdb
 
                     Poco::Net::HTTPResponse response;
                     response_buffer = &client->receiveResponse(response);
+                    active = client.get();
 
                     int status = static_cast<int>(response.getStatus());
                     network_error = status / 100 != 2;
@@ -360,9 +364,56 @@ namespace couchdb
             return line;
         }
 
+        /* Wait until a line may be read from a response handle, or until the timeout elapses.
+         * Data already buffered by the stream is checked first, then the session's socket is polled.
+         */
+        virtual bool wait_for_response_handle(response_handle_type handle, std::chrono::milliseconds timeout)
+        {
+            if (handle == invalid_handle() || !*handle || handle->rdbuf()->in_avail() > 0 || active == NULL)
+                return true;
+
+            try
+            {
+                return active->socket().poll(Poco::Timespan(static_cast<Poco::Timespan::TimeDiff>(timeout.count()) * 1000),
+                                             Poco::Net::Socket::SELECT_READ | Poco::Net::Socket::SELECT_ERROR);
+            }
+            catch (const Poco::Exception &)
+            {
+                return true;
+            }
+        }
+
+        /* Wake up a thread blocked reading or waiting on a response handle.
+         * The receiving side of the session's socket is shut down, so the blocked read ends as if the server closed the response.
+         */
+        virtual void interrupt_response_handle(response_handle_type handle)
+        {
+            if (handle == invalid_handle() || active == NULL)
+                return;
+
+            try
+            {
+                active->socket().shutdownReceive();
+            }
+            catch (const Poco::Exception &)
+            {
+            }
+        }
+
+        /* Release a response handle that is no longer needed.
+         * The session is reset unless the end of the response was reached, which is only known once a read hit it.
+         * The stream is not read here, as that would block on a response that is still open.
+         */
+        virtual void release_response_handle(response_handle_type handle)
+        {
+            if (handle != invalid_handle() && handle->good())
+                reset();
+        }
+
     private:
         std::shared_ptr<Poco::Net::HTTPClientSession> client;
         std::shared_ptr<Poco::Net::HTTPSClientSession> sclient;
+        Poco::Net::HTTPClientSession *active; // The session of the most recent response handle
     };
 }
 
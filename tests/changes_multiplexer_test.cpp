@@ -0,0 +1,266 @@
+/* Tests that changes_multiplexer can add, remove and stop feeds while its workers are running, both with a client
+ * that notifies when data arrives and with one whose feeds are polled.
+ *
+ * Uses an in-memory client, so no server is needed:
+ *
+ *     g++ -std=c++11 -I.. changes_multiplexer_test.cpp -lpthread && ./a.out
+ */
+
+#include "Couch/cppcouch.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <iostream>
+
+namespace
+{
+    // A URL that is only stored, as the client never connects anywhere
+    struct fake_url : public couchdb::http_url_base
+    {
+        fake_url() : port(0) {}
+
+        std::string to_string() const {return url;}
+        void from_string(const std::string &url) {this->url = url;}
+
+        std::string get_scheme() const {return "http";}
+        void set_scheme(const std::string &) {}
+        std::string get_username() const {return std::string();}
+        void set_username(const std::string &) {}
+        std::string get_password() const {return std::string();}
+        void set_password(const std::string &) {}
+        std::string get_host() const {return "localhost";}
+        void set_host(const std::string &) {}
+        unsigned short get_port() const {return port;}
+        void set_port(unsigned short port) {this->port = port;}
+        std::string get_path() const {return std::string();}
+        void set_path(const std::string &) {}
+        std::string get_query() const {return std::string();}
+        void set_query(const std::string &) {}
+        std::string get_fragment() const {return std::string();}
+        void set_fragment(const std::string &) {}
+        std::string get_authority() const {return std::string();}
+        void set_authority(const std::string &) {}
+
+        std::string url;
+        unsigned short port;
+    };
+
+    // A continuous feed whose lines are pushed by the test
+    struct fake_feed
+    {
+        fake_feed() : open(true) {}
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<std::string> lines;
+        bool open;
+        std::function<void ()> ready; // Called with the mutex held, like a network thread would
+
+        void push(const std::string &line)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                lines.push_back(line);
+                if (ready)
+                    ready();
+            }
+            changed.notify_all();
+        }
+
+        // Ends the response, as if the server closed it
+        void end()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                open = false;
+                if (ready)
+                    ready();
+            }
+            changed.notify_all();
+        }
+    };
+
+    std::mutex feeds_mutex;
+    std::vector<std::shared_ptr<fake_feed>> feeds; // Every feed opened so far, protected by feeds_mutex
+
+    // A client with non-blocking response handles, serving feeds from memory
+    struct fake_client : public couchdb::http_client_base<fake_url, int, int, std::shared_ptr<fake_feed>>
+    {
+        typedef fake_client type;
+
+        fake_client(bool notify = false) : notify(notify) {}
+
+        bool notify; // Whether notify_response_handle() is supported
+
+        bool allow_cached_responses() const {return false;}
+        response_handle_type invalid_handle() const {return response_handle_type();}
+        bool is_active_handle(response_handle_type handle) const
+        {
+            if (!handle)
+                return false;
+
+            std::lock_guard<std::mutex> lock(handle->mutex);
+            return handle->open;
+        }
+        bool is_response_handle_blocking() const {return false;}
+        void reset() {}
+
+        int operator()(const std::string &, int, int, std::map<std::string, std::string> &headers, const std::string &,
+                       const std::string &, std::string &response_buffer, bool &network_error, std::string &)
+        {
+            headers.clear();
+            response_buffer = "{}";
+            network_error = false;
+            return 200;
+        }
+
+        int get_response_handle(const std::string &, int, int, std::map<std::string, std::string> &headers, const std::string &,
+                                const std::string &, response_handle_type &response_buffer, bool &network_error, std::string &)
+        {
+            headers.clear();
+            response_buffer = std::make_shared<fake_feed>();
+            network_error = false;
+
+            std::lock_guard<std::mutex> lock(feeds_mutex);
+            feeds.push_back(response_buffer);
+            return 200;
+        }
+
+        std::string read_line_from_response_handle(response_handle_type handle)
+        {
+            std::lock_guard<std::mutex> lock(handle->mutex);
+            if (handle->lines.empty())
+                return std::string();
+
+            std::string line = handle->lines.front();
+            handle->lines.pop_front();
+            return line;
+        }
+
+        void release_response_handle(response_handle_type handle)
+        {
+            if (!handle)
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(handle->mutex);
+                handle->open = false;
+                handle->ready = nullptr;
+            }
+            handle->changed.notify_all();
+        }
+
+        bool notify_response_handle(response_handle_type handle, std::function<void ()> ready)
+        {
+            if (!notify)
+                return false;
+
+            std::lock_guard<std::mutex> lock(handle->mutex);
+            handle->ready = ready;
+            return true;
+        }
+
+        bool wait_for_response_handle(response_handle_type handle, std::chrono::milliseconds timeout)
+        {
+            std::unique_lock<std::mutex> lock(handle->mutex);
+            return handle->changed.wait_for(lock, timeout, [handle]{return !handle->lines.empty() || !handle->open;});
+        }
+    };
+
+    struct counting_signal : public couchdb::signal_base
+    {
+        counting_signal() : changes(0), opened(0), closed(0) {}
+
+        void changes_feed_opened() {++opened;}
+        void change_occured(const json::value &) {++changes;}
+        void changes_feed_closed() {++closed;}
+
+        std::atomic<int> changes, opened, closed;
+    };
+
+    int failures = 0;
+
+    void check(bool condition, const char *what)
+    {
+        if (!condition)
+        {
+            std::cerr << "FAILED: " << what << std::endl;
+            ++failures;
+        }
+    }
+
+    // Waits up to a second for a condition to become true
+    template<typename Condition>
+    bool eventually(Condition condition)
+    {
+        for (int i = 0; i < 1000 && !condition(); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return condition();
+    }
+
+    std::shared_ptr<fake_feed> feed(size_t index)
+    {
+        std::lock_guard<std::mutex> lock(feeds_mutex);
+        return feeds.at(index);
+    }
+
+    void run(bool notify)
+    {
+        {
+            std::lock_guard<std::mutex> lock(feeds_mutex);
+            feeds.clear();
+        }
+
+        couchdb::connection<fake_client> conn(fake_client(), "http://localhost:5984");
+        couchdb::changes_multiplexer<fake_client> mux(1, fake_client(notify));
+        counting_signal a, b;
+
+        mux.start();
+
+        couchdb::changes_multiplexer<fake_client>::feed_id first = mux.add(conn.get_db("a"), a);
+        feed(0)->push("{\"seq\":1,\"id\":\"doc\",\"changes\":[{\"rev\":\"1-a\"}]}");
+        check(eventually([&]{return a.changes == 1;}), "change delivered on the first feed");
+
+        // The worker is now servicing the first feed, and must not keep a second one from being added
+        couchdb::changes_multiplexer<fake_client>::feed_id second = mux.add(conn.get_db("b"), b);
+        check(mux.size() == 2, "second feed added while the worker is running");
+        feed(1)->push("{\"seq\":1,\"id\":\"doc\",\"changes\":[{\"rev\":\"1-b\"}]}");
+        check(eventually([&]{return b.changes == 1;}), "change delivered on the second feed");
+
+        check(mux.remove(first), "first feed removed while the worker is running");
+        check(!mux.remove(first), "first feed cannot be removed twice");
+        check(a.closed == 1, "first feed closed once");
+        check(!mux.is_active(first) && mux.is_active(second), "only the second feed is still active");
+
+        // A feed closed by the server is removed by its worker
+        feed(1)->end();
+        check(eventually([&]{return b.closed == 1;}), "feed closed by the server");
+        check(eventually([&]{return mux.size() == 0;}), "closed feed removed");
+
+        counting_signal c;
+        mux.add(conn.get_db("c"), c);
+        mux.stop();
+        check(c.opened == 1 && c.closed == 1, "stop() closes the remaining feed");
+        check(mux.size() == 0, "no feed left after stop()");
+    }
+}
+
+int main()
+{
+    // Give up instead of hanging if a worker keeps the multiplexer locked
+    std::thread([]
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(10));
+        std::cerr << "FAILED: timed out" << std::endl;
+        std::_Exit(1);
+    }).detach();
+
+    run(true);
+    run(false);
+
+    if (failures == 0)
+        std::cout << "OK" << std::endl;
+    return failures == 0? EXIT_SUCCESS: EXIT_FAILURE;
+}